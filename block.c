@@ -8018,6 +8018,8 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    /* The mapping changed without going through a write */
+    qatomic_inc(&c->bs->write_gen);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
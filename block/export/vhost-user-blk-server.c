@@ -17,6 +17,7 @@
 #include "vhost-user-blk-server.h"
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 #include "virtio-blk-handler.h"
 
@@ -28,8 +29,20 @@ typedef struct VuBlkReq {
     VuVirtqElement elem;
     VuServer *server;
     struct VuVirtq *vq;
+    size_t in_len;
+    QSLIST_ENTRY(VuBlkReq) next;
 } VuBlkReq;
 
+/* A virtqueue processed by its own IOThread */
+typedef struct {
+    VuServer *server;
+    IOThread *iothread;
+    QEMUBH *completion_bh;
+
+    /* Requests completed in the export's AioContext, accessed atomically */
+    QSLIST_HEAD(, VuBlkReq) completed;
+} VuBlkQueue;
+
 /* vhost user block device */
 typedef struct {
     BlockExport export;
@@ -37,16 +50,67 @@ typedef struct {
     VirtioBlkHandler handler;
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
+    uint16_t num_queues;
+    VuBlkQueue *queues; /* num_queues elements if queue-iothreads is set */
 } VuBlkExport;
 
+/*
+ * Push the requests completed by the block layer into the virtqueue and
+ * notify the guest once for the whole batch. Runs in the virtqueue's
+ * IOThread, which owns the virtqueue state.
+ */
+static void vu_blk_queue_completion_bh(void *opaque)
+{
+    VuBlkQueue *q = opaque;
+    VuServer *server = q->server;
+    VuDev *vu_dev = &server->vu_dev;
+    AioContext *ctx = iothread_get_aio_context(q->iothread);
+    QSLIST_HEAD(, VuBlkReq) reqs;
+    VuBlkReq *req;
+    VuVirtq *vq = NULL;
+    unsigned int n = 0;
+
+    QSLIST_MOVE_ATOMIC(&reqs, &q->completed);
+
+    aio_context_acquire(ctx);
+    while ((req = QSLIST_FIRST(&reqs))) {
+        QSLIST_REMOVE_HEAD(&reqs, next);
+        vq = req->vq;
+        vu_queue_push(vu_dev, vq, &req->elem, req->in_len);
+        free(req);
+        n++;
+    }
+    if (vq) {
+        vu_queue_notify(vu_dev, vq);
+    }
+    aio_context_release(ctx);
+
+    while (n--) {
+        vhost_user_server_unref(server);
+    }
+}
+
+/* Drops the server reference taken for @req */
 static void vu_blk_req_complete(VuBlkReq *req, size_t in_len)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuDev *vu_dev = &server->vu_dev;
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
+
+    if (vexp->queues) {
+        VuBlkQueue *q = &vexp->queues[req->vq - vu_dev->vq];
+
+        req->in_len = in_len;
+        QSLIST_INSERT_HEAD_ATOMIC(&q->completed, req, next);
+        qemu_bh_schedule(q->completion_bh);
+        return;
+    }
 
     vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
     vu_queue_notify(vu_dev, req->vq);
 
     free(req);
+    vhost_user_server_unref(server);
 }
 
 /* Called with server refcount increased, must decrease before returning */
@@ -72,7 +136,6 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
     }
 
     vu_blk_req_complete(req, in_len);
-    vhost_user_server_unref(server);
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
@@ -95,7 +158,12 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
 
         vhost_user_server_ref(server);
-        qemu_coroutine_enter(co);
+        if (server->ctx == qemu_get_current_aio_context()) {
+            qemu_coroutine_enter(co);
+        } else {
+            /* Submit from the BlockBackend's AioContext */
+            aio_co_schedule(server->ctx, co);
+        }
     }
 }
 
@@ -244,6 +312,75 @@ vu_blk_initialize_config(BlockDriverState *bs,
     config->max_write_zeroes_seg = cpu_to_le32(1);
 }
 
+/* Assign the virtqueues to the IOThreads round-robin */
+static bool vu_blk_init_queues(VuBlkExport *vexp, strList *iothreads,
+                               AioContext ***queue_ctx, Error **errp)
+{
+    g_autoptr(GPtrArray) list = g_ptr_array_new();
+    strList *node;
+    uint16_t i;
+
+    for (node = iothreads; node; node = node->next) {
+        IOThread *iothread = iothread_by_id(node->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread \"%s\" not found", node->value);
+            return false;
+        }
+        g_ptr_array_add(list, iothread);
+    }
+
+    vexp->queues = g_new0(VuBlkQueue, vexp->num_queues);
+    *queue_ctx = g_new(AioContext *, vexp->num_queues);
+
+    for (i = 0; i < vexp->num_queues; i++) {
+        VuBlkQueue *q = &vexp->queues[i];
+
+        q->server = &vexp->vu_server;
+        q->iothread = g_ptr_array_index(list, i % list->len);
+        object_ref(OBJECT(q->iothread));
+        q->completion_bh = aio_bh_new(iothread_get_aio_context(q->iothread),
+                                      vu_blk_queue_completion_bh, q);
+        QSLIST_INIT(&q->completed);
+        (*queue_ctx)[i] = iothread_get_aio_context(q->iothread);
+    }
+    return true;
+}
+
+static void vu_blk_free_queues(VuBlkExport *vexp)
+{
+    uint16_t i;
+
+    if (!vexp->queues) {
+        return;
+    }
+
+    for (i = 0; i < vexp->num_queues; i++) {
+        VuBlkQueue *q = &vexp->queues[i];
+        AioContext *ctx = iothread_get_aio_context(q->iothread);
+
+        /*
+         * Run the completion BH once more in the IOThread, so that requests
+         * it has not pushed yet are completed and a concurrent run of it
+         * has finished before it is deleted.  The caller holds the export's
+         * AioContext.
+         */
+        if (ctx != vexp->export.ctx) {
+            aio_context_acquire(ctx);
+        }
+        aio_wait_bh_oneshot(ctx, vu_blk_queue_completion_bh, q);
+        if (ctx != vexp->export.ctx) {
+            aio_context_release(ctx);
+        }
+
+        assert(QSLIST_EMPTY(&q->completed));
+        qemu_bh_delete(q->completion_bh);
+        object_unref(OBJECT(q->iothread));
+    }
+    g_free(vexp->queues);
+    vexp->queues = NULL;
+}
+
 static void vu_blk_exp_request_shutdown(BlockExport *exp)
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
@@ -256,6 +393,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
     BlockExportOptionsVhostUserBlk *vu_opts = &opts->u.vhost_user_blk;
+    g_autofree AioContext **queue_ctx = NULL;
     Error *local_err = NULL;
     uint64_t logical_block_size;
     uint16_t num_queues = VHOST_USER_BLK_NUM_QUEUES_DEFAULT;
@@ -281,6 +419,15 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         error_setg(errp, "num-queues must be greater than 0");
         return -EINVAL;
     }
+    vexp->num_queues = num_queues;
+
+    if (vu_opts->queue_iothreads &&
+        !vu_blk_init_queues(vexp, vu_opts->queue_iothreads, &queue_ctx,
+                            errp)) {
+        vu_blk_free_queues(vexp);
+        return -EINVAL;
+    }
+
     vexp->handler.blk = exp->blk;
     vexp->handler.serial = g_strdup("vhost_user_blk");
     vexp->handler.logical_block_size = logical_block_size;
@@ -293,10 +440,12 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 num_queues, queue_ctx, &vu_blk_iface,
+                                 errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
         g_free(vexp->handler.serial);
+        vu_blk_free_queues(vexp);
         return -EADDRNOTAVAIL;
     }
 
@@ -310,6 +459,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
     g_free(vexp->handler.serial);
+    vu_blk_free_queues(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
@@ -38,6 +38,7 @@
 #include "block/raw-aio.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
+#include "exec/memory.h" /* for ram_block_discard_disable() */
 
 #include "scsi/pr-manager.h"
 #include "scsi/constants.h"
@@ -157,12 +158,17 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool aio_fixed_buffers:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
     bool force_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+
+    /* Buffers passed to bdrv_register_buf(), as struct iovec */
+    GArray *fixed_bufs;
+
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -550,6 +556,12 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with the io_uring AIO backend "
+                    "(default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -630,6 +642,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
+    s->aio_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -730,6 +743,11 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
             goto fail;
         }
     }
+    if (s->aio_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #else
     if (s->use_linux_io_uring) {
         error_setg(errp, "aio=io_uring was specified, but is not supported "
@@ -796,6 +814,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+    if (s->aio_fixed_buffers) {
+        /* Registered buffers stay pinned, which RAM discard cannot cope with */
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "ram_block_discard_disable() failed");
+            goto fail;
+        }
+        s->fixed_bufs = g_array_new(false, false, sizeof(struct iovec));
+    }
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2192,6 +2220,108 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Register the buffers of @s with the io_uring ring of @ctx */
+static void raw_luring_register_bufs(BDRVRawState *s, AioContext *ctx)
+{
+    LuringState *aio = aio_get_linux_io_uring(ctx);
+    bool ok = true;
+    guint i;
+
+    for (i = 0; i < s->fixed_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->fixed_bufs, struct iovec, i);
+
+        ok &= luring_register_buf(aio, iov->iov_base, iov->iov_len);
+    }
+    if (!ok) {
+        warn_report_once("Could not register all buffers with io_uring, "
+                         "falling back to unregistered I/O for some requests");
+    }
+}
+
+/*
+ * Drop what @s registered with the io_uring ring of @ctx.  Must be called
+ * before s->fd is closed, because the ring keeps its own reference to the
+ * file.
+ */
+static void raw_luring_unregister(BDRVRawState *s, AioContext *ctx)
+{
+    LuringState *aio;
+    guint i;
+
+    if (!s->use_linux_io_uring) {
+        return;
+    }
+
+    aio = aio_get_linux_io_uring(ctx);
+    if (s->fd >= 0) {
+        luring_unregister_fd(aio, s->fd);
+    }
+    for (i = 0; s->fixed_bufs && i < s->fixed_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->fixed_bufs, struct iovec, i);
+
+        luring_unregister_buf(aio, iov->iov_base, iov->iov_len);
+    }
+}
+#endif
+
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    if (!s->aio_fixed_buffers) {
+        return true;
+    }
+
+    g_array_append_val(s->fixed_bufs, iov);
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring &&
+        !luring_register_buf(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                             host, size)) {
+        warn_report_once("Could not register all buffers with io_uring, "
+                         "falling back to unregistered I/O for some requests");
+    }
+#endif
+    /* Registration is only an optimization, never fail */
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    if (!s->aio_fixed_buffers) {
+        return;
+    }
+
+    for (i = 0; i < s->fixed_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->fixed_bufs, struct iovec, i);
+
+        if (iov->iov_base == host && iov->iov_len == size) {
+            g_array_remove_index_fast(s->fixed_bufs, i);
+#ifdef CONFIG_LINUX_IO_URING
+            if (s->use_linux_io_uring) {
+                luring_unregister_buf(
+                    aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                    host, size);
+            }
+#endif
+            return;
+        }
+    }
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(s, bdrv_get_aio_context(bs));
+#endif
+}
+
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
                                        AioContext *new_context)
 {
@@ -2215,6 +2345,9 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
             s->use_linux_io_uring = false;
         }
     }
+    if (s->use_linux_io_uring && s->fixed_bufs) {
+        raw_luring_register_bufs(s, new_context);
+    }
 #endif
 }
 
@@ -2222,6 +2355,14 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(s, bdrv_get_aio_context(bs));
+#endif
+    if (s->fixed_bufs) {
+        g_array_free(s->fixed_bufs, true);
+        s->fixed_bufs = NULL;
+        ram_block_discard_disable(false);
+    }
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3246,6 +3387,13 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_linux_io_uring) {
+            AioContext *ctx = bdrv_get_aio_context(bs);
+
+            luring_unregister_fd(aio_get_linux_io_uring(ctx), s->fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3346,6 +3494,9 @@ BlockDriver bdrv_file = {
     .bdrv_co_io_plug        = raw_co_io_plug,
     .bdrv_co_io_unplug      = raw_co_io_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
@@ -3718,6 +3869,9 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_io_plug        = raw_co_io_plug,
     .bdrv_co_io_unplug      = raw_co_io_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
@@ -3848,6 +4002,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_co_io_plug        = raw_co_io_plug,
     .bdrv_co_io_unplug      = raw_co_io_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
@@ -3976,6 +4133,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_co_io_plug        = raw_co_io_plug,
     .bdrv_co_io_unplug      = raw_co_io_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
 
     .bdrv_co_truncate                   = raw_co_truncate,
     .bdrv_co_getlength                  = raw_co_getlength,
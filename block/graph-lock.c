@@ -47,6 +47,12 @@ static uint32_t orphaned_reader_count;
 /* Queue of readers waiting for the writer to finish */
 static CoQueue reader_queue;
 
+/*
+ * Incremented whenever the writer lock is taken.  Only written by the writer
+ * and read by readers, so the lock itself serializes accesses.
+ */
+static uint64_t graph_generation;
+
 struct BdrvGraphRWlock {
     /* How many readers are currently reading the graph. */
     uint32_t reader_count;
@@ -138,6 +144,8 @@ void bdrv_graph_wrlock(void)
         smp_mb();
     } while (reader_count() >= 1);
 
+    graph_generation++;
+
     bdrv_drain_all_end();
 }
 
@@ -263,6 +271,11 @@ void bdrv_graph_rdunlock_main_loop(void)
     assert(!qemu_in_coroutine());
 }
 
+uint64_t bdrv_graph_generation(void)
+{
+    return graph_generation;
+}
+
 void assert_bdrv_graph_readable(void)
 {
     assert(qemu_in_main_thread() || reader_count());
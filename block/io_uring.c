@@ -12,14 +12,30 @@
 #include <liburing.h>
 #include "block/aio.h"
 #include "qemu/queue.h"
+#include "qemu/units.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
 #include "trace.h"
 
-/* io_uring ring size */
-#define MAX_ENTRIES 128
+/* Default io_uring ring size */
+#define DEFAULT_ENTRIES 128
+
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/* Number of slots in the registered file and buffer tables */
+#define MAX_FIXED_FILES 64
+#define MAX_FIXED_BUFS 1024
+
+/* The kernel does not register buffers larger than this */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
+typedef struct LuringFixedBuf {
+    void *host;             /* NULL for free slots */
+    size_t size;
+    unsigned refcnt;        /* number of luring_register_buf() users */
+} LuringFixedBuf;
+#endif
 
 typedef struct LuringAIOCB {
     Coroutine *co;
@@ -49,10 +65,30 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    unsigned entries;
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    /*
+     * Registered files and buffers, used in place of the plain fd and iovec
+     * when possible.  Protected by AioContext lock.
+     */
+    bool has_fixed_files;
+    int fixed_files[MAX_FIXED_FILES];       /* -1 for free slots */
+    GHashTable *fixed_file_slots;           /* fd -> slot + 1 */
+
+    bool has_fixed_bufs;
+    LuringFixedBuf fixed_bufs[MAX_FIXED_BUFS];
+    /*
+     * MAX_FIXED_BUF_SIZE aligned window of the address space -> GSList of
+     * the slots of the buffers that overlap it.  Each buffer overlaps at
+     * most two windows.
+     */
+    GHashTable *fixed_buf_windows;
+#endif
+
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
 } LuringState;
@@ -87,6 +123,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* Fixed buffer reads have a single contiguous buffer */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -323,6 +368,306 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/* Returns the registered file slot for @fd, registering it if needed */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->has_fixed_files) {
+        return -1;
+    }
+
+    i = GPOINTER_TO_INT(g_hash_table_lookup(s->fixed_file_slots,
+                                            GINT_TO_POINTER(fd)));
+    if (i) {
+        return i - 1;
+    }
+
+    /* Only the first request for @fd looks for a free slot */
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_files[i] == -1) {
+            break;
+        }
+    }
+
+    if (i == MAX_FIXED_FILES ||
+        io_uring_register_files_update(&s->ring, i, &fd, 1) != 1) {
+        return -1;
+    }
+
+    trace_luring_register_file(s, fd, i);
+    s->fixed_files[i] = fd;
+    g_hash_table_insert(s->fixed_file_slots, GINT_TO_POINTER(fd),
+                        GINT_TO_POINTER(i + 1));
+    return i;
+}
+
+static gpointer luring_fixed_buf_window(uintptr_t addr)
+{
+    return (gpointer)(uintptr_t)(addr / MAX_FIXED_BUF_SIZE);
+}
+
+/* Add or remove @slot in the index of the windows that its buffer overlaps */
+static void luring_fixed_buf_index(LuringState *s, unsigned slot, bool add)
+{
+    LuringFixedBuf *b = &s->fixed_bufs[slot];
+    uintptr_t addr = (uintptr_t)b->host;
+    uintptr_t last = addr + b->size - 1;
+
+    for (;;) {
+        gpointer window = luring_fixed_buf_window(addr);
+        GSList *slots = g_hash_table_lookup(s->fixed_buf_windows, window);
+
+        if (add) {
+            slots = g_slist_prepend(slots, GUINT_TO_POINTER(slot));
+        } else {
+            slots = g_slist_remove(slots, GUINT_TO_POINTER(slot));
+        }
+        if (slots) {
+            g_hash_table_insert(s->fixed_buf_windows, window, slots);
+        } else {
+            g_hash_table_remove(s->fixed_buf_windows, window);
+        }
+
+        if (window == luring_fixed_buf_window(last)) {
+            break;
+        }
+        addr = QEMU_ALIGN_UP(addr + 1, MAX_FIXED_BUF_SIZE);
+    }
+}
+
+/*
+ * Returns the registered buffer slot that contains [@buf, @buf + @len), or
+ * if @exact is true, the slot that was registered for exactly that range.
+ */
+static int luring_find_fixed_buf(LuringState *s, void *buf, size_t len,
+                                 bool exact)
+{
+    uintptr_t start = (uintptr_t)buf;
+    GSList *slots;
+
+    slots = g_hash_table_lookup(s->fixed_buf_windows,
+                                luring_fixed_buf_window(start));
+    for (; slots; slots = slots->next) {
+        unsigned i = GPOINTER_TO_UINT(slots->data);
+        LuringFixedBuf *b = &s->fixed_bufs[i];
+
+        if (exact ? b->host == buf && b->size == len :
+            start >= (uintptr_t)b->host &&
+            start - (uintptr_t)b->host + len <= b->size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int luring_fixed_buf(LuringState *s, void *buf, size_t len)
+{
+    if (!s->has_fixed_bufs) {
+        return -1;
+    }
+    return luring_find_fixed_buf(s, buf, len, false);
+}
+
+static bool luring_fixed_buf_update(LuringState *s, unsigned slot,
+                                    void *host, size_t size)
+{
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    return io_uring_register_buffers_update_tag(&s->ring, slot, &iov,
+                                                NULL, 1) == 1;
+}
+
+/* Registers [@host, @host + @len) in a free slot */
+static bool luring_add_fixed_buf(LuringState *s, void *host, size_t len)
+{
+    unsigned i;
+
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (!s->fixed_bufs[i].host) {
+            break;
+        }
+    }
+
+    if (i == MAX_FIXED_BUFS || !luring_fixed_buf_update(s, i, host, len)) {
+        return false;
+    }
+
+    trace_luring_register_buf(s, host, len, i);
+    s->fixed_bufs[i] = (LuringFixedBuf) {
+        .host = host,
+        .size = len,
+        .refcnt = 1,
+    };
+    luring_fixed_buf_index(s, i, true);
+    return true;
+}
+
+bool luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    bool ok = true;
+
+    if (!s->has_fixed_bufs) {
+        return false;
+    }
+
+    aio_context_acquire(s->aio_context);
+    while (size > 0 && ok) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+        int i = luring_find_fixed_buf(s, host, len, true);
+
+        if (i >= 0) {
+            s->fixed_bufs[i].refcnt++;
+        } else {
+            ok = luring_add_fixed_buf(s, host, len);
+        }
+
+        host += len;
+        size -= len;
+    }
+    aio_context_release(s->aio_context);
+    return ok;
+}
+
+void luring_unregister_buf(LuringState *s, void *host, size_t size)
+{
+    if (!s->has_fixed_bufs) {
+        return;
+    }
+
+    aio_context_acquire(s->aio_context);
+    while (size > 0) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+        int i = luring_find_fixed_buf(s, host, len, true);
+
+        if (i >= 0 && --s->fixed_bufs[i].refcnt == 0) {
+            trace_luring_unregister_buf(s, host, len, i);
+            luring_fixed_buf_update(s, i, NULL, 0);
+            luring_fixed_buf_index(s, i, false);
+            s->fixed_bufs[i] = (LuringFixedBuf) {};
+        }
+
+        host += len;
+        size -= len;
+    }
+    aio_context_release(s->aio_context);
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int unused = -1;
+    int i;
+
+    if (!s->has_fixed_files) {
+        return;
+    }
+
+    aio_context_acquire(s->aio_context);
+    i = GPOINTER_TO_INT(g_hash_table_lookup(s->fixed_file_slots,
+                                            GINT_TO_POINTER(fd))) - 1;
+    if (i >= 0) {
+        trace_luring_unregister_file(s, fd, i);
+        io_uring_register_files_update(&s->ring, i, &unused, 1);
+        s->fixed_files[i] = -1;
+        g_hash_table_remove(s->fixed_file_slots, GINT_TO_POINTER(fd));
+    }
+    aio_context_release(s->aio_context);
+}
+
+/*
+ * Use a registered buffer for single-buffer reads and writes, so the kernel
+ * does not need to pin the guest pages on every request.
+ */
+static bool luring_prep_rw_fixed(LuringState *s, struct io_uring_sqe *sqe,
+                                 int fd, QEMUIOVector *qiov, uint64_t offset,
+                                 bool is_write)
+{
+    void *buf;
+    size_t len;
+    int idx;
+
+    if (qiov->niov != 1) {
+        return false;
+    }
+
+    buf = qiov->iov[0].iov_base;
+    len = qiov->iov[0].iov_len;
+    idx = luring_fixed_buf(s, buf, len);
+    if (idx < 0) {
+        return false;
+    }
+
+    if (is_write) {
+        io_uring_prep_write_fixed(sqe, fd, buf, len, offset, idx);
+    } else {
+        io_uring_prep_read_fixed(sqe, fd, buf, len, offset, idx);
+    }
+    return true;
+}
+
+static void luring_init_fixed(LuringState *s)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        s->fixed_files[i] = -1;
+    }
+
+    s->fixed_file_slots = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->fixed_buf_windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    /* Older kernels do not support sparse tables; just do without them */
+    s->has_fixed_files =
+        io_uring_register_files_sparse(&s->ring, MAX_FIXED_FILES) == 0;
+    s->has_fixed_bufs =
+        io_uring_register_buffers_sparse(&s->ring, MAX_FIXED_BUFS) == 0;
+}
+
+static void luring_cleanup_fixed(LuringState *s)
+{
+    GHashTableIter iter;
+    gpointer slots;
+
+    g_hash_table_iter_init(&iter, s->fixed_buf_windows);
+    while (g_hash_table_iter_next(&iter, NULL, &slots)) {
+        g_slist_free(slots);
+    }
+    g_hash_table_destroy(s->fixed_buf_windows);
+    g_hash_table_destroy(s->fixed_file_slots);
+}
+#else
+bool luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    return false;
+}
+
+void luring_unregister_buf(LuringState *s, void *host, size_t size)
+{
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+}
+
+static inline int luring_fixed_file(LuringState *s, int fd)
+{
+    return -1;
+}
+
+static inline bool luring_prep_rw_fixed(LuringState *s,
+                                        struct io_uring_sqe *sqe, int fd,
+                                        QEMUIOVector *qiov, uint64_t offset,
+                                        bool is_write)
+{
+    return false;
+}
+
+static inline void luring_cleanup_fixed(LuringState *s)
+{
+}
+#endif /* HAVE_IO_URING_REGISTER_SPARSE */
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -338,16 +683,22 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
     int ret;
+    int fixed_file;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (!luring_prep_rw_fixed(s, sqes, fd, luringcb->qiov, offset, true)) {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (!luring_prep_rw_fixed(s, sqes, fd, luringcb->qiov, offset,
+                                  false)) {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -357,6 +708,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+
+    fixed_file = luring_fixed_file(s, fd);
+    if (fixed_file >= 0) {
+        sqes->fd = fixed_file;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -365,7 +722,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                            s->io_q.in_queue, s->io_q.in_flight);
     if (!s->io_q.blocked &&
         (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+         s->io_q.in_flight + s->io_q.in_queue >= s->entries)) {
         ret = ioq_submit(s);
         trace_luring_do_submit_done(s, ret);
         return ret;
@@ -414,21 +771,45 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned entries, unsigned sqpoll_idle,
+                          Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+#ifdef HAVE_IO_URING_SQPOLL
+    struct io_uring_params params = {};
+#endif
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    s->entries = entries ?: DEFAULT_ENTRIES;
+
+#ifdef HAVE_IO_URING_SQPOLL
+    if (sqpoll_idle) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = sqpoll_idle;
+    }
+    rc = io_uring_queue_init_params(s->entries, ring, &params);
+#else
+    if (sqpoll_idle) {
+        error_setg(errp, "io_uring submission queue polling is not supported "
+                   "in this build");
+        g_free(s);
+        return NULL;
+    }
+    rc = io_uring_queue_init(s->entries, ring, 0);
+#endif
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+    luring_init_fixed(s);
+#endif
+
     ioq_init(&s->io_q);
     return s;
 
@@ -436,6 +817,7 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    luring_cleanup_fixed(s);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
@@ -0,0 +1,444 @@
+/*
+ * Flattened backing chain mapping for the QCOW2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Reading an area that is unallocated in a qcow2 image normally recurses
+ * into the backing file, which looks up its own L2 tables and recurses again
+ * for whatever it does not have allocated either.  With long chains of qcow2
+ * images every such read pays one request and one metadata lookup per layer.
+ *
+ * The chain map caches, for the backing chain of one qcow2 node, which child
+ * each chunk of the guest address space must be read from in the end: the
+ * data file of the qcow2 layer that has the data allocated, nothing at all if
+ * the chunk reads as zeroes, or a backing child whose content cannot be
+ * mapped directly (compressed or encrypted data, other drivers).  The chunk
+ * size is the smallest subcluster size in the chain so that every chunk has a
+ * uniform mapping.
+ *
+ * Entries are filled lazily from the layers' L2 tables.  The whole map is
+ * dropped whenever the block graph changes or any of its layers is written
+ * to or emptied, which is rare because backing files are normally read-only
+ * (the main exceptions being block-commit, block-stream and replication).
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/aio_task.h"
+#include "qcow2.h"
+#include "trace.h"
+
+#define QCOW2_CHAIN_MAP_ENTRIES 16384
+
+typedef struct Qcow2ChainMapEntry {
+    uint64_t tag;       /* chunk index + 1, or 0 if the entry is unused */
+    uint64_t offset;    /* offset in @child of the start of the chunk */
+    BdrvChild *child;   /* NULL if the chunk reads as zeroes */
+} Qcow2ChainMapEntry;
+
+typedef struct Qcow2ChainLayer {
+    BlockDriverState *bs;
+    unsigned int write_gen;
+} Qcow2ChainLayer;
+
+struct Qcow2ChainMap {
+    Qcow2ChainMapEntry *entries;
+    int chunk_bits;
+
+    /*
+     * The layers the entries were computed from.  They are only compared by
+     * address while the graph generation is unchanged, as a node that was
+     * freed may be reallocated at the same address.
+     */
+    uint64_t graph_gen;
+    Qcow2ChainLayer *layers;
+    int nb_layers;
+};
+
+typedef struct Qcow2ChainMapTask {
+    AioTask task;
+
+    BdrvChild *child;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2ChainMapTask;
+
+void qcow2_chain_map_destroy(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->chain_map) {
+        g_free(s->chain_map->entries);
+        g_free(s->chain_map->layers);
+        g_free(s->chain_map);
+        s->chain_map = NULL;
+    }
+}
+
+/*
+ * The layers whose mapping is cached are the qcow2 nodes of the backing
+ * chain, and the first node of another driver if any.
+ */
+static BdrvChild * GRAPH_RDLOCK
+qcow2_chain_next(BlockDriverState *bs, BdrvChild *c)
+{
+    return c->bs->drv == bs->drv ? c->bs->backing : NULL;
+}
+
+static void GRAPH_RDLOCK
+qcow2_chain_map_reset(BlockDriverState *bs, Qcow2ChainMap *map)
+{
+    BdrvChild *c;
+    int i = 0;
+
+    map->nb_layers = 0;
+    for (c = bs->backing; c; c = qcow2_chain_next(bs, c)) {
+        map->nb_layers++;
+    }
+    map->layers = g_renew(Qcow2ChainLayer, map->layers, map->nb_layers);
+    map->graph_gen = bdrv_graph_generation();
+
+    map->chunk_bits = INT_MAX;
+    for (c = bs->backing; c; c = qcow2_chain_next(bs, c)) {
+        map->layers[i++] = (Qcow2ChainLayer) {
+            .bs         = c->bs,
+            .write_gen  = qatomic_read(&c->bs->write_gen),
+        };
+        if (c->bs->drv == bs->drv) {
+            BDRVQcow2State *ls = c->bs->opaque;
+            map->chunk_bits = MIN(map->chunk_bits, ls->subcluster_bits);
+        }
+    }
+    if (map->chunk_bits == INT_MAX) {
+        map->chunk_bits = BDRV_SECTOR_BITS;
+    }
+
+    memset(map->entries, 0,
+           QCOW2_CHAIN_MAP_ENTRIES * sizeof(Qcow2ChainMapEntry));
+
+    trace_qcow2_chain_map_reset(bs, map->nb_layers, map->chunk_bits);
+}
+
+/*
+ * Check that the backing chain is still the one the map was computed from,
+ * and drop all entries if it is not.  Returns false in the latter case.
+ */
+static bool GRAPH_RDLOCK
+qcow2_chain_map_check(BlockDriverState *bs, Qcow2ChainMap *map)
+{
+    BdrvChild *c;
+    int i = 0;
+
+    if (map->graph_gen != bdrv_graph_generation()) {
+        qcow2_chain_map_reset(bs, map);
+        return false;
+    }
+
+    for (c = bs->backing; c; c = qcow2_chain_next(bs, c)) {
+        if (i == map->nb_layers || map->layers[i].bs != c->bs ||
+            map->layers[i].write_gen != qatomic_read(&c->bs->write_gen))
+        {
+            break;
+        }
+        i++;
+    }
+
+    if (c || i != map->nb_layers) {
+        qcow2_chain_map_reset(bs, map);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Find out where the data at @offset in the backing chain of @bs comes from.
+ *
+ * On input, @bytes is the maximum number of bytes to map.  On output, it is
+ * the number of bytes that are read from @child at @target, or that read as
+ * zeroes if @child is NULL.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_chain_resolve(BlockDriverState *bs, uint64_t offset, unsigned int *bytes,
+                    BdrvChild **child, uint64_t *target)
+{
+    BdrvChild *c = bs->backing;
+
+    for (;;) {
+        BlockDriverState *layer = c->bs;
+        BDRVQcow2State *ls = layer->opaque;
+        uint64_t size = layer->total_sectors * BDRV_SECTOR_SIZE;
+        uint64_t host_offset;
+        QCow2SubclusterType type;
+        int ret;
+
+        if (offset >= size) {
+            *child = NULL;
+            return 0;
+        }
+        *bytes = MIN(*bytes, size - offset);
+
+        if (layer->drv != bs->drv || layer->encrypted) {
+            *child = c;
+            *target = offset;
+            return 0;
+        }
+
+        qemu_co_mutex_lock(&ls->lock);
+        ret = qcow2_get_host_offset(layer, offset, bytes, &host_offset, &type);
+        qemu_co_mutex_unlock(&ls->lock);
+        if (ret < 0) {
+            return ret;
+        }
+
+        switch (type) {
+        case QCOW2_SUBCLUSTER_NORMAL:
+            *child = ls->data_file;
+            *target = host_offset;
+            return 0;
+
+        case QCOW2_SUBCLUSTER_COMPRESSED:
+            *child = c;
+            *target = offset;
+            return 0;
+
+        case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+        case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+            *child = NULL;
+            return 0;
+
+        case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+            if (!layer->backing) {
+                *child = NULL;
+                return 0;
+            }
+            c = layer->backing;
+            break;
+
+        default:
+            g_assert_not_reached();
+        }
+    }
+}
+
+/*
+ * Compute the mapping of up to @nb_chunks chunks starting at @chunk, store it
+ * in the map and return the entry for @chunk in @entry.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_chain_map_fill(BlockDriverState *bs, Qcow2ChainMap *map, uint64_t chunk,
+                     uint64_t nb_chunks, Qcow2ChainMapEntry *entry)
+{
+    int chunk_bits = map->chunk_bits;
+    uint64_t chunk_size = 1ULL << chunk_bits;
+    uint64_t offset = chunk << chunk_bits;
+    unsigned int bytes;
+    BdrvChild *child;
+    uint64_t target = 0;
+    uint64_t i;
+    int ret;
+
+    nb_chunks = MIN(nb_chunks, QCOW2_CHAIN_MAP_ENTRIES);
+    bytes = MIN(nb_chunks << chunk_bits, QEMU_ALIGN_DOWN(INT_MAX, chunk_size));
+
+    ret = qcow2_chain_resolve(bs, offset, &bytes, &child, &target);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (bytes < chunk_size) {
+        /*
+         * The chunk straddles the end of a layer; let the backing file take
+         * care of it.
+         */
+        child = bs->backing;
+        target = offset;
+        bytes = chunk_size;
+    }
+
+    trace_qcow2_chain_map_fill(bs, offset, bytes, child, target);
+
+    *entry = (Qcow2ChainMapEntry) {
+        .tag    = chunk + 1,
+        .offset = target,
+        .child  = child,
+    };
+
+    /* Don't cache anything if the chain changed while we were looking */
+    if (!qcow2_chain_map_check(bs, map)) {
+        return 0;
+    }
+
+    for (i = 0; i < bytes >> chunk_bits; i++) {
+        map->entries[(chunk + i) % QCOW2_CHAIN_MAP_ENTRIES] =
+            (Qcow2ChainMapEntry) {
+                .tag    = chunk + i + 1,
+                .offset = child ? target + (i << chunk_bits) : 0,
+                .child  = child,
+            };
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_chain_map_read(BdrvChild *child, uint64_t offset, uint64_t bytes,
+                     QEMUIOVector *qiov, size_t qiov_offset)
+{
+    if (!child) {
+        qemu_iovec_memset(qiov, qiov_offset, 0, bytes);
+        return 0;
+    }
+
+    return bdrv_co_preadv_part(child, offset, bytes, qiov, qiov_offset, 0);
+}
+
+/*
+ * This function can count as GRAPH_RDLOCK because qcow2_co_preadv_backing()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_chain_map_read_task_entry(AioTask *task)
+{
+    Qcow2ChainMapTask *t = container_of(task, Qcow2ChainMapTask, task);
+
+    return qcow2_chain_map_read(t->child, t->offset, t->bytes,
+                                t->qiov, t->qiov_offset);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_chain_map_add_read(AioTaskPool *pool, BdrvChild *child,
+                         uint64_t offset, uint64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2ChainMapTask *task;
+
+    if (!pool) {
+        return qcow2_chain_map_read(child, offset, bytes, qiov, qiov_offset);
+    }
+
+    task = g_new(Qcow2ChainMapTask, 1);
+    *task = (Qcow2ChainMapTask) {
+        .task.func      = qcow2_chain_map_read_task_entry,
+        .child          = child,
+        .offset         = offset,
+        .bytes          = bytes,
+        .qiov           = qiov,
+        .qiov_offset    = qiov_offset,
+    };
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+/*
+ * Read an area that is unallocated in @bs itself from its backing chain.
+ * Each contiguous extent of the flattened chain is read with a single
+ * request.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_backing(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                        QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ChainMap *map = s->chain_map;
+    AioTaskPool *aio = NULL;
+    BdrvChild *run_child = NULL;
+    uint64_t run_offset = 0, run_bytes = 0;
+    size_t run_qiov_offset = 0;
+    int ret = 0;
+
+    if (bs->backing->bs->drv != bs->drv) {
+        return bdrv_co_preadv_part(bs->backing, offset, bytes,
+                                   qiov, qiov_offset, 0);
+    }
+
+    if (!map) {
+        map = s->chain_map = g_new0(Qcow2ChainMap, 1);
+        map->entries = g_new0(Qcow2ChainMapEntry, QCOW2_CHAIN_MAP_ENTRIES);
+    }
+    qcow2_chain_map_check(bs, map);
+
+    while (bytes != 0 && aio_task_pool_status(aio) == 0) {
+        int chunk_bits = map->chunk_bits;
+        uint64_t chunk = offset >> chunk_bits;
+        uint64_t offset_in_chunk = offset & ((1ULL << chunk_bits) - 1);
+        uint64_t cur_bytes = MIN(bytes, (1ULL << chunk_bits) - offset_in_chunk);
+        Qcow2ChainMapEntry entry;
+
+        entry = map->entries[chunk % QCOW2_CHAIN_MAP_ENTRIES];
+        if (entry.tag != chunk + 1) {
+            uint64_t end = offset + bytes;
+            uint64_t nb_chunks = DIV_ROUND_UP(end, 1ULL << chunk_bits) - chunk;
+
+            ret = qcow2_chain_map_fill(bs, map, chunk, nb_chunks, &entry);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+
+        if (run_bytes && entry.child == run_child &&
+            (!run_child || entry.offset + offset_in_chunk ==
+                           run_offset + run_bytes))
+        {
+            run_bytes += cur_bytes;
+        } else {
+            if (run_bytes) {
+                if (!aio) {
+                    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+                }
+                ret = qcow2_chain_map_add_read(aio, run_child, run_offset,
+                                               run_bytes, qiov,
+                                               run_qiov_offset);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            run_child = entry.child;
+            run_offset = entry.offset + offset_in_chunk;
+            run_bytes = cur_bytes;
+            run_qiov_offset = qiov_offset;
+        }
+
+        bytes -= cur_bytes;
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    if (run_bytes && aio_task_pool_status(aio) == 0) {
+        ret = qcow2_chain_map_add_read(aio, run_child, run_offset, run_bytes,
+                                       qiov, run_qiov_offset);
+    }
+
+out:
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        g_free(aio);
+    }
+
+    return ret;
+}
@@ -875,6 +875,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qatomic_inc(&bs->write_gen);
 
     if (ret < 0) {
         goto fail;
@@ -2290,8 +2290,7 @@ qcow2_co_preadv_task(BlockDriverState *bs, QCow2SubclusterType subc_type,
         assert(bs->backing); /* otherwise handled in qcow2_co_preadv_part */
 
         BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
-        return bdrv_co_preadv_part(bs->backing, offset, bytes,
-                                   qiov, qiov_offset, 0);
+        return qcow2_co_preadv_backing(bs, offset, bytes, qiov, qiov_offset);
 
     case QCOW2_SUBCLUSTER_COMPRESSED:
         return qcow2_co_preadv_compressed(bs, host_offset,
@@ -2751,6 +2750,7 @@ static void qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_chain_map_destroy(bs);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2823,6 +2823,9 @@ qcow2_co_invalidate_cache(BlockDriverState *bs, Error **errp)
     }
 
     s->crypto = crypto;
+
+    /* Make overlays drop whatever they cached about our mapping */
+    qatomic_inc(&bs->write_gen);
 }
 
 static size_t header_ext_add(char *buf, uint32_t magic, const void *s,
@@ -4591,84 +4594,219 @@ fail:
     return ret;
 }
 
-static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
-                                 uint64_t offset, uint64_t bytes,
-                                 QEMUIOVector *qiov, size_t qiov_offset)
+/*
+ * Compressed writes are done in three steps.  First all clusters of a batch
+ * are compressed in parallel.  Then host space and L2 entries for all of them
+ * are allocated in guest offset order within a single s->lock section, which
+ * packs the compressed data of consecutive clusters next to each other.
+ * Finally the compressed data is written with one request per run of
+ * contiguous host offsets.
+ */
+
+/* Upper bound of uncompressed data handled in one batch */
+#define QCOW2_COMPRESSED_BATCH_SIZE (4 * MiB)
+
+typedef struct Qcow2CompressedCluster {
+    uint64_t offset;        /* guest offset */
+    uint64_t bytes;         /* less than a cluster only at the end of image */
+    uint8_t *buf;           /* compressed data */
+    ssize_t len;            /* size of compressed data, -ENOMEM if none */
+    uint64_t host_offset;
+} Qcow2CompressedCluster;
+
+typedef struct Qcow2CompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    Qcow2CompressedCluster *cluster;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+} Qcow2CompressTask;
+
+static int coroutine_fn
+qcow2_co_compress_cluster(BlockDriverState *bs, Qcow2CompressedCluster *c,
+                          QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret;
-    ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
-
-    assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
-           (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
+    uint8_t *buf;
 
     buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes < s->cluster_size) {
+    if (c->bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+        memset(buf + c->bytes, 0, s->cluster_size - c->bytes);
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf, c->bytes);
+
+    c->buf = g_malloc(s->cluster_size);
+    c->len = qcow2_co_compress(bs, c->buf, s->cluster_size - 1,
+                               buf, s->cluster_size);
+    qemu_vfree(buf);
+
+    /* -ENOMEM means the cluster could not be compressed */
+    return c->len < 0 && c->len != -ENOMEM ? -EINVAL : 0;
+}
+
+static int coroutine_fn qcow2_co_compress_task_entry(AioTask *task)
+{
+    Qcow2CompressTask *t = container_of(task, Qcow2CompressTask, task);
 
-    out_buf = g_malloc(s->cluster_size);
+    return qcow2_co_compress_cluster(t->bs, t->cluster, t->qiov,
+                                     t->qiov_offset);
+}
 
-    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
-                                buf, s->cluster_size);
-    if (out_len == -ENOMEM) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+/*
+ * Allocate host space and L2 entries for the compressed clusters @c.  On
+ * failure, the clusters from the failing one onwards are marked as not to be
+ * written, so that the data of those allocated before can still be written.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_alloc_compressed_clusters(BlockDriverState *bs,
+                                Qcow2CompressedCluster *c, int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret = 0;
+    int i;
+
+    qemu_co_mutex_lock(&s->lock);
+    for (i = 0; i < nb_clusters; i++) {
+        if (c[i].len < 0) {
+            continue;
+        }
+
+        ret = qcow2_alloc_compressed_cluster_offset(bs, c[i].offset, c[i].len,
+                                                    &c[i].host_offset);
         if (ret < 0) {
-            goto fail;
+            break;
         }
-        goto success;
-    } else if (out_len < 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
 
-    qemu_co_mutex_lock(&s->lock);
-    ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
-    if (ret < 0) {
-        qemu_co_mutex_unlock(&s->lock);
-        goto fail;
+        ret = qcow2_pre_write_overlap_check(bs, 0, c[i].host_offset,
+                                            c[i].len, true);
+        if (ret < 0) {
+            break;
+        }
     }
-
-    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len, true);
     qemu_co_mutex_unlock(&s->lock);
-    if (ret < 0) {
-        goto fail;
+
+    for (; i < nb_clusters; i++) {
+        c[i].len = -ECANCELED;
     }
 
-    BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
-    ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
-    if (ret < 0) {
-        goto fail;
+    return ret;
+}
+
+/* Write the compressed data of @c, merging runs of contiguous host space */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_write_compressed_clusters(BlockDriverState *bs,
+                                   Qcow2CompressedCluster *c, int nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    QEMUIOVector qiov;
+    int ret = 0;
+    int i, j;
+
+    qemu_iovec_init(&qiov, nb_clusters);
+    for (i = 0; i < nb_clusters && ret >= 0; i = j) {
+        uint64_t end;
+
+        if (c[i].len < 0) {
+            j = i + 1;
+            continue;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, c[i].buf, c[i].len);
+        end = c[i].host_offset + c[i].len;
+        for (j = i + 1; j < nb_clusters; j++) {
+            if (c[j].len < 0 || c[j].host_offset != end) {
+                break;
+            }
+            qemu_iovec_add(&qiov, c[j].buf, c[j].len);
+            end += c[j].len;
+        }
+
+        BLKDBG_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
+        ret = bdrv_co_pwritev(s->data_file, c[i].host_offset, qiov.size,
+                              &qiov, 0);
     }
-success:
-    ret = 0;
-fail:
-    qemu_vfree(buf);
-    g_free(out_buf);
+    qemu_iovec_destroy(&qiov);
+
     return ret;
 }
 
-/*
- * This function can count as GRAPH_RDLOCK because
- * qcow2_co_pwritev_compressed_part() holds the graph lock and keeps it until
- * this coroutine has terminated.
- */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_pwritev_compressed_task_entry(AioTask *task)
+qcow2_co_pwritev_compressed_batch(BlockDriverState *bs,
+                                  uint64_t offset, uint64_t bytes,
+                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
-    Qcow2AioTask *t = container_of(task, Qcow2AioTask, task);
+    BDRVQcow2State *s = bs->opaque;
+    int nb_clusters = DIV_ROUND_UP(bytes, s->cluster_size);
+    g_autofree Qcow2CompressedCluster *c =
+        g_new0(Qcow2CompressedCluster, nb_clusters);
+    AioTaskPool *aio = NULL;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        c[i].offset = offset + (uint64_t)i * s->cluster_size;
+        c[i].bytes = MIN(bytes - (uint64_t)i * s->cluster_size,
+                         s->cluster_size);
+        c[i].len = -ENOMEM;
+    }
+
+    /* Compress */
+    if (nb_clusters == 1) {
+        ret = qcow2_co_compress_cluster(bs, &c[0], qiov, qiov_offset);
+    } else {
+        aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+        for (i = 0; i < nb_clusters && aio_task_pool_status(aio) == 0; i++) {
+            Qcow2CompressTask *t = g_new(Qcow2CompressTask, 1);
+
+            *t = (Qcow2CompressTask) {
+                .task.func = qcow2_co_compress_task_entry,
+                .bs = bs,
+                .cluster = &c[i],
+                .qiov = qiov,
+                .qiov_offset = qiov_offset + (c[i].offset - offset),
+            };
+            aio_task_pool_wait_slot(aio);
+            aio_task_pool_start_task(aio, &t->task);
+        }
+        aio_task_pool_wait_all(aio);
+        ret = aio_task_pool_status(aio);
+        g_free(aio);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Allocate and write the compressible clusters */
+    ret = qcow2_alloc_compressed_clusters(bs, c, nb_clusters);
+    if (ret < 0) {
+        qcow2_co_write_compressed_clusters(bs, c, nb_clusters);
+        goto out;
+    }
+    ret = qcow2_co_write_compressed_clusters(bs, c, nb_clusters);
+    if (ret < 0) {
+        goto out;
+    }
 
-    assert(!t->subcluster_type && !t->l2meta);
+    /* Could not compress: write normal clusters */
+    for (i = 0; i < nb_clusters; i++) {
+        if (c[i].len == -ENOMEM) {
+            ret = qcow2_co_pwritev_part(bs, c[i].offset, c[i].bytes, qiov,
+                                        qiov_offset + (c[i].offset - offset),
+                                        0);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+    }
 
-    return qcow2_co_pwritev_compressed_task(t->bs, t->offset, t->bytes, t->qiov,
-                                            t->qiov_offset);
+out:
+    for (i = 0; i < nb_clusters; i++) {
+        g_free(c[i].buf);
+    }
+    return ret;
 }
 
 /*
@@ -4681,7 +4819,7 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
                                  QEMUIOVector *qiov, size_t qiov_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    AioTaskPool *aio = NULL;
+    uint64_t batch_size = MAX(QCOW2_COMPRESSED_BATCH_SIZE, s->cluster_size);
     int ret = 0;
 
     if (has_data_file(bs)) {
@@ -4710,31 +4848,16 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    while (bytes && aio_task_pool_status(aio) == 0) {
-        uint64_t chunk_size = MIN(bytes, s->cluster_size);
-
-        if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-        }
+    while (bytes && ret == 0) {
+        uint64_t chunk_size = MIN(bytes, batch_size);
 
-        ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
-                             0, 0, offset, chunk_size, qiov, qiov_offset, NULL);
-        if (ret < 0) {
-            break;
-        }
+        ret = qcow2_co_pwritev_compressed_batch(bs, offset, chunk_size,
+                                                qiov, qiov_offset);
         qiov_offset += chunk_size;
         offset += chunk_size;
         bytes -= chunk_size;
     }
 
-    if (aio) {
-        aio_task_pool_wait_all(aio);
-        if (ret == 0) {
-            ret = aio_task_pool_status(aio);
-        }
-        g_free(aio);
-    }
-
     return ret;
 }
 
@@ -5163,6 +5286,7 @@ qcow2_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     bdi->is_dirty = s->incompatible_features & QCOW2_INCOMPAT_DIRTY;
+    bdi->can_compress_multiple_clusters = true;
     return 0;
 }
 
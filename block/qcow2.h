@@ -229,6 +229,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2ChainMap Qcow2ChainMap;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -419,6 +420,9 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /* Flattened mapping of the backing chain, allocated on first use */
+    Qcow2ChainMap *chain_map;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -985,6 +989,13 @@ void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+/* qcow2-chain-map.c functions */
+void qcow2_chain_map_destroy(BlockDriverState *bs);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_backing(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                        QEMUIOVector *qiov, size_t qiov_offset);
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
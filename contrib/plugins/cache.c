@@ -13,6 +13,15 @@
 
 #define STRTOLL(x) g_ascii_strtoll(x, NULL, 10)
 
+/* Upper bound of the associativity, a set's blocks are tracked in a bitmap */
+#define MAX_ASSOC 64
+
+/* Upper bound of cores sharing a coherent LLC, sharers are tracked in a bitmap */
+#define MAX_COHERENT_CORES 64
+
+/* Number of accesses buffered per vCPU thread before they are simulated */
+#define ACCESS_BATCH 256
+
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
 static enum qemu_plugin_mem_rw rw = QEMU_PLUGIN_MEM_RW;
@@ -20,7 +29,6 @@ static enum qemu_plugin_mem_rw rw = QEMU_PLUGIN_MEM_RW;
 static GHashTable *miss_ht;
 
 static GMutex hashtable_lock;
-static GRand *rng;
 
 static int limit;
 static bool sys;
@@ -53,16 +61,31 @@ enum EvictionPolicy policy;
  * The tag is compared against all the tags of a set to search for a match. If a
  * match is found, then the access is a hit.
  *
+ * The tags of a set are kept contiguous and the valid bits are packed into a
+ * bitmap, so that probing a set is a branch-free comparison over an array
+ * which the compiler is able to vectorise.
+ *
  * The CacheSet also contains bookkeaping information about eviction details.
  */
 
+/*
+ * Directory entry of a block in the shared last-level cache.
+ *
+ * The directory implements MESI from the point of view of the LLC: a block is
+ * either not held by any core (I), held read-only by the cores in @sharers
+ * (S), or held exclusively by @owner (E or M). Private caches upgrade E to M
+ * silently, so the directory does not distinguish the two states.
+ */
 typedef struct {
-    uint64_t tag;
-    bool valid;
-} CacheBlock;
+    uint64_t sharers;
+    int owner;
+} DirEntry;
 
 typedef struct {
-    CacheBlock *blocks;
+    uint64_t *tags;
+    uint64_t valid;
+    uint64_t writable;
+    DirEntry *dir;
     uint64_t *lru_priorities;
     uint64_t lru_gen_counter;
     GQueue *fifo_queue;
@@ -78,6 +101,7 @@ typedef struct {
     uint64_t tag_mask;
     uint64_t accesses;
     uint64_t misses;
+    GRand *rng;
 } Cache;
 
 typedef struct {
@@ -87,8 +111,48 @@ typedef struct {
     uint64_t l1_dmisses;
     uint64_t l1_imisses;
     uint64_t l2_misses;
+    uint64_t l3_misses;
 } InsnData;
 
+enum AccessKind {
+    ACCESS_IFETCH,
+    ACCESS_LOAD,
+    ACCESS_STORE,
+};
+
+typedef struct {
+    uint64_t addr;
+    InsnData *insn;
+    int core;
+    enum AccessKind kind;
+} MemAccess;
+
+/*
+ * Accesses are not simulated from the instrumentation callbacks. Each vCPU
+ * thread appends them to its own AccessBatch, which is simulated once full,
+ * so that locks (if any) are taken once per batch rather than once per
+ * access.
+ */
+typedef struct {
+    MemAccess entries[ACCESS_BATCH];
+    int n;
+} AccessBatch;
+
+/*
+ * A coherence message sent by the LLC directory to a core. It either
+ * invalidates the block holding @addr or downgrades it to the shared state.
+ */
+typedef struct {
+    uint64_t addr;
+    bool invalidate;
+} CoherenceMsg;
+
+typedef struct {
+    GMutex lock;
+    GArray *msgs;
+    int pending;
+} Mailbox;
+
 void (*update_hit)(Cache *cache, int set, int blk);
 void (*update_miss)(Cache *cache, int set, int blk);
 
@@ -101,9 +165,25 @@ static Cache **l1_dcaches, **l1_icaches;
 static bool use_l2;
 static Cache **l2_ucaches;
 
-static GMutex *l1_dcache_locks;
-static GMutex *l1_icache_locks;
-static GMutex *l2_ucache_locks;
+/*
+ * When every vCPU owns its private caches (the default for system
+ * emulation), they are only ever touched by the thread running that vCPU and
+ * need no locking. Otherwise several threads share them and the whole private
+ * hierarchy of a core is protected by its core lock.
+ */
+static bool shared_private_caches;
+static GMutex *core_locks;
+
+static bool use_l3;
+static Cache *l3_cache;
+static int l3_shards;
+static GMutex *l3_shard_locks;
+static Mailbox *mailboxes;
+
+static __thread AccessBatch *batch;
+static GPtrArray *batches;
+static GMutex batches_lock;
+static bool exiting;
 
 static uint64_t l1_dmem_accesses;
 static uint64_t l1_imem_accesses;
@@ -113,6 +193,14 @@ static uint64_t l1_dmisses;
 static uint64_t l2_mem_accesses;
 static uint64_t l2_misses;
 
+static uint64_t *l3_core_accesses;
+static uint64_t *l3_core_misses;
+static uint64_t *coherence_invals;
+
+static uint64_t l3_mem_accesses;
+static uint64_t l3_misses;
+static uint64_t coherence_total_invals;
+
 static int pow_of_two(int num)
 {
     g_assert((num & (num - 1)) == 0);
@@ -230,12 +318,19 @@ static inline uint64_t extract_set(Cache *cache, uint64_t addr)
     return (addr & cache->set_mask) >> cache->blksize_shift;
 }
 
+static inline uint64_t block_addr(Cache *cache, uint64_t set, int blk)
+{
+    return cache->sets[set].tags[blk] | (set << cache->blksize_shift);
+}
+
 static const char *cache_config_error(int blksize, int assoc, int cachesize)
 {
     if (cachesize % blksize != 0) {
         return "cache size must be divisible by block size";
     } else if (cachesize % (blksize * assoc) != 0) {
         return "cache size must be divisible by set size (assoc * block size)";
+    } else if (assoc > MAX_ASSOC) {
+        return "associativity must not exceed " G_STRINGIFY(MAX_ASSOC);
     } else {
         return NULL;
     }
@@ -243,7 +338,8 @@ static const char *cache_config_error(int blksize, int assoc, int cachesize)
 
 static bool bad_cache_params(int blksize, int assoc, int cachesize)
 {
-    return (cachesize % blksize) != 0 || (cachesize % (blksize * assoc) != 0);
+    return (cachesize % blksize) != 0 || (cachesize % (blksize * assoc) != 0) ||
+           assoc > MAX_ASSOC;
 }
 
 static Cache *cache_init(int blksize, int assoc, int cachesize)
@@ -262,13 +358,14 @@ static Cache *cache_init(int blksize, int assoc, int cachesize)
     cache->assoc = assoc;
     cache->cachesize = cachesize;
     cache->num_sets = cachesize / (blksize * assoc);
-    cache->sets = g_new(CacheSet, cache->num_sets);
+    cache->sets = g_new0(CacheSet, cache->num_sets);
     cache->blksize_shift = pow_of_two(blksize);
     cache->accesses = 0;
     cache->misses = 0;
+    cache->rng = policy == RAND ? g_rand_new() : NULL;
 
     for (i = 0; i < cache->num_sets; i++) {
-        cache->sets[i].blocks = g_new0(CacheBlock, assoc);
+        cache->sets[i].tags = g_new0(uint64_t, assoc);
     }
 
     blk_mask = blksize - 1;
@@ -300,24 +397,52 @@ static Cache **caches_init(int blksize, int assoc, int cachesize)
     return caches;
 }
 
-static int get_invalid_block(Cache *cache, uint64_t set)
+static Cache *llc_init(int blksize, int assoc, int cachesize)
 {
-    int i;
+    Cache *cache;
+    int i, j;
 
-    for (i = 0; i < cache->assoc; i++) {
-        if (!cache->sets[set].blocks[i].valid) {
-            return i;
+    if (bad_cache_params(blksize, assoc, cachesize)) {
+        return NULL;
+    }
+
+    cache = cache_init(blksize, assoc, cachesize);
+
+    /* Shards evict concurrently, use the thread-safe global generator */
+    if (cache->rng) {
+        g_rand_free(cache->rng);
+        cache->rng = NULL;
+    }
+
+    for (i = 0; i < cache->num_sets; i++) {
+        cache->sets[i].dir = g_new0(DirEntry, assoc);
+        for (j = 0; j < assoc; j++) {
+            cache->sets[i].dir[j].owner = -1;
         }
     }
 
-    return -1;
+    return cache;
+}
+
+static int get_invalid_block(Cache *cache, uint64_t set)
+{
+    uint64_t invalid = ~cache->sets[set].valid;
+
+    if (cache->assoc < MAX_ASSOC) {
+        invalid &= (1ULL << cache->assoc) - 1;
+    }
+
+    return invalid ? __builtin_ctzll(invalid) : -1;
 }
 
 static int get_replaced_block(Cache *cache, int set)
 {
     switch (policy) {
     case RAND:
-        return g_rand_int_range(rng, 0, cache->assoc);
+        if (!cache->rng) {
+            return g_random_int_range(0, cache->assoc);
+        }
+        return g_rand_int_range(cache->rng, 0, cache->assoc);
     case LRU:
         return lru_get_lru_block(cache, set);
     case FIFO:
@@ -330,30 +455,54 @@ static int get_replaced_block(Cache *cache, int set)
 static int in_cache(Cache *cache, uint64_t addr)
 {
     int i;
-    uint64_t tag, set;
+    uint64_t tag, set, match;
+    const uint64_t *tags;
 
     tag = extract_tag(cache, addr);
     set = extract_set(cache, addr);
+    tags = cache->sets[set].tags;
 
+    /*
+     * Compare against every way of the set without early exit, so that the
+     * loop can be vectorised, and then pick the first valid match.
+     */
+    match = 0;
     for (i = 0; i < cache->assoc; i++) {
-        if (cache->sets[set].blocks[i].tag == tag &&
-                cache->sets[set].blocks[i].valid) {
-            return i;
-        }
+        match |= (uint64_t) (tags[i] == tag) << i;
+    }
+    match &= cache->sets[set].valid;
+
+    return match ? __builtin_ctzll(match) : -1;
+}
+
+static void fill_block(Cache *cache, uint64_t set, int blk, uint64_t tag)
+{
+    if (update_miss) {
+        update_miss(cache, set, blk);
     }
 
-    return -1;
+    cache->sets[set].tags[blk] = tag;
+    cache->sets[set].valid |= 1ULL << blk;
+    cache->sets[set].writable &= ~(1ULL << blk);
+}
+
+static int find_victim(Cache *cache, uint64_t set)
+{
+    int blk = get_invalid_block(cache, set);
+
+    return blk == -1 ? get_replaced_block(cache, set) : blk;
 }
 
 /**
  * access_cache(): Simulate a cache access
  * @cache: The cache under simulation
  * @addr: The address of the requested memory location
+ * @blk: Set to the index of the block holding @addr after the access
  *
  * Returns true if the requsted data is hit in the cache and false when missed.
  * The cache is updated on miss for the next access.
  */
-static bool access_cache(Cache *cache, uint64_t addr)
+static bool access_cache(Cache *cache, uint64_t addr, int *blk)
 {
     int hit_blk, replaced_blk;
     uint64_t tag, set;
@@ -366,100 +515,335 @@ static bool access_cache(Cache *cache, uint64_t addr)
         if (update_hit) {
             update_hit(cache, set, hit_blk);
         }
+        *blk = hit_blk;
         return true;
     }
 
-    replaced_blk = get_invalid_block(cache, set);
+    replaced_blk = find_victim(cache, set);
+    fill_block(cache, set, replaced_blk, tag);
+    *blk = replaced_blk;
+
+    return false;
+}
+
+/*
+ * Drop the block holding @addr from @cache, or only revoke its write
+ * permission when @invalidate is false. Returns true if the block was cached.
+ */
+static bool revoke_block(Cache *cache, uint64_t addr, bool invalidate)
+{
+    uint64_t set = extract_set(cache, addr);
+    int blk = in_cache(cache, addr);
 
-    if (replaced_blk == -1) {
-        replaced_blk = get_replaced_block(cache, set);
+    if (blk == -1) {
+        return false;
     }
 
-    if (update_miss) {
-        update_miss(cache, set, replaced_blk);
+    cache->sets[set].writable &= ~(1ULL << blk);
+    if (invalidate) {
+        cache->sets[set].valid &= ~(1ULL << blk);
+        if (policy == FIFO) {
+            g_queue_remove(cache->sets[set].fifo_queue, GINT_TO_POINTER(blk));
+        }
     }
 
-    cache->sets[set].blocks[replaced_blk].tag = tag;
-    cache->sets[set].blocks[replaced_blk].valid = true;
+    return true;
+}
 
-    return false;
+static void post_coherence_msg(int core, uint64_t addr, bool invalidate)
+{
+    Mailbox *mb = &mailboxes[core];
+    CoherenceMsg msg = { .addr = addr, .invalidate = invalidate };
+
+    g_mutex_lock(&mb->lock);
+    g_array_append_val(mb->msgs, msg);
+    __atomic_store_n(&mb->pending, 1, __ATOMIC_RELEASE);
+    g_mutex_unlock(&mb->lock);
 }
 
-static void vcpu_mem_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info,
-                            uint64_t vaddr, void *userdata)
+/*
+ * Apply the coherence messages sent to @core since its last access. Called
+ * by the thread simulating @core, with the core lock held if needed.
+ */
+static void drain_coherence_msgs(int core)
 {
-    uint64_t effective_addr;
-    struct qemu_plugin_hwaddr *hwaddr;
-    int cache_idx;
-    InsnData *insn;
-    bool hit_in_l1;
+    Mailbox *mb = &mailboxes[core];
+    CoherenceMsg *msg;
+    bool hit;
+    int i;
 
-    hwaddr = qemu_plugin_get_hwaddr(info, vaddr);
-    if (hwaddr && qemu_plugin_hwaddr_is_io(hwaddr)) {
+    if (!__atomic_load_n(&mb->pending, __ATOMIC_ACQUIRE)) {
         return;
     }
 
-    effective_addr = hwaddr ? qemu_plugin_hwaddr_phys_addr(hwaddr) : vaddr;
-    cache_idx = vcpu_index % cores;
+    g_mutex_lock(&mb->lock);
+    for (i = 0; i < mb->msgs->len; i++) {
+        msg = &g_array_index(mb->msgs, CoherenceMsg, i);
+        hit = revoke_block(l1_dcaches[core], msg->addr, msg->invalidate);
+        if (msg->invalidate) {
+            hit |= revoke_block(l1_icaches[core], msg->addr, true);
+        }
+        if (use_l2) {
+            hit |= revoke_block(l2_ucaches[core], msg->addr, msg->invalidate);
+        }
+        if (hit && msg->invalidate) {
+            coherence_invals[core]++;
+        }
+    }
+    g_array_set_size(mb->msgs, 0);
+    __atomic_store_n(&mb->pending, 0, __ATOMIC_RELAXED);
+    g_mutex_unlock(&mb->lock);
+}
+
+/*
+ * Invalidate the private copies of an LLC block that is about to be evicted,
+ * keeping the LLC inclusive of the private caches.
+ */
+static void llc_back_invalidate(uint64_t set, int blk)
+{
+    DirEntry *d = &l3_cache->sets[set].dir[blk];
+    uint64_t addr = block_addr(l3_cache, set, blk);
+    uint64_t sharers = d->sharers;
+
+    while (sharers) {
+        post_coherence_msg(__builtin_ctzll(sharers), addr, true);
+        sharers &= sharers - 1;
+    }
+
+    d->sharers = 0;
+    d->owner = -1;
+}
+
+/**
+ * llc_access(): Simulate an access to the shared last-level cache
+ * @core: The core issuing the access
+ * @addr: The address of the requested memory location
+ * @is_store: Whether @core requests the block for writing
+ * @insn: The instruction issuing the access
+ *
+ * Looks up the block in its LLC shard and updates the directory, sending
+ * invalidations or downgrades to the other cores holding the block.
+ *
+ * Returns true if @core now holds the block exclusively.
+ */
+static bool llc_access(int core, uint64_t addr, bool is_store, InsnData *insn)
+{
+    uint64_t tag, set, others;
+    GMutex *lock;
+    DirEntry *d;
+    bool exclusive;
+    int blk;
+
+    tag = extract_tag(l3_cache, addr);
+    set = extract_set(l3_cache, addr);
+    lock = &l3_shard_locks[set & (l3_shards - 1)];
+
+    g_mutex_lock(lock);
+
+    l3_core_accesses[core]++;
+    blk = in_cache(l3_cache, addr);
+    if (blk != -1) {
+        if (update_hit) {
+            update_hit(l3_cache, set, blk);
+        }
+    } else {
+        __atomic_fetch_add(&insn->l3_misses, 1, __ATOMIC_SEQ_CST);
+        l3_core_misses[core]++;
+
+        blk = find_victim(l3_cache, set);
+        if (l3_cache->sets[set].valid & (1ULL << blk)) {
+            llc_back_invalidate(set, blk);
+        }
+        fill_block(l3_cache, set, blk, tag);
+    }
+
+    d = &l3_cache->sets[set].dir[blk];
+    others = d->sharers & ~(1ULL << core);
+
+    if (is_store) {
+        while (others) {
+            post_coherence_msg(__builtin_ctzll(others), addr, true);
+            others &= others - 1;
+        }
+        d->sharers = 1ULL << core;
+        d->owner = core;
+    } else {
+        if (d->owner != -1 && d->owner != core) {
+            post_coherence_msg(d->owner, addr, false);
+            d->owner = -1;
+        }
+        d->sharers |= 1ULL << core;
+        if (d->sharers == 1ULL << core) {
+            d->owner = core;
+        }
+    }
+    exclusive = d->owner == core;
 
-    g_mutex_lock(&l1_dcache_locks[cache_idx]);
-    hit_in_l1 = access_cache(l1_dcaches[cache_idx], effective_addr);
-    if (!hit_in_l1) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l1_dmisses, 1, __ATOMIC_SEQ_CST);
-        l1_dcaches[cache_idx]->misses++;
+    g_mutex_unlock(lock);
+
+    return exclusive;
+}
+
+static void set_writable(Cache *cache, uint64_t addr, int blk, bool writable)
+{
+    CacheSet *set = &cache->sets[extract_set(cache, addr)];
+
+    if (writable) {
+        set->writable |= 1ULL << blk;
+    } else {
+        set->writable &= ~(1ULL << blk);
     }
-    l1_dcaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l1_dcache_locks[cache_idx]);
+}
 
-    if (hit_in_l1 || !use_l2) {
-        /* No need to access L2 */
+static inline bool is_writable(Cache *cache, uint64_t addr, int blk)
+{
+    return cache->sets[extract_set(cache, addr)].writable & (1ULL << blk);
+}
+
+/*
+ * Simulate an access of @core through its private hierarchy and, on a miss,
+ * the shared LLC. Stores to blocks that are not held exclusively are sent to
+ * the LLC directory as upgrade requests even when they hit.
+ */
+static void simulate_access(MemAccess *acc)
+{
+    Cache *l1, *l2;
+    int l1_blk, l2_blk = -1;
+    bool is_store = acc->kind == ACCESS_STORE;
+    bool exclusive;
+
+    if (acc->kind == ACCESS_IFETCH) {
+        l1 = l1_icaches[acc->core];
+    } else {
+        l1 = l1_dcaches[acc->core];
+    }
+    l2 = use_l2 ? l2_ucaches[acc->core] : NULL;
+
+    l1->accesses++;
+    if (access_cache(l1, acc->addr, &l1_blk)) {
+        if (is_store && use_l3 && !is_writable(l1, acc->addr, l1_blk)) {
+            llc_access(acc->core, acc->addr, true, acc->insn);
+            set_writable(l1, acc->addr, l1_blk, true);
+            if (l2 && (l2_blk = in_cache(l2, acc->addr)) != -1) {
+                set_writable(l2, acc->addr, l2_blk, true);
+            }
+        }
+        return;
+    }
+
+    l1->misses++;
+    if (acc->kind == ACCESS_IFETCH) {
+        __atomic_fetch_add(&acc->insn->l1_imisses, 1, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_fetch_add(&acc->insn->l1_dmisses, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (l2) {
+        l2->accesses++;
+        if (access_cache(l2, acc->addr, &l2_blk)) {
+            exclusive = is_writable(l2, acc->addr, l2_blk);
+            if (is_store && use_l3 && !exclusive) {
+                exclusive = llc_access(acc->core, acc->addr, true, acc->insn);
+                set_writable(l2, acc->addr, l2_blk, exclusive);
+            }
+            set_writable(l1, acc->addr, l1_blk, exclusive);
+            return;
+        }
+        l2->misses++;
+        __atomic_fetch_add(&acc->insn->l2_misses, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (!use_l3) {
         return;
     }
 
-    g_mutex_lock(&l2_ucache_locks[cache_idx]);
-    if (!access_cache(l2_ucaches[cache_idx], effective_addr)) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l2_misses, 1, __ATOMIC_SEQ_CST);
-        l2_ucaches[cache_idx]->misses++;
+    exclusive = llc_access(acc->core, acc->addr, is_store, acc->insn);
+    set_writable(l1, acc->addr, l1_blk, exclusive);
+    if (l2) {
+        set_writable(l2, acc->addr, l2_blk, exclusive);
     }
-    l2_ucaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l2_ucache_locks[cache_idx]);
 }
 
-static void vcpu_insn_exec(unsigned int vcpu_index, void *userdata)
+static void flush_batch(AccessBatch *b)
 {
-    uint64_t insn_addr;
-    InsnData *insn;
-    int cache_idx;
-    bool hit_in_l1;
+    int i, core = -1;
 
-    insn_addr = ((InsnData *) userdata)->addr;
+    for (i = 0; i < b->n; i++) {
+        MemAccess *acc = &b->entries[i];
 
-    cache_idx = vcpu_index % cores;
-    g_mutex_lock(&l1_icache_locks[cache_idx]);
-    hit_in_l1 = access_cache(l1_icaches[cache_idx], insn_addr);
-    if (!hit_in_l1) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l1_imisses, 1, __ATOMIC_SEQ_CST);
-        l1_icaches[cache_idx]->misses++;
+        if (acc->core != core) {
+            if (shared_private_caches && core != -1) {
+                g_mutex_unlock(&core_locks[core]);
+            }
+            core = acc->core;
+            if (shared_private_caches) {
+                g_mutex_lock(&core_locks[core]);
+            }
+        }
+
+        /* Other cores may have posted messages while this batch was running */
+        if (use_l3) {
+            drain_coherence_msgs(core);
+        }
+        simulate_access(acc);
+    }
+
+    if (shared_private_caches && core != -1) {
+        g_mutex_unlock(&core_locks[core]);
     }
-    l1_icaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l1_icache_locks[cache_idx]);
 
-    if (hit_in_l1 || !use_l2) {
-        /* No need to access L2 */
+    b->n = 0;
+}
+
+static void record_access(unsigned int vcpu_index, uint64_t addr,
+                          InsnData *insn, enum AccessKind kind)
+{
+    AccessBatch *b = batch;
+
+    if (__atomic_load_n(&exiting, __ATOMIC_RELAXED)) {
         return;
     }
 
-    g_mutex_lock(&l2_ucache_locks[cache_idx]);
-    if (!access_cache(l2_ucaches[cache_idx], insn_addr)) {
-        insn = userdata;
-        __atomic_fetch_add(&insn->l2_misses, 1, __ATOMIC_SEQ_CST);
-        l2_ucaches[cache_idx]->misses++;
+    if (!b) {
+        b = batch = g_new0(AccessBatch, 1);
+        g_mutex_lock(&batches_lock);
+        g_ptr_array_add(batches, b);
+        g_mutex_unlock(&batches_lock);
+    }
+
+    b->entries[b->n++] = (MemAccess) {
+        .addr = addr,
+        .insn = insn,
+        .core = vcpu_index % cores,
+        .kind = kind,
+    };
+
+    if (b->n == ACCESS_BATCH) {
+        flush_batch(b);
+    }
+}
+
+static void vcpu_mem_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info,
+                            uint64_t vaddr, void *userdata)
+{
+    uint64_t effective_addr;
+    struct qemu_plugin_hwaddr *hwaddr;
+
+    hwaddr = qemu_plugin_get_hwaddr(info, vaddr);
+    if (hwaddr && qemu_plugin_hwaddr_is_io(hwaddr)) {
+        return;
     }
-    l2_ucaches[cache_idx]->accesses++;
-    g_mutex_unlock(&l2_ucache_locks[cache_idx]);
+
+    effective_addr = hwaddr ? qemu_plugin_hwaddr_phys_addr(hwaddr) : vaddr;
+    record_access(vcpu_index, effective_addr, userdata,
+                  qemu_plugin_mem_is_store(info) ? ACCESS_STORE : ACCESS_LOAD);
+}
+
+static void vcpu_insn_exec(unsigned int vcpu_index, void *userdata)
+{
+    InsnData *insn = userdata;
+
+    record_access(vcpu_index, insn->addr, insn, ACCESS_IFETCH);
 }
 
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
@@ -515,13 +899,18 @@ static void insn_free(gpointer data)
 static void cache_free(Cache *cache)
 {
     for (int i = 0; i < cache->num_sets; i++) {
-        g_free(cache->sets[i].blocks);
+        g_free(cache->sets[i].tags);
+        g_free(cache->sets[i].dir);
     }
 
     if (metadata_destroy) {
         metadata_destroy(cache);
     }
 
+    if (cache->rng) {
+        g_rand_free(cache->rng);
+    }
+
     g_free(cache->sets);
     g_free(cache);
 }
@@ -538,9 +927,10 @@ static void caches_free(Cache **caches)
 static void append_stats_line(GString *line, uint64_t l1_daccess,
                               uint64_t l1_dmisses, uint64_t l1_iaccess,
                               uint64_t l1_imisses,  uint64_t l2_access,
-                              uint64_t l2_misses)
+                              uint64_t l2_misses, uint64_t l3_access,
+                              uint64_t l3_misses, uint64_t invals)
 {
-    double l1_dmiss_rate, l1_imiss_rate, l2_miss_rate;
+    double l1_dmiss_rate, l1_imiss_rate, l2_miss_rate, l3_miss_rate;
 
     l1_dmiss_rate = ((double) l1_dmisses) / (l1_daccess) * 100.0;
     l1_imiss_rate = ((double) l1_imisses) / (l1_iaccess) * 100.0;
@@ -562,6 +952,15 @@ static void append_stats_line(GString *line, uint64_t l1_daccess,
                                l2_access ? l2_miss_rate : 0.0);
     }
 
+    if (use_l3) {
+        l3_miss_rate =  ((double) l3_misses) / (l3_access) * 100.0;
+        g_string_append_printf(line, "  %-12lu %-11lu %10.4lf%%  %-12lu",
+                               l3_access,
+                               l3_misses,
+                               l3_access ? l3_miss_rate : 0.0,
+                               invals);
+    }
+
     g_string_append(line, "\n");
 }
 
@@ -580,6 +979,12 @@ static void sum_stats(void)
             l2_misses += l2_ucaches[i]->misses;
             l2_mem_accesses += l2_ucaches[i]->accesses;
         }
+
+        if (use_l3) {
+            l3_misses += l3_core_misses[i];
+            l3_mem_accesses += l3_core_accesses[i];
+            coherence_total_invals += coherence_invals[i];
+        }
     }
 }
 
@@ -607,6 +1012,14 @@ static int l2_cmp(gconstpointer a, gconstpointer b)
     return insn_a->l2_misses < insn_b->l2_misses ? 1 : -1;
 }
 
+static int l3_cmp(gconstpointer a, gconstpointer b)
+{
+    InsnData *insn_a = (InsnData *) a;
+    InsnData *insn_b = (InsnData *) b;
+
+    return insn_a->l3_misses < insn_b->l3_misses ? 1 : -1;
+}
+
 static void log_stats(void)
 {
     int i;
@@ -620,6 +1033,11 @@ static void log_stats(void)
         g_string_append(rep, ", l2 accesses, l2 misses, l2 miss rate");
     }
 
+    if (use_l3) {
+        g_string_append(rep, ", l3 accesses, l3 misses, l3 miss rate,"
+                        " invalidations");
+    }
+
     g_string_append(rep, "\n");
 
     for (i = 0; i < cores; i++) {
@@ -630,7 +1048,10 @@ static void log_stats(void)
         append_stats_line(rep, dcache->accesses, dcache->misses,
                 icache->accesses, icache->misses,
                 l2_cache ? l2_cache->accesses : 0,
-                l2_cache ? l2_cache->misses : 0);
+                l2_cache ? l2_cache->misses : 0,
+                use_l3 ? l3_core_accesses[i] : 0,
+                use_l3 ? l3_core_misses[i] : 0,
+                use_l3 ? coherence_invals[i] : 0);
     }
 
     if (cores > 1) {
@@ -638,7 +1059,8 @@ static void log_stats(void)
         g_string_append_printf(rep, "%-8s", "sum");
         append_stats_line(rep, l1_dmem_accesses, l1_dmisses,
                 l1_imem_accesses, l1_imisses,
-                l2_cache ? l2_mem_accesses : 0, l2_cache ? l2_misses : 0);
+                l2_cache ? l2_mem_accesses : 0, l2_cache ? l2_misses : 0,
+                l3_mem_accesses, l3_misses, coherence_total_invals);
     }
 
     g_string_append(rep, "\n");
@@ -680,7 +1102,7 @@ static void log_top_insns(void)
     }
 
     if (!use_l2) {
-        goto finish;
+        goto l3;
     }
 
     miss_insns = g_list_sort(miss_insns, l2_cmp);
@@ -696,27 +1118,87 @@ static void log_top_insns(void)
                                insn->disas_str);
     }
 
+l3:
+    if (!use_l3) {
+        goto finish;
+    }
+
+    miss_insns = g_list_sort(miss_insns, l3_cmp);
+    g_string_append_printf(rep, "%s", "\naddress, L3 misses, instruction\n");
+
+    for (curr = miss_insns, i = 0; curr && i < limit; i++, curr = curr->next) {
+        insn = (InsnData *) curr->data;
+        g_string_append_printf(rep, "0x%" PRIx64, insn->addr);
+        if (insn->symbol) {
+            g_string_append_printf(rep, " (%s)", insn->symbol);
+        }
+        g_string_append_printf(rep, ", %ld, %s\n", insn->l3_misses,
+                               insn->disas_str);
+    }
+
 finish:
     qemu_plugin_outs(rep->str);
     g_list_free(miss_insns);
 }
 
+static void flush_batches(void)
+{
+    int i;
+
+    g_mutex_lock(&batches_lock);
+    for (i = 0; i < batches->len; i++) {
+        flush_batch(g_ptr_array_index(batches, i));
+    }
+    g_mutex_unlock(&batches_lock);
+}
+
 static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
+    int i;
+
+    __atomic_store_n(&exiting, true, __ATOMIC_RELAXED);
+
+    /*
+     * System emulation stops the vCPUs before calling atexit callbacks.  In
+     * user mode other threads may still be running and filling their own
+     * batches, so only the batch of the exiting thread can be flushed.
+     */
+    if (sys) {
+        flush_batches();
+    } else if (batch) {
+        flush_batch(batch);
+    }
+
     log_stats();
     log_top_insns();
 
+    if (!sys) {
+        /* Other threads may still be simulating, keep their caches around */
+        return;
+    }
+
     caches_free(l1_dcaches);
     caches_free(l1_icaches);
 
-    g_free(l1_dcache_locks);
-    g_free(l1_icache_locks);
+    g_free(core_locks);
 
     if (use_l2) {
         caches_free(l2_ucaches);
-        g_free(l2_ucache_locks);
     }
 
+    if (use_l3) {
+        cache_free(l3_cache);
+        g_free(l3_shard_locks);
+        for (i = 0; i < cores; i++) {
+            g_array_free(mailboxes[i].msgs, true);
+        }
+        g_free(mailboxes);
+        g_free(l3_core_accesses);
+        g_free(l3_core_misses);
+        g_free(coherence_invals);
+    }
+
+    g_ptr_array_free(batches, true);
     g_hash_table_destroy(miss_ht);
 }
 
@@ -735,7 +1217,6 @@ static void policy_init(void)
         metadata_destroy = fifo_destroy;
         break;
     case RAND:
-        rng = g_rand_new();
         break;
     default:
         g_assert_not_reached();
@@ -750,6 +1231,7 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     int l1_iassoc, l1_iblksize, l1_icachesize;
     int l1_dassoc, l1_dblksize, l1_dcachesize;
     int l2_assoc, l2_blksize, l2_cachesize;
+    int l3_assoc, l3_blksize, l3_cachesize;
 
     limit = 32;
     sys = info->system_emulation;
@@ -766,6 +1248,11 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     l2_blksize = 64;
     l2_cachesize = l2_assoc * l2_blksize * 2048;
 
+    l3_assoc = 16;
+    l3_blksize = 64;
+    l3_cachesize = l3_assoc * l3_blksize * 8192;
+    l3_shards = 16;
+
     policy = LRU;
 
     cores = sys ? qemu_plugin_n_vcpus() : 1;
@@ -804,6 +1291,23 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
                 fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
                 return -1;
             }
+        } else if (g_strcmp0(tokens[0], "l3cachesize") == 0) {
+            use_l3 = true;
+            l3_cachesize = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3blksize") == 0) {
+            use_l3 = true;
+            l3_blksize = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3assoc") == 0) {
+            use_l3 = true;
+            l3_assoc = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3shards") == 0) {
+            use_l3 = true;
+            l3_shards = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "l3") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &use_l3)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
         } else if (g_strcmp0(tokens[0], "evict") == 0) {
             if (g_strcmp0(tokens[1], "rand") == 0) {
                 policy = RAND;
@@ -847,9 +1351,49 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
         return -1;
     }
 
-    l1_dcache_locks = g_new0(GMutex, cores);
-    l1_icache_locks = g_new0(GMutex, cores);
-    l2_ucache_locks = use_l2 ? g_new0(GMutex, cores) : NULL;
+    if (use_l3) {
+        if (cores > MAX_COHERENT_CORES) {
+            fprintf(stderr, "L3 cache supports at most %d cores\n",
+                    MAX_COHERENT_CORES);
+            return -1;
+        }
+
+        l3_cache = llc_init(l3_blksize, l3_assoc, l3_cachesize);
+        if (!l3_cache) {
+            const char *err = cache_config_error(l3_blksize, l3_assoc,
+                                                 l3_cachesize);
+            fprintf(stderr, "L3 cache cannot be constructed from given "
+                    "parameters\n");
+            fprintf(stderr, "%s\n", err);
+            return -1;
+        }
+
+        if (l3_shards <= 0 || (l3_shards & (l3_shards - 1)) != 0 ||
+            l3_shards > l3_cache->num_sets) {
+            fprintf(stderr, "L3 shards must be a power of two not exceeding "
+                    "the number of L3 sets\n");
+            return -1;
+        }
+
+        l3_shard_locks = g_new0(GMutex, l3_shards);
+        mailboxes = g_new0(Mailbox, cores);
+        for (i = 0; i < cores; i++) {
+            mailboxes[i].msgs = g_array_new(false, false, sizeof(CoherenceMsg));
+        }
+        l3_core_accesses = g_new0(uint64_t, cores);
+        l3_core_misses = g_new0(uint64_t, cores);
+        coherence_invals = g_new0(uint64_t, cores);
+    }
+
+    /*
+     * Each vCPU of a system emulation runs on at most one thread, so its
+     * caches are private unless several vCPUs were folded into one core.
+     * In user mode every guest thread maps onto the same cores.
+     */
+    shared_private_caches = !sys || cores < qemu_plugin_n_vcpus();
+    core_locks = g_new0(GMutex, cores);
+
+    batches = g_ptr_array_new_with_free_func(g_free);
 
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
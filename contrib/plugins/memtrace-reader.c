@@ -0,0 +1,340 @@
+/*
+ * Reader library for traces written by the memtrace plugin.
+ *
+ * It only depends on libc (and libzstd for compressed traces) so that it can
+ * be linked into external trace driven simulators.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "memtrace.h"
+
+struct MemTraceReader {
+    FILE *f;
+
+    MemTraceIndexEntry *index;
+    uint64_t n_chunks;
+    uint64_t n_records;
+
+    /* Currently decoded chunk */
+    MemTraceRecord *chunk;
+    size_t chunk_cap;
+    uint32_t chunk_len;
+    uint32_t chunk_pos;
+    uint64_t next_chunk;
+
+    void *stored;
+    size_t stored_cap;
+};
+
+static int read_exact(FILE *f, void *buf, size_t len)
+{
+    if (fread(buf, 1, len, f) != len) {
+        return ferror(f) ? -EIO : -ENODATA;
+    }
+    return 0;
+}
+
+static int reserve(void **buf, size_t *cap, size_t len)
+{
+    void *p;
+
+    if (len <= *cap) {
+        return 0;
+    }
+    p = realloc(*buf, len);
+    if (!p) {
+        return -ENOMEM;
+    }
+    *buf = p;
+    *cap = len;
+    return 0;
+}
+
+/* Load the index written when the trace was closed */
+static int load_index(MemTraceReader *r)
+{
+    MemTraceTrailer trailer;
+    int ret;
+
+    if (fseeko(r->f, -(off_t) sizeof(trailer), SEEK_END) < 0) {
+        return -errno;
+    }
+    ret = read_exact(r->f, &trailer, sizeof(trailer));
+    if (ret < 0) {
+        return ret;
+    }
+    if (trailer.magic != MEMTRACE_TRAILER_MAGIC) {
+        return -ENOENT;
+    }
+
+    r->index = calloc(trailer.n_chunks ? trailer.n_chunks : 1,
+                      sizeof(MemTraceIndexEntry));
+    if (!r->index) {
+        return -ENOMEM;
+    }
+    if (fseeko(r->f, trailer.index_offset, SEEK_SET) < 0) {
+        return -errno;
+    }
+    ret = read_exact(r->f, r->index,
+                     trailer.n_chunks * sizeof(MemTraceIndexEntry));
+    if (ret < 0) {
+        return ret;
+    }
+
+    r->n_chunks = trailer.n_chunks;
+    r->n_records = trailer.n_records;
+    return 0;
+}
+
+/*
+ * Rebuild the index of a trace that was not closed properly by walking the
+ * chunk headers. A truncated last chunk is ignored.
+ */
+static int scan_index(MemTraceReader *r)
+{
+    MemTraceChunkHeader hdr;
+    uint64_t cap = 0;
+    off_t offset = sizeof(MemTraceFileHeader);
+    off_t size;
+
+    if (fseeko(r->f, 0, SEEK_END) < 0 || (size = ftello(r->f)) < 0) {
+        return -errno;
+    }
+
+    free(r->index);
+    r->index = NULL;
+    r->n_chunks = 0;
+    r->n_records = 0;
+
+    for (;;) {
+        if (fseeko(r->f, offset, SEEK_SET) < 0) {
+            return -errno;
+        }
+        if (read_exact(r->f, &hdr, sizeof(hdr)) < 0 ||
+            hdr.magic != MEMTRACE_CHUNK_MAGIC) {
+            return 0;
+        }
+        if (offset + sizeof(hdr) + hdr.stored_size > size) {
+            return 0;
+        }
+
+        if (r->n_chunks == cap) {
+            void *p;
+
+            cap = cap ? cap * 2 : 64;
+            p = realloc(r->index, cap * sizeof(MemTraceIndexEntry));
+            if (!p) {
+                return -ENOMEM;
+            }
+            r->index = p;
+        }
+        r->index[r->n_chunks].offset = offset;
+        r->index[r->n_chunks].first_record = r->n_records;
+        r->n_chunks++;
+        r->n_records += hdr.n_records;
+
+        offset += sizeof(hdr) + hdr.stored_size;
+    }
+}
+
+static int load_chunk(MemTraceReader *r, uint64_t i)
+{
+    MemTraceChunkHeader hdr;
+    size_t raw_size;
+    int ret;
+
+    if (fseeko(r->f, r->index[i].offset, SEEK_SET) < 0) {
+        return -errno;
+    }
+    ret = read_exact(r->f, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+    if (hdr.magic != MEMTRACE_CHUNK_MAGIC) {
+        return -EINVAL;
+    }
+
+    raw_size = (size_t) hdr.n_records * sizeof(MemTraceRecord);
+    ret = reserve((void **) &r->chunk, &r->chunk_cap, raw_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    switch (hdr.codec) {
+    case MEMTRACE_CODEC_NONE:
+        if (hdr.stored_size != raw_size) {
+            return -EINVAL;
+        }
+        ret = read_exact(r->f, r->chunk, raw_size);
+        if (ret < 0) {
+            return ret;
+        }
+        break;
+#ifdef CONFIG_ZSTD
+    case MEMTRACE_CODEC_ZSTD: {
+        size_t len;
+
+        ret = reserve(&r->stored, &r->stored_cap, hdr.stored_size);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = read_exact(r->f, r->stored, hdr.stored_size);
+        if (ret < 0) {
+            return ret;
+        }
+        len = ZSTD_decompress(r->chunk, raw_size, r->stored, hdr.stored_size);
+        if (ZSTD_isError(len) || len != raw_size) {
+            return -EINVAL;
+        }
+        break;
+    }
+#endif
+    default:
+        return -ENOTSUP;
+    }
+
+    r->chunk_len = hdr.n_records;
+    r->chunk_pos = 0;
+    r->next_chunk = i + 1;
+    return 0;
+}
+
+MemTraceReader *memtrace_reader_open(const char *path)
+{
+    MemTraceFileHeader hdr;
+    MemTraceReader *r;
+    int ret;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+
+    r->f = fopen(path, "rb");
+    if (!r->f) {
+        ret = -errno;
+        goto fail;
+    }
+
+    ret = read_exact(r->f, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        goto fail;
+    }
+    if (memcmp(hdr.magic, MEMTRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != MEMTRACE_VERSION ||
+        hdr.record_size != sizeof(MemTraceRecord)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = load_index(r);
+    if (ret < 0) {
+        ret = scan_index(r);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    return r;
+
+fail:
+    memtrace_reader_close(r);
+    errno = -ret;
+    return NULL;
+}
+
+void memtrace_reader_close(MemTraceReader *r)
+{
+    if (r->f) {
+        fclose(r->f);
+    }
+    free(r->index);
+    free(r->chunk);
+    free(r->stored);
+    free(r);
+}
+
+uint64_t memtrace_reader_n_records(MemTraceReader *r)
+{
+    return r->n_records;
+}
+
+int memtrace_reader_seek(MemTraceReader *r, uint64_t record)
+{
+    uint64_t lo = 0, hi = r->n_chunks;
+    int ret;
+
+    if (record >= r->n_records) {
+        if (record > r->n_records) {
+            return -EINVAL;
+        }
+        r->chunk_len = r->chunk_pos = 0;
+        r->next_chunk = r->n_chunks;
+        return 0;
+    }
+
+    /* Find the last chunk starting at or before @record */
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (r->index[mid].first_record <= record) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    ret = load_chunk(r, lo);
+    if (ret < 0) {
+        return ret;
+    }
+    r->chunk_pos = record - r->index[lo].first_record;
+    return 0;
+}
+
+ssize_t memtrace_reader_read(MemTraceReader *r, MemTraceRecord *records,
+                             size_t n)
+{
+    size_t done = 0;
+    int ret;
+
+    while (done < n) {
+        size_t len;
+
+        if (r->chunk_pos == r->chunk_len) {
+            if (r->next_chunk >= r->n_chunks) {
+                break;
+            }
+            ret = load_chunk(r, r->next_chunk);
+            if (ret < 0) {
+                return done ? done : ret;
+            }
+            continue;
+        }
+
+        len = r->chunk_len - r->chunk_pos;
+        if (len > n - done) {
+            len = n - done;
+        }
+        memcpy(&records[done], &r->chunk[r->chunk_pos],
+               len * sizeof(MemTraceRecord));
+        r->chunk_pos += len;
+        done += len;
+    }
+
+    return done;
+}
@@ -0,0 +1,436 @@
+/*
+ * Binary memory access trace.
+ *
+ * Every guest memory access is recorded as a fixed size MemTraceRecord into
+ * a lock-free ring owned by the vCPU. A writer thread drains the rings into
+ * chunks which are optionally compressed with zstd and written to a seekable
+ * trace file, see memtrace.h for the format and the reader library.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include <inttypes.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <glib.h>
+
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include <qemu-plugin.h>
+
+#include "memtrace.h"
+
+#define STRTOLL(x) g_ascii_strtoll(x, NULL, 10)
+
+/* Upper bound of vCPUs traced in user mode, where there is no fixed count */
+#define USER_MAX_VCPUS 1024
+
+/* Time the writer thread sleeps when all rings are empty */
+#define WRITER_IDLE_US 100
+
+/* Time a vCPU waits for room in its full ring before dropping a record */
+#define PRODUCER_MAX_WAIT_US 10000
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+/*
+ * Single producer (the vCPU) single consumer (the writer thread) ring. @head
+ * and @tail are free running and only ever written by their owner, so they
+ * live on separate cache lines.
+ */
+typedef struct {
+    MemTraceRecord *buf;
+    uint32_t vcpu;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t stalls;
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+} TraceRing;
+
+static bool sys;
+static char *filename;
+static uint64_t ring_size = 1 << 16;
+static uint64_t chunk_records = 1 << 14;
+static bool compress;
+static int compress_level = 1;
+
+static int max_vcpus;
+static TraceRing **rings;
+
+static FILE *trace;
+static uint64_t trace_offset;
+static uint64_t trace_records;
+static uint64_t trace_bytes_raw;
+static GArray *trace_index;
+
+static MemTraceRecord *chunk_buf;
+static void *stored_buf;
+static size_t stored_cap;
+#ifdef CONFIG_ZSTD
+static ZSTD_CCtx *cctx;
+#endif
+
+static GThread *writer;
+static int stopping;
+static bool write_error;
+
+static void trace_write(const void *buf, size_t len)
+{
+    if (write_error) {
+        return;
+    }
+    if (fwrite(buf, 1, len, trace) != len) {
+        fprintf(stderr, "memtrace: failed to write %s: %s\n", filename,
+                strerror(errno));
+        write_error = true;
+        return;
+    }
+    trace_offset += len;
+}
+
+static void write_chunk(uint32_t n)
+{
+    MemTraceChunkHeader hdr = {
+        .magic = MEMTRACE_CHUNK_MAGIC,
+        .codec = MEMTRACE_CODEC_NONE,
+        .n_records = n,
+        .stored_size = n * sizeof(MemTraceRecord),
+        .first_record = trace_records,
+    };
+    MemTraceIndexEntry entry = {
+        .offset = trace_offset,
+        .first_record = trace_records,
+    };
+    const void *payload = chunk_buf;
+
+#ifdef CONFIG_ZSTD
+    if (compress) {
+        size_t ret = ZSTD_compressCCtx(cctx, stored_buf, stored_cap, chunk_buf,
+                                       hdr.stored_size, compress_level);
+        /* Incompressible chunks are stored as is */
+        if (!ZSTD_isError(ret) && ret < hdr.stored_size) {
+            hdr.codec = MEMTRACE_CODEC_ZSTD;
+            hdr.stored_size = ret;
+            payload = stored_buf;
+        }
+    }
+#endif
+
+    g_array_append_val(trace_index, entry);
+    trace_write(&hdr, sizeof(hdr));
+    trace_write(payload, hdr.stored_size);
+
+    trace_records += n;
+    trace_bytes_raw += n * sizeof(MemTraceRecord);
+}
+
+/*
+ * Move records of @ring into chunks. Unless @flush is set, only full chunks
+ * are written so that idle vCPUs do not produce tiny chunks.
+ *
+ * Returns true if anything was written.
+ */
+static bool drain_ring(TraceRing *ring, bool flush)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    bool progress = false;
+
+    while (head - tail >= chunk_records || (flush && head != tail)) {
+        uint64_t n = MIN(head - tail, chunk_records);
+        uint64_t start = tail & (ring_size - 1);
+        uint64_t first = MIN(n, ring_size - start);
+
+        memcpy(chunk_buf, &ring->buf[start], first * sizeof(MemTraceRecord));
+        memcpy(chunk_buf + first, ring->buf,
+               (n - first) * sizeof(MemTraceRecord));
+
+        /* Let the vCPU reuse the slots before spending time compressing */
+        tail += n;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        write_chunk(n);
+        progress = true;
+    }
+
+    return progress;
+}
+
+static bool drain_rings(bool flush)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < max_vcpus; i++) {
+        TraceRing *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+        if (ring) {
+            progress |= drain_ring(ring, flush);
+        }
+    }
+
+    return progress;
+}
+
+static gpointer writer_thread(gpointer opaque)
+{
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (!drain_rings(false)) {
+            g_usleep(WRITER_IDLE_US);
+        }
+    }
+
+    drain_rings(true);
+    return NULL;
+}
+
+static void vcpu_init(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    TraceRing *ring;
+
+    if (vcpu_index >= max_vcpus) {
+        fprintf(stderr, "memtrace: vCPU %u is not traced, at most %d vCPUs "
+                "are supported\n", vcpu_index, max_vcpus);
+        return;
+    }
+
+    /* Indices of exited threads are reused in user mode, as are their rings */
+    if (__atomic_load_n(&rings[vcpu_index], __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    ring = g_new0(TraceRing, 1);
+    ring->buf = g_new(MemTraceRecord, ring_size);
+    ring->vcpu = vcpu_index;
+    __atomic_store_n(&rings[vcpu_index], ring, __ATOMIC_RELEASE);
+}
+
+static void vcpu_mem(unsigned int vcpu_index, qemu_plugin_meminfo_t info,
+                     uint64_t vaddr, void *udata)
+{
+    struct qemu_plugin_hwaddr *hwaddr;
+    MemTraceRecord *rec;
+    TraceRing *ring;
+    uint64_t head;
+
+    if (vcpu_index >= max_vcpus) {
+        return;
+    }
+    ring = __atomic_load_n(&rings[vcpu_index], __ATOMIC_ACQUIRE);
+    if (!ring) {
+        return;
+    }
+
+    /* In user mode, vCPUs keep running after the writer has stopped */
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        ring->dropped++;
+        return;
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring_size) {
+        /* The writer is behind, give it some time rather than losing records */
+        int64_t deadline = g_get_monotonic_time() + PRODUCER_MAX_WAIT_US;
+
+        ring->stalls++;
+        do {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) ||
+                g_get_monotonic_time() > deadline) {
+                ring->dropped++;
+                return;
+            }
+            sched_yield();
+        } while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+                 ring_size);
+    }
+
+    rec = &ring->buf[head & (ring_size - 1)];
+    rec->pc = (uintptr_t) udata;
+    rec->vaddr = vaddr;
+    rec->paddr = vaddr;
+    rec->vcpu = vcpu_index;
+    rec->size = 1 << qemu_plugin_mem_size_shift(info);
+    rec->flags = qemu_plugin_mem_is_store(info) ? MEMTRACE_STORE : 0;
+    rec->reserved = 0;
+
+    if (sys) {
+        hwaddr = qemu_plugin_get_hwaddr(info, vaddr);
+        if (hwaddr) {
+            rec->paddr = qemu_plugin_hwaddr_phys_addr(hwaddr);
+            if (qemu_plugin_hwaddr_is_io(hwaddr)) {
+                rec->flags |= MEMTRACE_IO;
+            }
+        }
+    }
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
+{
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+        uint64_t pc = qemu_plugin_insn_vaddr(insn);
+
+        qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem,
+                                         QEMU_PLUGIN_CB_NO_REGS,
+                                         QEMU_PLUGIN_MEM_RW,
+                                         (void *) (uintptr_t) pc);
+    }
+}
+
+static void plugin_exit(qemu_plugin_id_t id, void *p)
+{
+    MemTraceTrailer trailer = { .magic = MEMTRACE_TRAILER_MAGIC };
+    g_autoptr(GString) report = g_string_new("");
+    uint64_t stalls = 0, dropped = 0;
+    int i;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    g_thread_join(writer);
+
+    trailer.index_offset = trace_offset;
+    trailer.n_chunks = trace_index->len;
+    trailer.n_records = trace_records;
+    trace_write(trace_index->data,
+                trace_index->len * sizeof(MemTraceIndexEntry));
+    trace_write(&trailer, sizeof(trailer));
+    if (fclose(trace) != 0 && !write_error) {
+        fprintf(stderr, "memtrace: failed to close %s: %s\n", filename,
+                strerror(errno));
+    }
+
+    /*
+     * The rings are not freed: in user mode, other vCPU threads may still
+     * be running and look them up until the process exits.
+     */
+    for (i = 0; i < max_vcpus; i++) {
+        TraceRing *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+
+        if (ring) {
+            stalls += ring->stalls;
+            dropped += ring->dropped;
+        }
+    }
+
+    g_string_printf(report, "memtrace: %" PRIu64 " records in %u chunks, "
+                    "%" PRIu64 " bytes (%" PRIu64 " uncompressed), "
+                    "%" PRIu64 " producer stalls, %" PRIu64 " records "
+                    "dropped\n",
+                    trace_records, trace_index->len, trace_offset,
+                    trace_bytes_raw, stalls, dropped);
+    qemu_plugin_outs(report->str);
+
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCCtx(cctx);
+#endif
+    g_array_free(trace_index, true);
+    g_free(chunk_buf);
+    g_free(stored_buf);
+    g_free(filename);
+}
+
+static bool is_pow2(uint64_t v)
+{
+    return v && !(v & (v - 1));
+}
+
+QEMU_PLUGIN_EXPORT
+int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
+                        int argc, char **argv)
+{
+    MemTraceFileHeader hdr = {
+        .magic = MEMTRACE_MAGIC,
+        .version = MEMTRACE_VERSION,
+        .record_size = sizeof(MemTraceRecord),
+    };
+    int i;
+
+    sys = info->system_emulation;
+#ifdef CONFIG_ZSTD
+    compress = true;
+#endif
+
+    for (i = 0; i < argc; i++) {
+        char *opt = argv[i];
+        g_autofree char **tokens = g_strsplit(opt, "=", 2);
+
+        if (g_strcmp0(tokens[0], "filename") == 0) {
+            g_free(filename);
+            filename = g_strdup(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "ringsize") == 0) {
+            ring_size = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "chunksize") == 0) {
+            chunk_records = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "level") == 0) {
+            compress_level = STRTOLL(tokens[1]);
+        } else if (g_strcmp0(tokens[0], "compress") == 0) {
+            if (!qemu_plugin_bool_parse(tokens[0], tokens[1], &compress)) {
+                fprintf(stderr, "boolean argument parsing failed: %s\n", opt);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "option parsing failed: %s\n", opt);
+            return -1;
+        }
+    }
+
+#ifndef CONFIG_ZSTD
+    if (compress) {
+        fprintf(stderr, "memtrace: built without zstd, compress=on is not "
+                "supported\n");
+        return -1;
+    }
+#endif
+
+    if (!is_pow2(ring_size)) {
+        fprintf(stderr, "memtrace: ringsize must be a power of two\n");
+        return -1;
+    }
+    if (chunk_records == 0 || chunk_records > ring_size / 2 ||
+        chunk_records > UINT32_MAX / sizeof(MemTraceRecord)) {
+        fprintf(stderr, "memtrace: chunksize must be non-zero and at most "
+                "half of ringsize\n");
+        return -1;
+    }
+
+    if (!filename) {
+        filename = g_strdup("memtrace.bin");
+    }
+    trace = fopen(filename, "wb");
+    if (!trace) {
+        fprintf(stderr, "memtrace: cannot open %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+    trace_write(&hdr, sizeof(hdr));
+
+    max_vcpus = sys ? qemu_plugin_n_max_vcpus() : USER_MAX_VCPUS;
+    rings = g_new0(TraceRing *, max_vcpus);
+    trace_index = g_array_new(false, false, sizeof(MemTraceIndexEntry));
+    chunk_buf = g_new(MemTraceRecord, chunk_records);
+#ifdef CONFIG_ZSTD
+    if (compress) {
+        stored_cap = ZSTD_compressBound(chunk_records * sizeof(MemTraceRecord));
+        stored_buf = g_malloc(stored_cap);
+        cctx = ZSTD_createCCtx();
+    }
+#endif
+
+    writer = g_thread_new("memtrace-writer", writer_thread, NULL);
+
+    qemu_plugin_register_vcpu_init_cb(id, vcpu_init);
+    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Binary memory access trace format shared by the memtrace plugin and its
+ * reader library.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef MEMTRACE_H
+#define MEMTRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A trace file is laid out as follows, all fields in host byte order:
+ *
+ *   MemTraceFileHeader
+ *   MemTraceChunkHeader, payload    (repeated)
+ *   MemTraceIndexEntry[n_chunks]
+ *   MemTraceTrailer
+ *
+ * Each chunk holds a run of records of a single vCPU, compressed with the
+ * codec named in its header. Records of different vCPUs are interleaved at
+ * chunk granularity, in the order the chunks were drained.
+ *
+ * The index and trailer are written when the trace is closed and allow
+ * seeking to any record without decompressing the preceding chunks. A trace
+ * without them (e.g. because QEMU was killed) can still be read sequentially.
+ */
+
+#define MEMTRACE_MAGIC          "QMEMTRC"
+#define MEMTRACE_VERSION        1
+#define MEMTRACE_CHUNK_MAGIC    0x4b4e4843  /* "CHNK" */
+#define MEMTRACE_TRAILER_MAGIC  0x58444e49  /* "INDX" */
+
+enum MemTraceCodec {
+    MEMTRACE_CODEC_NONE = 0,
+    MEMTRACE_CODEC_ZSTD = 1,
+};
+
+/* MemTraceRecord flags */
+#define MEMTRACE_STORE  (1 << 0)
+#define MEMTRACE_IO     (1 << 1)
+
+typedef struct {
+    uint64_t pc;
+    uint64_t vaddr;
+    uint64_t paddr;     /* equal to vaddr in user mode */
+    uint32_t vcpu;
+    uint8_t size;       /* in bytes */
+    uint8_t flags;
+    uint16_t reserved;
+} MemTraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} MemTraceFileHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t codec;
+    uint32_t n_records;
+    uint32_t stored_size;
+    uint64_t first_record;
+} MemTraceChunkHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t first_record;
+} MemTraceIndexEntry;
+
+typedef struct {
+    uint64_t index_offset;
+    uint64_t n_chunks;
+    uint64_t n_records;
+    uint32_t magic;
+    uint32_t reserved;
+} MemTraceTrailer;
+
+/*
+ * Reader library
+ */
+
+typedef struct MemTraceReader MemTraceReader;
+
+/**
+ * memtrace_reader_open() - open a trace file for reading
+ * @path: path of the trace file
+ *
+ * Returns: a reader positioned on the first record, or NULL with errno set.
+ */
+MemTraceReader *memtrace_reader_open(const char *path);
+
+/**
+ * memtrace_reader_close() - close a trace file
+ * @r: the reader
+ */
+void memtrace_reader_close(MemTraceReader *r);
+
+/**
+ * memtrace_reader_n_records() - total number of records in the trace
+ * @r: the reader
+ */
+uint64_t memtrace_reader_n_records(MemTraceReader *r);
+
+/**
+ * memtrace_reader_seek() - position the reader on a record
+ * @r: the reader
+ * @record: index of the record, in file order
+ *
+ * Returns: 0 on success, -errno on failure.
+ */
+int memtrace_reader_seek(MemTraceReader *r, uint64_t record);
+
+/**
+ * memtrace_reader_read() - read the next records of a trace
+ * @r: the reader
+ * @records: buffer receiving the records
+ * @n: capacity of @records
+ *
+ * Returns: the number of records read, 0 at the end of the trace, or
+ * -errno on failure.
+ */
+ssize_t memtrace_reader_read(MemTraceReader *r, MemTraceRecord *records,
+                             size_t n);
+
+#endif /* MEMTRACE_H */
@@ -32,6 +32,12 @@ static void event_loop_base_instance_init(Object *obj)
 static EventLoopBaseParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(EventLoopBase, aio_max_batch),
 };
+static EventLoopBaseParamInfo io_uring_entries_info = {
+    "io-uring-entries", offsetof(EventLoopBase, io_uring_entries),
+};
+static EventLoopBaseParamInfo io_uring_sqpoll_idle_info = {
+    "io-uring-sqpoll-idle", offsetof(EventLoopBase, io_uring_sqpoll_idle),
+};
 static EventLoopBaseParamInfo thread_pool_min_info = {
     "thread-pool-min", offsetof(EventLoopBase, thread_pool_min),
 };
@@ -77,6 +83,26 @@ static void event_loop_base_set_param(Object *obj, Visitor *v,
     return;
 }
 
+static bool event_loop_base_get_numa_affine(Object *obj, Error **errp)
+{
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    return base->thread_pool_numa_affine;
+}
+
+static void event_loop_base_set_numa_affine(Object *obj, bool value,
+                                            Error **errp)
+{
+    EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(obj);
+    EventLoopBase *base = EVENT_LOOP_BASE(obj);
+
+    base->thread_pool_numa_affine = value;
+
+    if (bc->update_params) {
+        bc->update_params(base, errp);
+    }
+}
+
 static void event_loop_base_complete(UserCreatable *uc, Error **errp)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_GET_CLASS(uc);
@@ -109,6 +135,14 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &aio_max_batch_info);
+    object_class_property_add(klass, "io-uring-entries", "int",
+                              event_loop_base_get_param,
+                              event_loop_base_set_param,
+                              NULL, &io_uring_entries_info);
+    object_class_property_add(klass, "io-uring-sqpoll-idle", "int",
+                              event_loop_base_get_param,
+                              event_loop_base_set_param,
+                              NULL, &io_uring_sqpoll_idle_info);
     object_class_property_add(klass, "thread-pool-min", "int",
                               event_loop_base_get_param,
                               event_loop_base_set_param,
@@ -117,6 +151,9 @@ static void event_loop_base_class_init(ObjectClass *klass, void *class_data)
                               event_loop_base_get_param,
                               event_loop_base_set_param,
                               NULL, &thread_pool_max_info);
+    object_class_property_add_bool(klass, "thread-pool-numa-affine",
+                                   event_loop_base_get_numa_affine,
+                                   event_loop_base_set_numa_affine);
 }
 
 static const TypeInfo event_loop_base_info = {
@@ -273,9 +273,105 @@ static MemTxResult cxl_write_cfmws(void *opaque, hwaddr addr, uint64_t data,
     return result;
 }
 
+/*
+ * Split a span of a fixed memory window at interleave granule boundaries,
+ * the smallest of which is 256 bytes, so that each piece targets a single
+ * device and is contiguous in its DPA space.
+ */
+static hwaddr cxl_cfmws_piece_len(CXLFixedWindow *fw, hwaddr addr, hwaddr len)
+{
+    hwaddr gran = cxl_decode_ig(0);
+    hwaddr hpa = addr + fw->base;
+
+    return MIN(len, QEMU_ALIGN_UP(hpa + 1, gran) - hpa);
+}
+
+/*
+ * Size of the next access when a span is split for a target without bulk
+ * support: the largest power of 2 that fits, up to 8 bytes.
+ */
+static unsigned cxl_cfmws_access_size(hwaddr len)
+{
+    return pow2floor(MIN(len, 8));
+}
+
+static MemTxResult cxl_read_cfmws_bulk(void *opaque, hwaddr addr, void *buf,
+                                       hwaddr len, MemTxAttrs attrs)
+{
+    MemTxResult result = MEMTX_OK;
+    CXLFixedWindow *fw = opaque;
+    uint8_t *p = buf;
+
+    while (len) {
+        hwaddr l = cxl_cfmws_piece_len(fw, addr, len);
+        PCIDevice *d = cxl_cfmws_find_device(fw, addr);
+
+        if (d && !cxl_is_remote_root_port(d) &&
+            object_dynamic_cast(OBJECT(d), TYPE_CXL_TYPE3)) {
+            trace_cxl_read_cfmws_bulk("CXL.mem", addr, l);
+            result |= cxl_type3_read_bulk(d, addr + fw->base, p, l, attrs);
+        } else {
+            /* Other targets get power of 2 accesses of up to 8 bytes */
+            unsigned size;
+            hwaddr i;
+
+            for (i = 0; i < l; i += size) {
+                uint64_t data;
+
+                size = cxl_cfmws_access_size(l - i);
+                result |= cxl_read_cfmws(opaque, addr + i, &data, size, attrs);
+                stn_le_p(p + i, size, data);
+            }
+        }
+
+        addr += l;
+        p += l;
+        len -= l;
+    }
+
+    return result;
+}
+
+static MemTxResult cxl_write_cfmws_bulk(void *opaque, hwaddr addr,
+                                        const void *buf, hwaddr len,
+                                        MemTxAttrs attrs)
+{
+    MemTxResult result = MEMTX_OK;
+    CXLFixedWindow *fw = opaque;
+    const uint8_t *p = buf;
+
+    while (len) {
+        hwaddr l = cxl_cfmws_piece_len(fw, addr, len);
+        PCIDevice *d = cxl_cfmws_find_device(fw, addr);
+
+        if (d && !cxl_is_remote_root_port(d) &&
+            object_dynamic_cast(OBJECT(d), TYPE_CXL_TYPE3)) {
+            trace_cxl_write_cfmws_bulk("CXL.mem", addr, l);
+            result |= cxl_type3_write_bulk(d, addr + fw->base, p, l, attrs);
+        } else {
+            unsigned size;
+            hwaddr i;
+
+            for (i = 0; i < l; i += size) {
+                size = cxl_cfmws_access_size(l - i);
+                result |= cxl_write_cfmws(opaque, addr + i,
+                                          ldn_le_p(p + i, size), size, attrs);
+            }
+        }
+
+        addr += l;
+        p += l;
+        len -= l;
+    }
+
+    return result;
+}
+
 const MemoryRegionOps cfmws_ops = {
     .read_with_attrs = cxl_read_cfmws,
     .write_with_attrs = cxl_write_cfmws,
+    .read_bulk = cxl_read_cfmws_bulk,
+    .write_bulk = cxl_write_cfmws_bulk,
     .endianness = DEVICE_LITTLE_ENDIAN,
     .valid =
         {
@@ -59,6 +59,9 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Number of TX packets popped and completed at once */
+#define VIRTIO_NET_TX_BATCH 32
+
 #define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
 
 #define VIRTIO_NET_TCP_FLAG         0x3F
@@ -373,6 +376,8 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_tx_zerocopy_drop(VirtIONetQueue *q, bool complete);
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
@@ -406,6 +411,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
         if (queue_started) {
             qemu_flush_queued_packets(ncs);
+        } else {
+            virtio_net_tx_zerocopy_drop(q,
+                                queue_status & VIRTIO_CONFIG_S_DRIVER_OK);
         }
 
         if (!q->tx_waiting) {
@@ -571,6 +579,9 @@ static void virtio_net_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
     }
 
     flush_or_purge_queued_packets(nc);
+    if (queue_index % 2) {
+        virtio_net_tx_zerocopy_drop(&n->vqs[vq2q(queue_index)], false);
+    }
 }
 
 static void virtio_net_queue_enable(VirtIODevice *vdev, uint32_t queue_index)
@@ -1268,6 +1279,15 @@ static bool virtio_net_attach_ebpf_to_backend(NICState *nic, int prog_fd)
     return nc->info->set_steering_ebpf(nc, prog_fd);
 }
 
+static void virtio_net_rss_update_key(VirtIONet *n)
+{
+    if (!n->rss_data.toeplitz) {
+        n->rss_data.toeplitz = g_new(NetToeplitzTable, 1);
+    }
+    net_toeplitz_table_init(n->rss_data.toeplitz, n->rss_data.key,
+                            sizeof(n->rss_data.key));
+}
+
 static void rss_data_to_rss_config(struct VirtioNetRssData *data,
                                    struct EBPFRSSConfig *config)
 {
@@ -1432,6 +1452,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         err_value = (uint32_t)s;
         goto error;
     }
+    virtio_net_rss_update_key(n);
     n->rss_data.enabled = true;
 
     if (!n->rss_data.populate_hash) {
@@ -1574,10 +1595,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         if (written > 0) {
             virtqueue_push(vq, elem, written);
             virtio_notify(vdev, vq);
-            g_free(elem);
+            virtqueue_free_element(elem);
         } else {
             virtqueue_detach_element(vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(elem);
             break;
         }
     }
@@ -1593,6 +1614,35 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
+static void virtio_net_receive_batch_begin(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+
+    n->rx_batch++;
+}
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
+
+    assert(n->rx_batch > 0);
+    if (--n->rx_batch) {
+        return;
+    }
+
+    /* With RSS, the packets may have gone to any queue */
+    for (i = 0; i < n->max_queue_pairs; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify_pending) {
+            q->rx_notify_pending = false;
+            virtio_notify(vdev, q->rx_vq);
+        }
+    }
+}
+
 static bool virtio_net_can_receive(NetClientState *nc)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
@@ -1848,7 +1898,8 @@ static int virtio_net_process_rss(NetClientState *nc, const uint8_t *buf,
         return n->rss_data.redirect ? n->rss_data.default_queue : -1;
     }
 
-    hash = net_rx_pkt_calc_rss_hash(pkt, net_hash_type, n->rss_data.key);
+    hash = net_rx_pkt_calc_rss_hash_table(pkt, net_hash_type,
+                                          n->rss_data.toeplitz);
 
     if (n->rss_data.populate_hash) {
         virtio_set_packet_hash(buf, reports[net_hash_type], hash);
@@ -1930,7 +1981,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_free_element(elem);
             err = -1;
             goto err;
         }
@@ -1968,7 +2019,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_free_element(elem);
             err = size;
             goto err;
         }
@@ -1988,18 +2039,22 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     for (j = 0; j < i; j++) {
         /* signal other side */
         virtqueue_fill(q->rx_vq, elems[j], lens[j], j);
-        g_free(elems[j]);
+        virtqueue_free_element(elems[j]);
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (n->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_notify(vdev, q->rx_vq);
+    }
 
     return size;
 
 err:
     for (j = 0; j < i; j++) {
         virtqueue_detach_element(q->rx_vq, elems[j], lens[j]);
-        g_free(elems[j]);
+        virtqueue_free_element(elems[j]);
     }
 
     return err;
@@ -2629,7 +2684,7 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_free_element(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2652,13 +2707,173 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+
+static void virtio_net_tx_zerocopy_hold(VirtIONetQueue *q,
+                                        VirtQueueElement *elem)
+{
+    unsigned int size = q->n->net_conf.tx_queue_size;
+
+    assert(q->zerocopy_tx.num < size);
+    q->zerocopy_tx.elems[(q->zerocopy_tx.head + q->zerocopy_tx.num) % size] =
+        elem;
+    q->zerocopy_tx.num++;
+}
+
+static VirtQueueElement *virtio_net_tx_zerocopy_pop(VirtIONetQueue *q)
+{
+    VirtQueueElement *elem = q->zerocopy_tx.elems[q->zerocopy_tx.head];
+
+    q->zerocopy_tx.head = (q->zerocopy_tx.head + 1) %
+                          q->n->net_conf.tx_queue_size;
+    q->zerocopy_tx.num--;
+    return elem;
+}
+
+/* The peer is done with the @num oldest packets sent with zero copy */
+static void virtio_net_tx_zerocopy_complete(NetClientState *nc,
+                                            unsigned int num)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int i, batch;
+
+    assert(num <= q->zerocopy_tx.num);
+
+    if (q->zerocopy_tx.detach) {
+        /* The queue is being reset, so the packets are dropped instead */
+        while (num--) {
+            elems[0] = virtio_net_tx_zerocopy_pop(q);
+            virtqueue_detach_element(q->tx_vq, elems[0], 0);
+            virtqueue_free_element(elems[0]);
+        }
+        return;
+    }
+
+    while (num) {
+        batch = MIN(num, VIRTIO_NET_TX_BATCH);
+        for (i = 0; i < batch; i++) {
+            elems[i] = virtio_net_tx_zerocopy_pop(q);
+        }
+        virtqueue_push_batch(q->tx_vq, elems, NULL, batch);
+        for (i = 0; i < batch; i++) {
+            virtqueue_free_element(elems[i]);
+        }
+        num -= batch;
+    }
+    virtio_notify(VIRTIO_DEVICE(n), q->tx_vq);
+}
+
+/*
+ * Get back all packets held by the peer, which waits until the host no
+ * longer reads from them.  They are completed if the ring is still live,
+ * e.g. when the VM is stopped for migration, and dropped otherwise.
+ */
+static void virtio_net_tx_zerocopy_drop(VirtIONetQueue *q, bool complete)
+{
+    NetClientState *nc;
+
+    if (!q->zerocopy_tx.num) {
+        return;
+    }
+
+    nc = qemu_get_subqueue(q->n->nic, vq2q(virtio_get_queue_index(q->tx_vq)));
+    q->zerocopy_tx.detach = !complete;
+    qemu_net_zerocopy_flush(nc);
+    if (q->zerocopy_tx.num) {
+        /* Without a peer nothing references the packets anymore */
+        virtio_net_tx_zerocopy_complete(nc, q->zerocopy_tx.num);
+    }
+    q->zerocopy_tx.detach = false;
+}
+
+/*
+ * Send the packet in @elem.  Returns 0 if @elem can be completed, 1 if the
+ * peer transmits from it without a copy and completes it later, -EBUSY if
+ * the packet was queued by the peer, or -EINVAL if @elem is invalid.
+ */
+static int virtio_net_tx_one(VirtIONetQueue *q, VirtQueueElement *elem)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
-    int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    ssize_t ret;
+    bool held = false;
+    unsigned int out_num;
+    struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+    struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+    out_num = elem->out_num;
+    out_sg = elem->out_sg;
+    if (out_num < 1) {
+        virtio_error(vdev, "virtio-net header not in first element");
+        return -EINVAL;
+    }
+
+    if (n->has_vnet_hdr) {
+        if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+            n->guest_hdr_len) {
+            virtio_error(vdev, "virtio-net header incorrect");
+            return -EINVAL;
+        }
+        if (n->needs_vnet_hdr_swap) {
+            virtio_net_hdr_swap(vdev, (void *) &mhdr);
+            sg2[0].iov_base = &mhdr;
+            sg2[0].iov_len = n->guest_hdr_len;
+            out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
+                               out_sg, out_num,
+                               n->guest_hdr_len, -1);
+            if (out_num == VIRTQUEUE_MAX_SIZE) {
+                /* drop */
+                return 0;
+            }
+            out_num += 1;
+            out_sg = sg2;
+        }
+    }
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    /*
+     * A swapped header lives on the stack, so the packet must be copied.
+     * Zero copy completes buffers out of order, which VIRTIO_F_IN_ORDER
+     * does not allow.
+     */
+    if (out_sg == sg2 ||
+        virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                      out_sg, out_num, virtio_net_tx_complete);
+    } else {
+        ret = qemu_sendv_packet_zerocopy(qemu_get_subqueue(n->nic,
+                                                           queue_index),
+                                         out_sg, out_num,
+                                         virtio_net_tx_complete, &held);
+    }
+    if (ret == 0) {
+        return -EBUSY;
+    }
+    return held ? 1 : 0;
+}
+
+static int32_t virtio_net_do_flush_tx(VirtIONetQueue *q)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int32_t num_packets = 0;
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
@@ -2669,84 +2884,76 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     }
 
     for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+        unsigned int num, done, pushed, i;
+        int ret = 0;
+
+        num = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                  (void **)elems,
+                                  MIN(VIRTIO_NET_TX_BATCH,
+                                      n->tx_burst - num_packets));
+        if (!num) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
-        }
-
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
-            }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-                }
-                out_num += 1;
-                out_sg = sg2;
+        for (done = 0, pushed = 0; done < num; done++) {
+            ret = virtio_net_tx_one(q, elems[done]);
+            if (ret < 0) {
+                break;
+            } else if (ret > 0) {
+                /* Completed by virtio_net_tx_zerocopy_complete() */
+                virtio_net_tx_zerocopy_hold(q, elems[done]);
+            } else {
+                elems[pushed++] = elems[done];
             }
         }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
+        num_packets += done;
+
+        /* Complete the packets that were sent with a single notification */
+        if (pushed) {
+            virtqueue_push_batch(q->tx_vq, elems, NULL, pushed);
+            virtio_notify(vdev, q->tx_vq);
+            for (i = 0; i < pushed; i++) {
+                virtqueue_free_element(elems[i]);
+            }
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
+        if (ret == -EBUSY) {
+            /* Give back what was popped after the queued packet */
+            for (i = num - 1; i > done; i--) {
+                virtqueue_unpop(q->tx_vq, elems[i], 0);
+                virtqueue_free_element(elems[i]);
+            }
             virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
+            q->async_tx.elem = elems[done];
             return -EBUSY;
+        } else if (ret < 0) {
+            for (i = done; i < num; i++) {
+                virtqueue_detach_element(q->tx_vq, elems[i], 0);
+                virtqueue_free_element(elems[i]);
+            }
+            return ret;
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
+        if (num_packets >= n->tx_burst) {
             break;
         }
     }
     return num_packets;
 }
 
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
+{
+    int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
+    NetClientState *nc = qemu_get_subqueue(q->n->nic, queue_index);
+    int32_t ret;
+
+    qemu_send_batch_begin(nc);
+    ret = virtio_net_do_flush_tx(q);
+    qemu_send_batch_end(nc);
+    return ret;
+}
+
 static void virtio_net_tx_timer(void *opaque);
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
@@ -2921,6 +3128,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
     }
 
     n->vqs[index].tx_waiting = 0;
+    n->vqs[index].zerocopy_tx.elems =
+        g_new0(VirtQueueElement *, n->net_conf.tx_queue_size);
     n->vqs[index].n = n;
 }
 
@@ -2931,6 +3140,10 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
     qemu_purge_queued_packets(nc);
+    virtio_net_tx_zerocopy_drop(q, false);
+    g_free(q->zerocopy_tx.elems);
+    q->zerocopy_tx.elems = NULL;
+    q->zerocopy_tx.head = 0;
 
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
@@ -3050,6 +3263,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
+        virtio_net_rss_update_key(n);
         n->rss_data.enabled_software_rss = n->rss_data.populate_hash;
         if (!n->rss_data.populate_hash) {
             if (!virtio_net_attach_epbf_rss(n)) {
@@ -3332,7 +3546,10 @@ static NetClientInfo net_virtio_info = {
     .type = NET_CLIENT_DRIVER_NIC,
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
+    .receive_batch_begin = virtio_net_receive_batch_begin,
+    .receive_batch_end = virtio_net_receive_batch_end,
     .receive = virtio_net_receive,
+    .zerocopy_complete = virtio_net_tx_zerocopy_complete,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3782,6 +3999,7 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_del_nic(n->nic);
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
+    g_free(n->rss_data.toeplitz);
     net_rx_pkt_uninit(n->rx_pkt);
     virtio_cleanup(vdev);
 }
@@ -3902,6 +4120,8 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
+    DEFINE_PROP_BIT64("in_order", VirtIONet, host_features,
+                    VIRTIO_F_IN_ORDER, false),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
@@ -98,7 +98,7 @@ static void virtio_scsi_free_req(VirtIOSCSIReq *req)
 {
     qemu_iovec_destroy(&req->resp_iov);
     qemu_sglist_destroy(&req->qsgl);
-    g_free(req);
+    virtqueue_free_element(req);
 }
 
 static void virtio_scsi_complete_req(VirtIOSCSIReq *req)
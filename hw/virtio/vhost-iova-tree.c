@@ -13,6 +13,9 @@
 
 #define iova_min_addr qemu_real_host_page_size()
 
+/* Number of recently translated maps remembered by the tree */
+#define VHOST_IOVA_TREE_CACHE_SIZE 4
+
 /**
  * VhostIOVATree, able to:
  * - Translate iova address
@@ -28,6 +31,9 @@ struct VhostIOVATree {
 
     /* IOVA address to qemu memory maps. */
     IOVATree *iova_taddr_map;
+
+    /* Most recently found maps, most recent first. */
+    const DMAMap *cache[VHOST_IOVA_TREE_CACHE_SIZE];
 };
 
 /**
@@ -37,7 +43,7 @@ struct VhostIOVATree {
  */
 VhostIOVATree *vhost_iova_tree_new(hwaddr iova_first, hwaddr iova_last)
 {
-    VhostIOVATree *tree = g_new(VhostIOVATree, 1);
+    VhostIOVATree *tree = g_new0(VhostIOVATree, 1);
 
     /* Some devices do not like 0 addresses */
     tree->iova_first = MAX(iova_first, iova_min_addr);
@@ -56,18 +62,54 @@ void vhost_iova_tree_delete(VhostIOVATree *iova_tree)
     g_free(iova_tree);
 }
 
+static bool vhost_iova_tree_map_contains(const DMAMap *map,
+                                         const DMAMap *needle)
+{
+    hwaddr off;
+
+    if (needle->translated_addr < map->translated_addr) {
+        return false;
+    }
+
+    off = needle->translated_addr - map->translated_addr;
+    return off <= map->size && needle->size <= map->size - off;
+}
+
 /**
  * Find the IOVA address stored from a memory address
  *
  * @tree: The iova tree
  * @map: The map with the memory address
  *
+ * Buffers are usually found in a handful of maps (guest RAM, shadow vrings),
+ * so the last found maps are checked before walking the whole tree.
+ *
  * Return the stored mapping, or NULL if not found.
  */
-const DMAMap *vhost_iova_tree_find_iova(const VhostIOVATree *tree,
+const DMAMap *vhost_iova_tree_find_iova(VhostIOVATree *tree,
                                         const DMAMap *map)
 {
-    return iova_tree_find_iova(tree->iova_taddr_map, map);
+    const DMAMap *found;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(tree->cache) && tree->cache[i]; ++i) {
+        found = tree->cache[i];
+        if (vhost_iova_tree_map_contains(found, map)) {
+            goto hit;
+        }
+    }
+
+    found = iova_tree_find_iova(tree->iova_taddr_map, map);
+    if (!found) {
+        return NULL;
+    }
+    i = ARRAY_SIZE(tree->cache) - 1;
+
+hit:
+    /* Move the found map to the front of the cache */
+    memmove(&tree->cache[1], &tree->cache[0], i * sizeof(tree->cache[0]));
+    tree->cache[0] = found;
+    return found;
 }
 
 /**
@@ -106,5 +148,7 @@ int vhost_iova_tree_map_alloc(VhostIOVATree *tree, DMAMap *map)
  */
 void vhost_iova_tree_remove(VhostIOVATree *iova_tree, DMAMap map)
 {
+    /* The removed maps are freed, forget about all of them */
+    memset(iova_tree->cache, 0, sizeof(iova_tree->cache));
     iova_tree_remove(iova_tree->iova_taddr_map, map);
 }
@@ -17,6 +17,9 @@
 #include "qemu/memalign.h"
 #include "linux-headers/linux/vhost.h"
 
+/* Maximum number of guest buffers exposed to the device per kick */
+#define VHOST_SVQ_KICK_BATCH 64
+
 /**
  * Validate the transport device features that both guests can use with the SVQ
  * and SVQs can use with the device.
@@ -204,23 +207,35 @@ static bool vhost_svq_add_split(VhostShadowVirtqueue *svq,
 
     /*
      * Put the entry in the available array (but don't update avail->idx until
-     * they do sync).
+     * vhost_svq_kick, so a burst of buffers is exposed to the device at once).
      */
     avail_idx = svq->shadow_avail_idx & (svq->vring.num - 1);
     avail->ring[avail_idx] = cpu_to_le16(*head);
     svq->shadow_avail_idx++;
 
-    /* Update the avail index after write the descriptor */
-    smp_wmb();
-    avail->idx = cpu_to_le16(svq->shadow_avail_idx);
-
     return true;
 }
 
+/**
+ * Expose the buffers added since the last call to the device and notify it
+ * if needed.
+ *
+ * @svq: The shadow virtqueue
+ */
 static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 {
+    vring_avail_t *avail = svq->vring.avail;
+    uint16_t old = le16_to_cpu(avail->idx);
     bool needs_kick;
 
+    if (old == svq->shadow_avail_idx) {
+        return;
+    }
+
+    /* Update the avail index after write the descriptors */
+    smp_wmb();
+    avail->idx = cpu_to_le16(svq->shadow_avail_idx);
+
     /*
      * We need to expose the available array entries before checking the used
      * flags
@@ -229,7 +244,7 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
 
     if (virtio_vdev_has_feature(svq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         uint16_t avail_event = *(uint16_t *)(&svq->vring.used->ring[svq->vring.num]);
-        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, svq->shadow_avail_idx - 1);
+        needs_kick = vring_need_event(avail_event, svq->shadow_avail_idx, old);
     } else {
         needs_kick = !(svq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
     }
@@ -241,14 +256,14 @@ static void vhost_svq_kick(VhostShadowVirtqueue *svq)
     event_notifier_set(&svq->hdev_kick);
 }
 
-/**
- * Add an element to a SVQ.
- *
- * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+/*
+ * Add an element to a SVQ without exposing it to the device. The caller must
+ * call vhost_svq_kick afterwards.
  */
-int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
-                  size_t out_num, const struct iovec *in_sg, size_t in_num,
-                  VirtQueueElement *elem)
+static int vhost_svq_add_no_kick(VhostShadowVirtqueue *svq,
+                                 const struct iovec *out_sg, size_t out_num,
+                                 const struct iovec *in_sg, size_t in_num,
+                                 VirtQueueElement *elem)
 {
     unsigned qemu_head;
     unsigned ndescs = in_num + out_num;
@@ -265,16 +280,32 @@ int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
 
     svq->desc_state[qemu_head].elem = elem;
     svq->desc_state[qemu_head].ndescs = ndescs;
-    vhost_svq_kick(svq);
     return 0;
 }
 
-/* Convenience wrapper to add a guest's element to SVQ */
+/**
+ * Add an element to a SVQ.
+ *
+ * Return -EINVAL if element is invalid, -ENOSPC if dev queue is full
+ */
+int vhost_svq_add(VhostShadowVirtqueue *svq, const struct iovec *out_sg,
+                  size_t out_num, const struct iovec *in_sg, size_t in_num,
+                  VirtQueueElement *elem)
+{
+    int r = vhost_svq_add_no_kick(svq, out_sg, out_num, in_sg, in_num, elem);
+
+    if (likely(r == 0)) {
+        vhost_svq_kick(svq);
+    }
+    return r;
+}
+
+/* Convenience wrapper to add a guest's element to SVQ, see vhost_svq_kick */
 static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
                                  VirtQueueElement *elem)
 {
-    return vhost_svq_add(svq, elem->out_sg, elem->out_num, elem->in_sg,
-                         elem->in_num, elem);
+    return vhost_svq_add_no_kick(svq, elem->out_sg, elem->out_num,
+                                 elem->in_sg, elem->in_num, elem);
 }
 
 /**
@@ -289,9 +320,14 @@ static int vhost_svq_add_element(VhostShadowVirtqueue *svq,
  *
  * If that happens, guest's kick notifications will be disabled until the
  * device uses some buffers.
+ *
+ * Buffers are exposed to the device in bursts of up to VHOST_SVQ_KICK_BATCH
+ * elements, so the device is notified at most once per burst.
  */
 static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
 {
+    unsigned pending = 0;
+
     /* Clear event notifier */
     event_notifier_test_and_clear(&svq->svq_kick);
 
@@ -317,6 +353,10 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                 r = svq->ops->avail_handler(svq, elem, svq->ops_opaque);
             } else {
                 r = vhost_svq_add_element(svq, elem);
+                if (r == 0 && ++pending == VHOST_SVQ_KICK_BATCH) {
+                    vhost_svq_kick(svq);
+                    pending = 0;
+                }
             }
             if (unlikely(r != 0)) {
                 if (r == -ENOSPC) {
@@ -335,12 +375,15 @@ static void vhost_handle_guest_kick(VhostShadowVirtqueue *svq)
                 }
 
                 /* VQ is full or broken, just return and ignore kicks */
+                vhost_svq_kick(svq);
                 return;
             }
             /* elem belongs to SVQ or external caller now */
             elem = NULL;
         }
 
+        vhost_svq_kick(svq);
+        pending = 0;
         virtio_queue_set_notification(svq->vq, true);
     } while (!virtio_queue_empty(svq->vq));
 }
@@ -470,6 +513,16 @@ void vhost_svq_push_elem(VhostShadowVirtqueue *svq,
     }
 }
 
+/*
+ * Check if the guest wants to be notified of the buffers used so far,
+ * honouring its used_event index or VRING_AVAIL_F_NO_INTERRUPT flag.
+ */
+static bool vhost_svq_guest_should_notify(VhostShadowVirtqueue *svq)
+{
+    RCU_READ_LOCK_GUARD();
+    return virtio_should_notify(svq->vdev, svq->vq);
+}
+
 static void vhost_svq_flush(VhostShadowVirtqueue *svq,
                             bool check_for_avail_queue)
 {
@@ -498,8 +551,12 @@ static void vhost_svq_flush(VhostShadowVirtqueue *svq,
             virtqueue_fill(vq, elem, len, i++);
         }
 
-        virtqueue_flush(vq, i);
-        event_notifier_set(&svq->svq_call);
+        if (i) {
+            virtqueue_flush(vq, i);
+            if (vhost_svq_guest_should_notify(svq)) {
+                event_notifier_set(&svq->svq_call);
+            }
+        }
 
         if (check_for_avail_queue && svq->next_guest_avail_elem) {
             /*
@@ -16,9 +16,11 @@
 #include "qapi/qapi-commands-virtio.h"
 #include "trace.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
 #include "qom/object_interfaces.h"
 #include "hw/core/cpu.h"
 #include "hw/virtio/virtio.h"
@@ -30,6 +32,7 @@
 #include "hw/virtio/virtio-access.h"
 #include "sysemu/dma.h"
 #include "sysemu/runstate.h"
+#include "sysemu/xen.h"
 #include "virtio-qmp.h"
 
 #include "standard-headers/linux/virtio_ids.h"
@@ -117,6 +120,71 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/*
+ * Elements with up to VIRTQUEUE_ELEM_CACHE_SG descriptors in each direction
+ * are kept in a per-queue cache of at most VIRTQUEUE_ELEM_CACHE_MAX entries
+ * when they are freed with virtqueue_free_element().
+ */
+#define VIRTQUEUE_ELEM_CACHE_SG  4
+#define VIRTQUEUE_ELEM_CACHE_MAX 256
+
+/* Overlaid on a free element in the cache */
+typedef struct VirtQueueCachedElement {
+    QSLIST_ENTRY(VirtQueueCachedElement) next;
+    unsigned int gen;
+} VirtQueueCachedElement;
+
+/*
+ * Element cache of a virtqueue.  Elements can still be in flight when
+ * their virtqueue is deleted, so caches are never freed; a deleted
+ * virtqueue puts its cache back in a pool for the next virtqueue to
+ * use.  @gen changes whenever the cache changes owner, so that elements
+ * of the previous owner are freed instead of being recycled.
+ */
+struct VirtQueueElementCache {
+    unsigned int gen;
+
+    /* Only accessed by virtqueue_pop() */
+    size_t sz;
+    QSLIST_HEAD(, VirtQueueCachedElement) free;
+
+    /* Pushed by virtqueue_free_element() from any thread */
+    QSLIST_HEAD(, VirtQueueCachedElement) returned;
+    unsigned int count;
+
+    /* Protected by the BQL */
+    QSLIST_ENTRY(VirtQueueElementCache) next;
+};
+
+/* Element caches of deleted virtqueues, protected by the BQL */
+static QSLIST_HEAD(, VirtQueueElementCache) virtqueue_elem_cache_pool =
+    QSLIST_HEAD_INITIALIZER(virtqueue_elem_cache_pool);
+
+/*
+ * Descriptor translation cache.  Guest (IOVA) pages that map to RAM are
+ * cached per virtqueue so that most descriptors can be mapped without
+ * walking the FlatView and the IOMMU.  4 KiB is the smallest granularity
+ * of both RAM sections and IOMMU mappings.
+ */
+#define VIRTQUEUE_MAP_CACHE_SIZE      64
+#define VIRTQUEUE_MAP_CACHE_PAGE_BITS 12
+#define VIRTQUEUE_MAP_CACHE_PAGE_SIZE (1ULL << VIRTQUEUE_MAP_CACHE_PAGE_BITS)
+
+typedef struct VirtQueueMapCacheEntry {
+    hwaddr page;
+    void *host;
+    MemoryRegion *mr;   /* NULL if the entry is unused */
+    bool is_write;
+} VirtQueueMapCacheEntry;
+
+/* Drops the translation caches on unmap events of an IOMMU */
+typedef struct VirtIOMapCacheIOMMU {
+    IOMMUNotifier n;
+    MemoryRegion *mr;
+    VirtIODevice *vdev;
+    QLIST_ENTRY(VirtIOMapCacheIOMMU) next;
+} VirtIOMapCacheIOMMU;
+
 struct VirtQueue
 {
     VRing vring;
@@ -153,6 +221,32 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /*
+     * Element cache, attached by virtio_add_queue().  Elements that fit
+     * in VIRTQUEUE_ELEM_CACHE_SG descriptors per direction are allocated
+     * with a fixed size so that they can be recycled.
+     */
+    VirtQueueElementCache *elem_cache;
+
+    /*
+     * Descriptor translation cache, allocated on first use by
+     * virtqueue_pop().  Each entry holds a mapping of its page, so the
+     * cache is flushed from the main loop as soon as the memory map
+     * changes; @map_cache_lock protects it against a concurrent pop.
+     */
+    QemuMutex map_cache_lock;
+    VirtQueueMapCacheEntry *map_cache;
+
+    /*
+     * Used buffer notification coalescing, see
+     * virtio_queue_set_notify_coalesce().  @notify_timer is NULL when
+     * coalescing is disabled.
+     */
+    QEMUTimer *notify_timer;
+    uint32_t notify_coalesce_packets;
+    uint32_t notify_coalesce_usecs;
+    uint32_t notify_pending;
 };
 
 const char *virtio_device_names[] = {
@@ -814,7 +908,7 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 {
 
     if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
-        virtqueue_packed_rewind(vq, 1);
+        virtqueue_packed_rewind(vq, elem->ndescs);
     } else {
         virtqueue_split_rewind(vq, 1);
     }
@@ -950,20 +1044,62 @@ static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER, a batch of buffers can be returned by writing a
+ * single used descriptor with the id of the last buffer of the batch, the
+ * driver then skips over the descriptors of the whole batch. The lengths of
+ * the other buffers are lost, so only buffers the device did not write to are
+ * folded into the one that follows them.
+ *
+ * Returns the number of descriptors used.
+ */
+static unsigned int virtqueue_packed_fill_in_order(VirtQueue *vq,
+                                                   unsigned int count)
+{
+    unsigned int i, first = 0, off = 0, ndescs = 0;
+
+    for (i = 0; i < count; i++) {
+        ndescs += vq->used_elems[i].ndescs;
+        if (i + 1 < count && !vq->used_elems[i].len) {
+            continue;
+        }
+
+        /* The descriptor of the first batch is written last */
+        if (off) {
+            virtqueue_packed_fill_desc(vq, &vq->used_elems[i], off, false);
+        } else {
+            first = i;
+        }
+        off = ndescs;
+    }
+    virtqueue_packed_fill_desc(vq, &vq->used_elems[first], 0, true);
+
+    return ndescs;
+}
+
 static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
 {
-    unsigned int i, ndescs = 0;
+    unsigned int i, ndescs;
 
     if (unlikely(!vq->vring.desc)) {
         return;
     }
 
-    for (i = 1; i < count; i++) {
-        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], i, false);
-        ndescs += vq->used_elems[i].ndescs;
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        ndescs = virtqueue_packed_fill_in_order(vq, count);
+    } else {
+        /*
+         * Each used descriptor is written where the buffer it returns
+         * started, and the flags of the first one last so the driver sees
+         * the whole batch at once.
+         */
+        ndescs = vq->used_elems[0].ndescs;
+        for (i = 1; i < count; i++) {
+            virtqueue_packed_fill_desc(vq, &vq->used_elems[i], ndescs, false);
+            ndescs += vq->used_elems[i].ndescs;
+        }
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
     }
-    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
-    ndescs += vq->used_elems[0].ndescs;
 
     vq->inuse -= ndescs;
     vq->used_idx += ndescs;
@@ -996,6 +1132,18 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *len, unsigned int num)
+{
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(vq, elems[i], len ? len[i] : 0, i);
+    }
+    virtqueue_flush(vq, num);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1365,11 +1513,132 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
+static void virtqueue_map_cache_flush(VirtQueue *vq)
+{
+    VirtQueueMapCacheEntry *e;
+    int i;
+
+    QEMU_LOCK_GUARD(&vq->map_cache_lock);
+    if (!vq->map_cache) {
+        return;
+    }
+
+    for (i = 0; i < VIRTQUEUE_MAP_CACHE_SIZE; i++) {
+        e = &vq->map_cache[i];
+        if (e->mr) {
+            dma_memory_unmap(vq->vdev->dma_as, e->host,
+                             VIRTQUEUE_MAP_CACHE_PAGE_SIZE,
+                             e->is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                           DMA_DIRECTION_TO_DEVICE, 0);
+            e->mr = NULL;
+        }
+    }
+}
+
+static void virtqueue_map_cache_free(VirtQueue *vq)
+{
+    virtqueue_map_cache_flush(vq);
+    g_free(vq->map_cache);
+    vq->map_cache = NULL;
+}
+
+/*
+ * Try to add the page containing @pa to the translation cache, given that
+ * @pa is mapped at @ptr.  The page must be mapped directly as a whole.
+ */
+static void virtqueue_map_cache_insert(VirtQueue *vq,
+                                       VirtQueueMapCacheEntry *e, hwaddr pa,
+                                       void *ptr, bool is_write)
+{
+    DMADirection dir = is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                  DMA_DIRECTION_TO_DEVICE;
+    hwaddr page = pa & ~(VIRTQUEUE_MAP_CACHE_PAGE_SIZE - 1);
+    hwaddr len = VIRTQUEUE_MAP_CACHE_PAGE_SIZE;
+    ram_addr_t offset;
+    MemoryRegion *mr;
+    void *host;
+
+    host = dma_memory_map(vq->vdev->dma_as, page, &len, dir,
+                          MEMTXATTRS_UNSPECIFIED);
+    if (!host) {
+        return;
+    }
+    mr = memory_region_from_host(host, &offset);
+    if (len != VIRTQUEUE_MAP_CACHE_PAGE_SIZE || host + (pa - page) != ptr ||
+        !mr) {
+        dma_memory_unmap(vq->vdev->dma_as, host, len, dir, 0);
+        return;
+    }
+
+    if (e->mr) {
+        dma_memory_unmap(vq->vdev->dma_as, e->host,
+                         VIRTQUEUE_MAP_CACHE_PAGE_SIZE,
+                         e->is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                       DMA_DIRECTION_TO_DEVICE, 0);
+    }
+    e->page = page;
+    e->host = host;
+    e->mr = mr;
+    e->is_write = is_write;
+}
+
+/*
+ * Map up to *@plen bytes at @pa like dma_memory_map(), going through the
+ * translation cache of @vq.  *@mr is set to the RAM region the buffer is
+ * in if it was found in (or added to) the cache, NULL otherwise.
+ */
+static void *virtqueue_map_cached(VirtQueue *vq, hwaddr pa, hwaddr *plen,
+                                  bool is_write, MemoryRegion **mr)
+{
+    VirtIODevice *vdev = vq->vdev;
+    hwaddr page = pa & ~(VIRTQUEUE_MAP_CACHE_PAGE_SIZE - 1);
+    VirtQueueMapCacheEntry *e;
+    void *ptr;
+
+    *mr = NULL;
+    if (vdev->map_cache_disabled) {
+        return dma_memory_map(vdev->dma_as, pa, plen,
+                              is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                         DMA_DIRECTION_TO_DEVICE,
+                              MEMTXATTRS_UNSPECIFIED);
+    }
+
+    QEMU_LOCK_GUARD(&vq->map_cache_lock);
+    if (unlikely(!vq->map_cache)) {
+        vq->map_cache = g_new0(VirtQueueMapCacheEntry,
+                               VIRTQUEUE_MAP_CACHE_SIZE);
+    }
+
+    e = &vq->map_cache[((page >> VIRTQUEUE_MAP_CACHE_PAGE_BITS) * 2 +
+                        is_write) % VIRTQUEUE_MAP_CACHE_SIZE];
+    if (e->mr && e->page == page && e->is_write == is_write) {
+        /* The caller unmaps the buffer, which drops this reference */
+        memory_region_ref(e->mr);
+        *plen = MIN(*plen, page + VIRTQUEUE_MAP_CACHE_PAGE_SIZE - pa);
+        *mr = e->mr;
+        return e->host + (pa - page);
+    }
+
+    ptr = dma_memory_map(vdev->dma_as, pa, plen,
+                         is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                    DMA_DIRECTION_TO_DEVICE,
+                         MEMTXATTRS_UNSPECIFIED);
+    if (ptr) {
+        virtqueue_map_cache_insert(vq, e, pa, ptr, is_write);
+        if (e->mr && e->page == page && e->is_write == is_write) {
+            *mr = e->mr;
+        }
+    }
+    return ptr;
+}
+
+static bool virtqueue_map_desc(VirtQueue *vq, unsigned int *p_num_sg,
                                hwaddr *addr, struct iovec *iov,
                                unsigned int max_num_sg, bool is_write,
                                hwaddr pa, size_t sz)
 {
+    VirtIODevice *vdev = vq->vdev;
+    MemoryRegion *last_mr = NULL;
     bool ok = false;
     unsigned num_sg = *p_num_sg;
     assert(num_sg <= max_num_sg);
@@ -1381,25 +1650,38 @@ static bool virtqueue_map_desc(VirtIODevice *vdev, unsigned int *p_num_sg,
 
     while (sz) {
         hwaddr len = sz;
+        MemoryRegion *mr;
+        void *ptr;
 
-        if (num_sg == max_num_sg) {
-            virtio_error(vdev, "virtio: too many write descriptors in "
-                               "indirect table");
+        ptr = virtqueue_map_cached(vq, pa, &len, is_write, &mr);
+        if (!ptr) {
+            virtio_error(vdev, "virtio: bogus descriptor or out of resources");
             goto out;
         }
 
-        iov[num_sg].iov_base = dma_memory_map(vdev->dma_as, pa, &len,
-                                              is_write ?
-                                              DMA_DIRECTION_FROM_DEVICE :
-                                              DMA_DIRECTION_TO_DEVICE,
-                                              MEMTXATTRS_UNSPECIFIED);
-        if (!iov[num_sg].iov_base) {
-            virtio_error(vdev, "virtio: bogus descriptor or out of resources");
+        /* Coalesce pages of a buffer that are contiguous in the same RAM */
+        if (mr && mr == last_mr &&
+            iov[num_sg - 1].iov_base + iov[num_sg - 1].iov_len == ptr) {
+            memory_region_unref(mr);
+            iov[num_sg - 1].iov_len += len;
+            sz -= len;
+            pa += len;
+            continue;
+        }
+
+        if (num_sg == max_num_sg) {
+            dma_memory_unmap(vdev->dma_as, ptr, len,
+                             is_write ? DMA_DIRECTION_FROM_DEVICE :
+                                        DMA_DIRECTION_TO_DEVICE, 0);
+            virtio_error(vdev, "virtio: too many write descriptors in "
+                               "indirect table");
             goto out;
         }
 
+        iov[num_sg].iov_base = ptr;
         iov[num_sg].iov_len = len;
         addr[num_sg] = pa;
+        last_mr = mr;
 
         sz -= len;
         pa += len;
@@ -1461,32 +1743,192 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/*
+ * Lay out an element of size @sz with room for @in_cap and @out_cap
+ * descriptors at @elem.  If @elem is NULL, only compute the size.
+ */
+static size_t virtqueue_init_element(VirtQueueElement *elem, size_t sz,
+                                     unsigned out_cap, unsigned in_cap)
 {
-    VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
-    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
-    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t out_addr_ofs = in_addr_ofs + in_cap * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_cap * sizeof(elem->out_addr[0]);
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
-    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    size_t out_sg_ofs = in_sg_ofs + in_cap * sizeof(elem->in_sg[0]);
+    size_t out_sg_end = out_sg_ofs + out_cap * sizeof(elem->out_sg[0]);
+
+    if (elem) {
+        elem->in_addr = (void *)elem + in_addr_ofs;
+        elem->out_addr = (void *)elem + out_addr_ofs;
+        elem->in_sg = (void *)elem + in_sg_ofs;
+        elem->out_sg = (void *)elem + out_sg_ofs;
+    }
+    return out_sg_end;
+}
+
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
+{
+    VirtQueueElement *elem;
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+
+    if (vq && vq->elem_cache && out_num <= VIRTQUEUE_ELEM_CACHE_SG &&
+        in_num <= VIRTQUEUE_ELEM_CACHE_SG &&
+        (!vq->elem_cache->sz || vq->elem_cache->sz == sz)) {
+        VirtQueueElementCache *cache = vq->elem_cache;
+        VirtQueueCachedElement *cached;
+
+        cache->sz = sz;
+        for (;;) {
+            if (QSLIST_EMPTY(&cache->free)) {
+                QSLIST_MOVE_ATOMIC(&cache->free, &cache->returned);
+            }
+            cached = QSLIST_FIRST(&cache->free);
+            if (!cached) {
+                break;
+            }
+            QSLIST_REMOVE_HEAD(&cache->free, next);
+            qatomic_dec(&cache->count);
+            if (cached->gen == cache->gen) {
+                break;
+            }
+            /* Returned late by a previous owner of the cache */
+            g_free(cached);
+        }
+        if (cached) {
+            elem = (VirtQueueElement *)cached;
+        } else {
+            elem = g_malloc(virtqueue_init_element(NULL, sz,
+                                                   VIRTQUEUE_ELEM_CACHE_SG,
+                                                   VIRTQUEUE_ELEM_CACHE_SG));
+        }
+        virtqueue_init_element(elem, sz, VIRTQUEUE_ELEM_CACHE_SG,
+                               VIRTQUEUE_ELEM_CACHE_SG);
+        elem->cache = cache;
+        elem->cache_gen = cache->gen;
+    } else {
+        elem = g_malloc(virtqueue_init_element(NULL, sz, out_num, in_num));
+        virtqueue_init_element(elem, sz, out_num, in_num);
+        elem->cache = NULL;
+    }
+
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
     elem->out_num = out_num;
     elem->in_num = in_num;
-    elem->in_addr = (void *)elem + in_addr_ofs;
-    elem->out_addr = (void *)elem + out_addr_ofs;
-    elem->in_sg = (void *)elem + in_sg_ofs;
-    elem->out_sg = (void *)elem + out_sg_ofs;
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+void virtqueue_free_element(void *opaque)
+{
+    VirtQueueElement *elem = opaque;
+    VirtQueueElementCache *cache;
+    VirtQueueCachedElement *cached;
+    unsigned int gen;
+
+    if (!elem) {
+        return;
+    }
+
+    cache = elem->cache;
+    gen = elem->cache_gen;
+    if (!cache || gen != qatomic_read(&cache->gen) ||
+        qatomic_read(&cache->count) >= VIRTQUEUE_ELEM_CACHE_MAX) {
+        g_free(elem);
+        return;
+    }
+
+    /*
+     * The cache may still change owner before the element is pushed;
+     * virtqueue_pop() checks the generation again.
+     */
+    cached = (VirtQueueCachedElement *)elem;
+    cached->gen = gen;
+    qatomic_inc(&cache->count);
+    QSLIST_INSERT_HEAD_ATOMIC(&cache->returned, cached, next);
+}
+
+static void virtqueue_element_cache_purge(VirtQueueElementCache *cache)
+{
+    VirtQueueCachedElement *cached, *next_cached;
+    unsigned int n = 0;
+
+    QSLIST_FOREACH_SAFE(cached, &cache->free, next, next_cached) {
+        g_free(cached);
+        n++;
+    }
+    QSLIST_MOVE_ATOMIC(&cache->free, &cache->returned);
+    QSLIST_FOREACH_SAFE(cached, &cache->free, next, next_cached) {
+        g_free(cached);
+        n++;
+    }
+    QSLIST_INIT(&cache->free);
+    qatomic_sub(&cache->count, n);
+    cache->sz = 0;
+}
+
+/* Called with the BQL held */
+static void virtqueue_attach_element_cache(VirtQueue *vq)
+{
+    VirtQueueElementCache *cache;
+
+    cache = QSLIST_FIRST(&virtqueue_elem_cache_pool);
+    if (cache) {
+        QSLIST_REMOVE_HEAD(&virtqueue_elem_cache_pool, next);
+        /* Drop elements returned since the previous owner detached */
+        virtqueue_element_cache_purge(cache);
+    } else {
+        cache = g_new0(VirtQueueElementCache, 1);
+    }
+    vq->elem_cache = cache;
+}
+
+/*
+ * Called with the BQL held.  Elements of @vq that are still in flight
+ * are freed by virtqueue_free_element() when they are returned.
+ */
+static void virtqueue_purge_element_cache(VirtQueue *vq)
+{
+    VirtQueueElementCache *cache = vq->elem_cache;
+
+    if (!cache) {
+        return;
+    }
+
+    vq->elem_cache = NULL;
+    qatomic_inc(&cache->gen);
+    virtqueue_element_cache_purge(cache);
+    QSLIST_INSERT_HEAD(&virtqueue_elem_cache_pool, cache, next);
+}
+
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_pop_get_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+/*
+ * Pop the element at last_avail_idx, which the caller has checked to be
+ * available.  Does not update the avail event.
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_split_pop_avail(VirtQueue *vq, size_t sz,
+                                       VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1498,14 +1940,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1520,23 +1954,8 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1564,7 +1983,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1573,7 +1992,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1595,7 +2014,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1620,10 +2039,91 @@ err_undo_map:
     goto done;
 }
 
-static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
 {
-    unsigned int i, max;
     VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = virtqueue_pop_get_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_avail(vq, sz, caches);
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    uint16_t num_heads;
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* Only read the avail index if the shadow does not cover the batch */
+    num_heads = vq->shadow_avail_idx - vq->last_avail_idx;
+    if (num_heads < max) {
+        num_heads = vring_avail_idx(vq) - vq->last_avail_idx;
+    }
+    if (!num_heads) {
+        return 0;
+    }
+    if (num_heads > vq->vring.num) {
+        virtio_error(vq->vdev, "Guest moved used index from %u to %u",
+                     vq->last_avail_idx, vq->shadow_avail_idx);
+        return 0;
+    }
+    /* See comment in virtqueue_num_heads() */
+    smp_rmb();
+
+    caches = virtqueue_pop_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    for (i = 0; i < max; i++) {
+        elems[i] = virtqueue_split_pop_avail(vq, sz, caches);
+        if (!elems[i]) {
+            break;
+        }
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return i;
+}
+
+/*
+ * Pop the element at last_avail_idx, which the caller has checked to be
+ * available.
+ *
+ * Called within rcu_read_lock().
+ */
+static void *virtqueue_packed_pop_avail(VirtQueue *vq, size_t sz,
+                                        VRingMemoryRegionCaches *caches)
+{
+    unsigned int i, max;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1636,11 +2136,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     uint16_t id;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_packed_empty_rcu(vq)) {
-        goto done;
-    }
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1653,17 +2148,6 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     i = vq->last_avail_idx;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_packed_desc_read(vdev, &desc, desc_cache, i, true);
     id = desc.id;
@@ -1692,7 +2176,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
         bool map_ok;
 
         if (desc.flags & VRING_DESC_F_WRITE) {
-            map_ok = virtqueue_map_desc(vdev, &in_num, addr + out_num,
+            map_ok = virtqueue_map_desc(vq, &in_num, addr + out_num,
                                         iov + out_num,
                                         VIRTQUEUE_MAX_SIZE - out_num, true,
                                         desc.addr, desc.len);
@@ -1701,7 +2185,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
                 virtio_error(vdev, "Incorrect order for descriptors");
                 goto err_undo_map;
             }
-            map_ok = virtqueue_map_desc(vdev, &out_num, addr, iov,
+            map_ok = virtqueue_map_desc(vq, &out_num, addr, iov,
                                         VIRTQUEUE_MAX_SIZE, false,
                                         desc.addr, desc.len);
         }
@@ -1721,7 +2205,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1755,6 +2239,102 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_packed_empty_rcu(vq)) {
+        return NULL;
+    }
+
+    caches = virtqueue_pop_get_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    return virtqueue_packed_pop_avail(vq, sz, caches);
+}
+
+/*
+ * Count how many descriptors starting at last_avail_idx, up to @max, the
+ * driver has made available.
+ *
+ * Called within rcu_read_lock().
+ */
+static unsigned int virtqueue_packed_avail_descs(VirtQueue *vq,
+                                                 VRingMemoryRegionCaches *caches,
+                                                 unsigned int max)
+{
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    uint16_t flags;
+    unsigned int n;
+
+    for (n = 0; n < max; n++) {
+        vring_packed_desc_read_flags(vq->vdev, &flags, &caches->desc, idx);
+        if (!is_desc_avail(flags, wrap_counter)) {
+            break;
+        }
+        if (++idx >= vq->vring.num) {
+            idx = 0;
+            wrap_counter ^= 1;
+        }
+    }
+
+    /* Make sure the flags are read before the rest of the descriptors */
+    if (n) {
+        smp_rmb();
+    }
+
+    return n;
+}
+
+static unsigned int virtqueue_packed_pop_batch(VirtQueue *vq, size_t sz,
+                                               void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int i, avail = 0;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.desc)) {
+        return 0;
+    }
+
+    caches = virtqueue_pop_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    for (i = 0; i < max; i++) {
+        VirtQueueElement *elem;
+
+        /*
+         * Each descriptor carries its own avail flag: scan the flags of the
+         * next descriptors at once, rather than polling them one by one.
+         * The driver makes a chain available by writing the flags of its
+         * head last, so every descriptor after an available head is
+         * available too.
+         */
+        if (!avail) {
+            avail = virtqueue_packed_avail_descs(vq, caches,
+                                                 MIN(max - i, vq->vring.num));
+            if (!avail) {
+                break;
+            }
+        }
+
+        elem = virtqueue_packed_pop_avail(vq, sz, caches);
+        if (!elem) {
+            break;
+        }
+        elems[i] = elem;
+        avail -= MIN(avail, elem->ndescs);
+    }
+
+    return i;
+}
+
 void *virtqueue_pop(VirtQueue *vq, size_t sz)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -1768,6 +2348,20 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_packed_pop_batch(vq, sz, elems, max);
+    } else {
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1903,7 +2497,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2072,6 +2666,11 @@ static void __virtio_queue_reset(VirtIODevice *vdev, uint32_t i)
     vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
     vdev->vq[i].inuse = 0;
     virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+    virtqueue_map_cache_flush(&vdev->vq[i]);
+    if (vdev->vq[i].notify_timer) {
+        timer_del(vdev->vq[i].notify_timer);
+    }
+    vdev->vq[i].notify_pending = 0;
 }
 
 void virtio_queue_reset(VirtIODevice *vdev, uint32_t queue_index)
@@ -2314,6 +2913,10 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
     vdev->vq[i].used_elems = g_new0(VirtQueueElement, queue_size);
+    virtqueue_attach_element_cache(&vdev->vq[i]);
+    virtio_queue_set_notify_coalesce(&vdev->vq[i],
+                                     vdev->notify_coalesce_packets,
+                                     vdev->notify_coalesce_usecs);
 
     return &vdev->vq[i];
 }
@@ -2325,6 +2928,14 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    /* The queue is going away, drop pending notifications */
+    timer_free(vq->notify_timer);
+    vq->notify_timer = NULL;
+    vq->notify_pending = 0;
+    vq->notify_coalesce_packets = 0;
+    vq->notify_coalesce_usecs = 0;
+    virtqueue_purge_element_cache(vq);
+    virtqueue_map_cache_free(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2417,7 +3028,7 @@ static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 }
 
 /* Called within rcu_read_lock().  */
-static bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
         return virtio_packed_should_notify(vdev, vq);
@@ -2461,7 +3072,7 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static void virtio_notify_now(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
         if (!virtio_should_notify(vdev, vq)) {
@@ -2473,6 +3084,75 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
     virtio_irq(vq);
 }
 
+static void virtio_notify_coalesce_timer(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    vq->notify_pending = 0;
+    virtio_notify_now(vq->vdev, vq);
+}
+
+/* Send the notifications held back by coalescing right away */
+static void virtio_notify_coalesce_flush(VirtQueue *vq)
+{
+    if (vq->notify_pending) {
+        timer_del(vq->notify_timer);
+        virtio_notify_coalesce_timer(vq);
+    }
+}
+
+/*
+ * virtio_queue_set_notify_coalesce:
+ * @vq: the virtqueue
+ * @max_packets: notify after this many used buffer notifications, 0 for
+ *               no limit
+ * @max_usecs: notify at most this many microseconds after the first held
+ *             back notification, 0 to disable coalescing
+ *
+ * Coalesce the used buffer notifications sent by virtio_notify(), in the
+ * spirit of VIRTIO_NET_F_NOTF_COAL.  Whether the driver wants to be notified
+ * is only checked when the notification is eventually sent, so event index
+ * and VRING_AVAIL_F_NO_INTERRUPT keep working.  Notifications sent through
+ * virtio_notify_irqfd() are not coalesced.
+ */
+void virtio_queue_set_notify_coalesce(VirtQueue *vq, uint32_t max_packets,
+                                      uint32_t max_usecs)
+{
+    if (vq->notify_timer) {
+        virtio_notify_coalesce_flush(vq);
+        if (!max_usecs) {
+            timer_free(vq->notify_timer);
+            vq->notify_timer = NULL;
+        }
+    } else if (max_usecs) {
+        vq->notify_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                        virtio_notify_coalesce_timer, vq);
+    }
+
+    vq->notify_coalesce_packets = max_packets;
+    vq->notify_coalesce_usecs = max_usecs;
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (vq->notify_timer) {
+        vq->notify_pending++;
+        if (!vq->notify_coalesce_packets ||
+            vq->notify_pending < vq->notify_coalesce_packets) {
+            if (!timer_pending(vq->notify_timer)) {
+                timer_mod(vq->notify_timer,
+                          qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) +
+                          vq->notify_coalesce_usecs);
+            }
+            return;
+        }
+        timer_del(vq->notify_timer);
+        vq->notify_pending = 0;
+    }
+
+    virtio_notify_now(vdev, vq);
+}
+
 void virtio_notify_config(VirtIODevice *vdev)
 {
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK))
@@ -3123,8 +3803,23 @@ static void virtio_vmstate_change(void *opaque, bool running, RunState state)
     BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     bool backend_run = running && virtio_device_started(vdev, vdev->status);
+    int i;
+
     vdev->vm_running = running;
 
+    /*
+     * The coalescing timers do not run while the VM is stopped and are not
+     * migrated, so deliver what they hold back now.
+     */
+    if (!running) {
+        for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+            if (vdev->vq[i].vring.num == 0) {
+                break;
+            }
+            virtio_notify_coalesce_flush(&vdev->vq[i]);
+        }
+    }
+
     if (backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -3175,6 +3870,7 @@ void virtio_init(VirtIODevice *vdev, uint16_t device_id, size_t config_size)
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
+        qemu_mutex_init(&vdev->vq[i].map_cache_lock);
         vdev->vq[i].queue_index = i;
         vdev->vq[i].host_notifier_enabled = false;
     }
@@ -3579,6 +4275,22 @@ void G_GNUC_PRINTF(2, 3) virtio_error(VirtIODevice *vdev, const char *fmt, ...)
     vdev->broken = true;
 }
 
+/*
+ * Drop the cached descriptor translations of all virtqueues, releasing
+ * their mappings so that no RAM region or IOMMU page stays pinned.
+ */
+static void virtio_map_cache_flush_all(VirtIODevice *vdev)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.num == 0) {
+            continue;
+        }
+        virtqueue_map_cache_flush(&vdev->vq[i]);
+    }
+}
+
 static void virtio_memory_listener_commit(MemoryListener *listener)
 {
     VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
@@ -3590,6 +4302,76 @@ static void virtio_memory_listener_commit(MemoryListener *listener)
         }
         virtio_init_region_cache(vdev, i);
     }
+    virtio_map_cache_flush_all(vdev);
+}
+
+static void virtio_map_cache_iommu_notify(IOMMUNotifier *n,
+                                          IOMMUTLBEntry *iotlb)
+{
+    VirtIOMapCacheIOMMU *iommu = container_of(n, VirtIOMapCacheIOMMU, n);
+
+    virtio_map_cache_flush_all(iommu->vdev);
+}
+
+static void virtio_memory_listener_region_add(MemoryListener *listener,
+                                              MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    VirtIOMapCacheIOMMU *iommu;
+    IOMMUMemoryRegion *iommu_mr;
+    Error *local_err = NULL;
+    Int128 end;
+    int iommu_idx;
+
+    if (!memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    iommu_mr = IOMMU_MEMORY_REGION(section->mr);
+
+    iommu = g_new0(VirtIOMapCacheIOMMU, 1);
+    end = int128_add(int128_make64(section->offset_within_region),
+                     section->size);
+    end = int128_sub(end, int128_one());
+    iommu_idx = memory_region_iommu_attrs_to_index(iommu_mr,
+                                                   MEMTXATTRS_UNSPECIFIED);
+    iommu_notifier_init(&iommu->n, virtio_map_cache_iommu_notify,
+                        IOMMU_NOTIFIER_UNMAP,
+                        section->offset_within_region,
+                        int128_get64(end),
+                        iommu_idx);
+    iommu->mr = section->mr;
+    iommu->vdev = vdev;
+    if (memory_region_register_iommu_notifier(section->mr, &iommu->n,
+                                              &local_err)) {
+        /* Without invalidations, translations cannot be cached */
+        error_free(local_err);
+        g_free(iommu);
+        vdev->map_cache_disabled = true;
+        return;
+    }
+    QLIST_INSERT_HEAD(&vdev->map_cache_iommus, iommu, next);
+}
+
+static void virtio_memory_listener_region_del(MemoryListener *listener,
+                                              MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    VirtIOMapCacheIOMMU *iommu;
+
+    if (!memory_region_is_iommu(section->mr)) {
+        return;
+    }
+
+    QLIST_FOREACH(iommu, &vdev->map_cache_iommus, next) {
+        if (iommu->mr == section->mr &&
+            iommu->n.start == section->offset_within_region) {
+            memory_region_unregister_iommu_notifier(iommu->mr, &iommu->n);
+            QLIST_REMOVE(iommu, next);
+            g_free(iommu);
+            break;
+        }
+    }
 }
 
 static void virtio_device_realize(DeviceState *dev, Error **errp)
@@ -3617,7 +4399,11 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
     }
 
     vdev->listener.commit = virtio_memory_listener_commit;
+    vdev->listener.region_add = virtio_memory_listener_region_add;
+    vdev->listener.region_del = virtio_memory_listener_region_del;
     vdev->listener.name = "virtio";
+    /* The Xen map cache does not keep mappings stable */
+    vdev->map_cache_disabled = xen_enabled();
     memory_listener_register(&vdev->listener, vdev->dma_as);
     QTAILQ_INSERT_TAIL(&virtio_list, vdev, next);
 }
@@ -3650,7 +4436,13 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtqueue_purge_element_cache(&vdev->vq[i]);
+        virtqueue_map_cache_free(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        timer_free(vdev->vq[i].notify_timer);
+    }
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        qemu_mutex_destroy(&vdev->vq[i].map_cache_lock);
     }
     g_free(vdev->vq);
 }
@@ -3671,6 +4463,10 @@ static Property virtio_properties[] = {
     DEFINE_PROP_BOOL("use-disabled-flag", VirtIODevice, use_disabled_flag, true),
     DEFINE_PROP_BOOL("x-disable-legacy-check", VirtIODevice,
                      disable_legacy_check, false),
+    DEFINE_PROP_UINT32("notify-coalesce-packets", VirtIODevice,
+                       notify_coalesce_packets, 0),
+    DEFINE_PROP_UINT32("notify-coalesce-usecs", VirtIODevice,
+                       notify_coalesce_usecs, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -19,6 +19,7 @@
 #endif
 #include "qemu/coroutine-core.h"
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
@@ -202,6 +203,7 @@ struct AioContext {
 
     int thread_pool_min;
     int thread_pool_max;
+    bool thread_pool_numa_affine;
     /* Thread pool for performing work and receiving completion callbacks.
      * Has its own locking.
      */
@@ -241,10 +243,26 @@ struct AioContext {
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
+    bool poll_adaptive;     /* size poll_ns from event inter-arrival times */
+
+    /* Preemption tracking for adaptive polling */
+    int64_t poll_contention_check;  /* when to sample preemptions next */
+    long poll_nivcsw;               /* involuntary context switches so far */
+    bool poll_contended;            /* were we preempted recently? */
+
+    /* Userspace polling statistics, updated by the event loop thread */
+    Stat64 poll_hits;       /* polling rounds that found an event */
+    Stat64 poll_misses;     /* polling rounds that timed out */
+    Stat64 poll_time_ns;    /* total time spent polling */
+    Stat64 poll_throttled;  /* rounds skipped due to the CPU budget */
 
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
 
+    /* io_uring engine parameters, used when linux_io_uring is created */
+    int64_t io_uring_entries;       /* ring size, 0 for the default */
+    int64_t io_uring_sqpoll_idle;   /* SQPOLL idle time in ms, 0 disables */
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -762,6 +780,26 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_poll_adaptive:
+ * @ctx: the aio context
+ * @adaptive: whether to size the polling time from the measured interval
+ *            between events instead of using @grow and @shrink
+ *
+ * In adaptive mode the polling time covers the expected time until the next
+ * event of the busiest handler, is capped by poll_max_ns, and is halved while
+ * the thread is being preempted by other tasks on the host.
+ */
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   Error **errp);
+
+/**
+ * aio_set_poll_cpu_budget:
+ * @percent: CPU time that all AioContexts together may spend busy polling,
+ *           in percent of one host CPU, 0 means that there is no limit
+ */
+void aio_set_poll_cpu_budget(int64_t percent, Error **errp);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
@@ -771,12 +809,28 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp);
 
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @entries: number of submission queue entries of the io_uring ring, 0 means
+ *           that the engine will use its default
+ * @sqpoll_idle: idle time in milliseconds of the kernel submission queue
+ *               polling thread, 0 means that no such thread is used
+ *
+ * The parameters cannot be changed once the ring has been created.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t entries,
+                                     int64_t sqpoll_idle, Error **errp);
+
 /**
  * aio_context_set_thread_pool_params:
  * @ctx: the aio context
  * @min: min number of threads to have readily available in the thread pool
  * @min: max number of threads the thread pool can contain
+ * @numa_affine: keep the worker threads on the host NUMA node that the
+ *               AioContext's thread runs on
  */
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
-                                        int64_t max, Error **errp);
+                                        int64_t max, bool numa_affine,
+                                        Error **errp);
 #endif
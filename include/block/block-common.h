@@ -85,6 +85,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if compressed writes may span several clusters, which the block
+     * driver then compresses in parallel
+     */
+    bool can_compress_multiple_clusters;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
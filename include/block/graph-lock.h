@@ -167,6 +167,15 @@ bdrv_graph_rdlock_main_loop(void);
 void TSA_RELEASE_SHARED(graph_lock) TSA_NO_TSA
 bdrv_graph_rdunlock_main_loop(void);
 
+/*
+ * bdrv_graph_generation:
+ * Return a value that changes every time the graph may have been modified,
+ * i.e. whenever the writer lock has been taken.  While the value is
+ * unchanged, no node has been attached, detached or freed, so pointers to
+ * nodes and edges that were seen in the graph still identify them.
+ */
+uint64_t GRAPH_RDLOCK bdrv_graph_generation(void);
+
 /*
  * assert_bdrv_graph_readable:
  * Make sure that the reader is either the main loop,
@@ -270,6 +270,25 @@ struct MemoryRegionOps {
                                     uint64_t data,
                                     unsigned size,
                                     MemTxAttrs attrs);
+    /*
+     * Optional: read or write a contiguous span of @size bytes starting at
+     * @addr (relative to @mr) in a single call.  @buf holds the bytes in the
+     * order they appear in the address space, as for RAM, and @size is not
+     * limited by @impl.max_access_size.  When provided, accesses wider than
+     * @impl.max_access_size are not split into a series of @read/@write
+     * calls, and neither are spans of address_space_read/write() that
+     * split evenly into valid, aligned accesses of @valid.max_access_size.
+     */
+    MemTxResult (*read_bulk)(void *opaque,
+                             hwaddr addr,
+                             void *buf,
+                             hwaddr size,
+                             MemTxAttrs attrs);
+    MemTxResult (*write_bulk)(void *opaque,
+                              hwaddr addr,
+                              const void *buf,
+                              hwaddr size,
+                              MemTxAttrs attrs);
 
     enum device_endian endianness;
     /* Guest-visible constraints: */
@@ -2513,6 +2532,37 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          MemOp op,
                                          MemTxAttrs attrs);
 
+/**
+ * memory_region_dispatch_read_bulk: read a span of bytes directly from the
+ * specified MemoryRegion with its #MemoryRegionOps.read_bulk callback.
+ *
+ * @mr: #MemoryRegion to access; memory_region_has_bulk_ops() must be true
+ * @addr: address within that region
+ * @buf: buffer which the data is written to, in address space byte order
+ * @len: number of bytes to read
+ * @attrs: memory transaction attributes to use for the access
+ */
+MemTxResult memory_region_dispatch_read_bulk(MemoryRegion *mr,
+                                             hwaddr addr,
+                                             void *buf,
+                                             hwaddr len,
+                                             MemTxAttrs attrs);
+/**
+ * memory_region_dispatch_write_bulk: write a span of bytes directly to the
+ * specified MemoryRegion with its #MemoryRegionOps.write_bulk callback.
+ *
+ * @mr: #MemoryRegion to access; memory_region_has_bulk_ops() must be true
+ * @addr: address within that region
+ * @buf: data to write, in address space byte order
+ * @len: number of bytes to write
+ * @attrs: memory transaction attributes to use for the access
+ */
+MemTxResult memory_region_dispatch_write_bulk(MemoryRegion *mr,
+                                              hwaddr addr,
+                                              const void *buf,
+                                              hwaddr len,
+                                              MemTxAttrs attrs);
+
 /**
  * address_space_init: initializes an address space
  *
@@ -2860,6 +2910,49 @@ MemTxResult address_space_write_cached_slow(MemoryRegionCache *cache,
 int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr);
 bool prepare_mmio_access(MemoryRegion *mr);
 
+/**
+ * memory_region_has_bulk_ops: check whether accesses to an I/O region can be
+ * dispatched as a whole span with memory_region_dispatch_read_bulk() or
+ * memory_region_dispatch_write_bulk().
+ *
+ * Regions that need to see individual accesses, because they validate them
+ * with @valid.accepts or match writes against ioeventfds, are excluded.
+ *
+ * @mr: the #MemoryRegion, which must not be an alias
+ * @is_write: whether the access is a write
+ */
+static inline bool memory_region_has_bulk_ops(MemoryRegion *mr, bool is_write)
+{
+    if (mr->ops->valid.accepts) {
+        return false;
+    }
+    if (is_write) {
+        return mr->ops->write_bulk && !mr->ioeventfd_nb;
+    } else {
+        return mr->ops->read_bulk;
+    }
+}
+
+/**
+ * memory_region_can_dispatch_bulk: check whether a span of an I/O region
+ * can be handed to memory_region_dispatch_read_bulk() or
+ * memory_region_dispatch_write_bulk() in one go.
+ *
+ * The span must split evenly into aligned accesses of the maximum valid
+ * access size, and such an access must pass memory_region_access_valid().
+ * Other spans must be split into individual accesses, which are checked
+ * one by one.
+ *
+ * @mr: the #MemoryRegion, which must not be an alias
+ * @addr: address of the span within @mr
+ * @len: length of the span
+ * @is_write: whether the access is a write
+ * @attrs: memory transaction attributes to use for the access
+ */
+bool memory_region_can_dispatch_bulk(MemoryRegion *mr, hwaddr addr,
+                                     hwaddr len, bool is_write,
+                                     MemTxAttrs attrs);
+
 static inline bool memory_access_is_direct(MemoryRegion *mr, bool is_write)
 {
     if (is_write) {
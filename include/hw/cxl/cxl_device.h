@@ -387,6 +387,14 @@ MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
                            unsigned size, MemTxAttrs attrs);
 MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
                             unsigned size, MemTxAttrs attrs);
+/*
+ * Access @len bytes of a type 3 device at once. The span must not cross an
+ * interleave granule, i.e. it must be contiguous in device physical address.
+ */
+MemTxResult cxl_type3_read_bulk(PCIDevice *d, hwaddr host_addr, void *buf,
+                                hwaddr len, MemTxAttrs attrs);
+MemTxResult cxl_type3_write_bulk(PCIDevice *d, hwaddr host_addr,
+                                 const void *buf, hwaddr len, MemTxAttrs attrs);
 
 bool cxl_is_remote_root_port(PCIDevice *d);
 PCIDevice *cxl_get_root_port(PCIDevice *d);
@@ -140,6 +140,8 @@ typedef struct VirtioNetRssData {
     bool    populate_hash;
     uint32_t hash_types;
     uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+    /* Lookup table of key, for software RSS */
+    struct NetToeplitzTable *toeplitz;
     uint16_t indirections_len;
     uint16_t *indirections_table;
     uint16_t default_queue;
@@ -154,6 +156,15 @@ typedef struct VirtIONetQueue {
     struct {
         VirtQueueElement *elem;
     } async_tx;
+    /* TX elements the peer transmits from without a copy, oldest first */
+    struct {
+        VirtQueueElement **elems;   /* ring of tx_queue_size entries */
+        unsigned int head;
+        unsigned int num;
+        bool detach;                /* drop them instead of completing */
+    } zerocopy_tx;
+    /* rx_vq needs a notification at the end of the current RX batch */
+    bool rx_notify_pending;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -169,6 +180,8 @@ struct VirtIONet {
     QTAILQ_HEAD(, VirtioNetRscChain) rsc_chains;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    /* Nesting depth of RX batches, see NetClientInfo.receive_batch_begin */
+    unsigned int rx_batch;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -58,6 +58,7 @@ size_t virtio_get_config_size(const VirtIOConfigSizeParams *params,
                               uint64_t host_features);
 
 typedef struct VirtQueue VirtQueue;
+typedef struct VirtQueueElementCache VirtQueueElementCache;
 
 #define VIRTQUEUE_MAX_SIZE 1024
 
@@ -72,6 +73,9 @@ typedef struct VirtQueueElement
     hwaddr *out_addr;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    /* Element cache the element returns to, if any, and its generation */
+    VirtQueueElementCache *cache;
+    unsigned int cache_gen;
 } VirtQueueElement;
 
 #define VIRTIO_QUEUE_MAX 1024
@@ -155,6 +159,18 @@ struct VirtIODevice
     QLIST_HEAD(, VirtQueue) *vector_queues;
     QTAILQ_ENTRY(VirtIODevice) next;
     EventNotifier config_notifier;
+    /*
+     * Descriptor translation caches of the virtqueues are dropped on
+     * memory topology changes and IOMMU invalidations.
+     */
+    bool map_cache_disabled;
+    QLIST_HEAD(, VirtIOMapCacheIOMMU) map_cache_iommus;
+    /*
+     * Default used buffer notification coalescing of the virtqueues, see
+     * virtio_queue_set_notify_coalesce().
+     */
+    uint32_t notify_coalesce_packets;
+    uint32_t notify_coalesce_usecs;
 };
 
 struct VirtioDeviceClass {
@@ -246,8 +262,49 @@ bool virtqueue_rewind(VirtQueue *vq, unsigned int num);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
 
+/**
+ * virtqueue_push_batch() - complete several elements at once
+ * @vq: the virtqueue
+ * @elems: the elements, in the order they are returned to the driver
+ * @len: number of bytes written to each element, or NULL if none was
+ *       written to
+ * @num: number of elements
+ *
+ * Like calling virtqueue_push() for each element, but the used ring index
+ * is only updated once.  The caller is responsible for a single
+ * virtio_notify() afterwards.
+ */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          const unsigned int *len, unsigned int num);
+
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+
+/**
+ * virtqueue_pop_batch() - pop several elements at once
+ * @vq: the virtqueue
+ * @sz: size of each element, as for virtqueue_pop()
+ * @elems: array receiving the elements
+ * @max: capacity of @elems
+ *
+ * Like calling virtqueue_pop() up to @max times, but for split rings the
+ * avail index is read, and the avail event written, once per batch.
+ *
+ * Returns: the number of elements stored in @elems.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
+
+/**
+ * virtqueue_free_element() - free an element returned by virtqueue_pop()
+ * @elem: the element, or the device request that embeds it
+ *
+ * Put @elem back in the element cache of the queue it was popped from, so
+ * that it can be reused by a later virtqueue_pop() on that queue without a
+ * trip through the allocator.  Elements may also be freed with g_free(), in
+ * which case they are simply not reused.  May be called from any thread.
+ */
+void virtqueue_free_element(void *elem);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
@@ -258,6 +315,8 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes);
 
+/* Called within rcu_read_lock().  */
+bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq);
 void virtio_notify_irqfd(VirtIODevice *vdev, VirtQueue *vq);
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq);
 
@@ -278,6 +337,8 @@ void virtio_notify_config(VirtIODevice *vdev);
 
 bool virtio_queue_get_notification(VirtQueue *vq);
 void virtio_queue_set_notification(VirtQueue *vq, int enable);
+void virtio_queue_set_notify_coalesce(VirtQueue *vq, uint32_t max_packets,
+                                      uint32_t max_usecs);
 
 int virtio_queue_ready(VirtQueue *vq);
 
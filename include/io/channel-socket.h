@@ -261,5 +261,32 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Enable QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY on a connected socket, if the
+ * host supports it for this socket type.  Client sockets connected with
+ * qio_channel_socket_connect_sync() have it enabled already.
+ *
+ * Returns: true if zero copy writes are available
+ */
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc);
+
+/**
+ * qio_channel_socket_poll_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Process the zero copy completion notifications that are already
+ * available, without blocking.  Unlike qio_channel_flush() this can be
+ * used from coroutine context.  The buffer of a write made with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY can be reused once @zero_copy_sent has
+ * reached the value @zero_copy_queued had after the write.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc, Error **errp);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
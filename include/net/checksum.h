@@ -108,4 +108,49 @@ void net_toeplitz_add(uint32_t *result,
     *result = accumulator;
 }
 
+/* Longest Toeplitz hash input: IPv6 source and destination, and L4 ports */
+#define NET_TOEPLITZ_MAX_INPUT 36
+
+/*
+ * Precomputed contribution of every byte value at every input position to
+ * the Toeplitz hash for a given key, so that hashing takes one lookup per
+ * input byte instead of eight shifts.
+ */
+typedef struct NetToeplitzTable {
+    uint32_t byte[NET_TOEPLITZ_MAX_INPUT][256];
+} NetToeplitzTable;
+
+/**
+ * net_toeplitz_table_init: build the lookup table for a Toeplitz key
+ *
+ * @table: the table to fill
+ * @key: the key; bytes past @key_len are taken as zero
+ * @key_len: length of @key in bytes
+ */
+void net_toeplitz_table_init(NetToeplitzTable *table,
+                             const uint8_t *key, size_t key_len);
+
+/**
+ * net_toeplitz_table_hash: compute a Toeplitz hash
+ *
+ * @table: the lookup table of the key
+ * @input: the hash input
+ * @len: length of @input in bytes, at most NET_TOEPLITZ_MAX_INPUT
+ *
+ * Returns the same value as net_toeplitz_add() with the key of @table.
+ */
+static inline
+uint32_t net_toeplitz_table_hash(const NetToeplitzTable *table,
+                                 const uint8_t *input, size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    assert(len <= NET_TOEPLITZ_MAX_INPUT);
+    for (i = 0; i < len; i++) {
+        hash ^= table->byte[i][input[i]];
+    }
+    return hash;
+}
+
 #endif /* QEMU_NET_CHECKSUM_H */
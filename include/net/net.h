@@ -47,8 +47,13 @@ typedef bool (NetCanReceive)(NetClientState *);
 typedef int (NetStart)(NetClientState *);
 typedef int (NetLoad)(NetClientState *);
 typedef void (NetStop)(NetClientState *);
+typedef void (NetBatch)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef ssize_t (NetReceiveIOVZeroCopy)(NetClientState *, const struct iovec *,
+                                        int, bool *);
+typedef void (NetZeroCopyComplete)(NetClientState *, unsigned int);
+typedef void (NetZeroCopyFlush)(NetClientState *);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -76,6 +81,23 @@ typedef struct NetClientInfo {
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
     NetCanReceive *can_receive;
+    /*
+     * Optional: bracket a burst of packets received back to back, so that
+     * they can be completed at once.  Calls may nest.
+     */
+    NetBatch *receive_batch_begin;
+    NetBatch *receive_batch_end;
+    /*
+     * Optional zero copy transmission, see qemu_sendv_packet_zerocopy().
+     * receive_iov_zerocopy() sets its last argument if it keeps referencing
+     * the iovec after returning; the packets are handed back to the sender,
+     * oldest first, through its zerocopy_complete().  zerocopy_flush()
+     * makes the receiver hand back all packets it holds for its peer,
+     * waiting until it no longer references them.
+     */
+    NetReceiveIOVZeroCopy *receive_iov_zerocopy;
+    NetZeroCopyComplete *zerocopy_complete;
+    NetZeroCopyFlush *zerocopy_flush;
     NetStart *start;
     NetLoad *load;
     NetStop *stop;
@@ -116,6 +138,7 @@ struct NetClientState {
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     bool is_datapath;
+    uint64_t zerocopy_sent; /* packets the peer took without a copy */
     QTAILQ_HEAD(, NetFilterState) filters;
 };
 
@@ -172,6 +195,11 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *nc,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb, bool *held);
+void qemu_net_zerocopy_complete(NetClientState *nc, unsigned int num);
+void qemu_net_zerocopy_flush(NetClientState *nc);
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_receive_packet_iov(NetClientState *nc,
@@ -180,6 +208,8 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
@@ -32,6 +32,8 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The receiver may keep transmitting from the buffer, see net.h */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 /* Returns:
  *   >0 - success
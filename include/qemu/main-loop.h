@@ -36,6 +36,8 @@ OBJECT_DECLARE_TYPE(MainLoop, MainLoopClass, MAIN_LOOP)
 
 struct MainLoop {
     EventLoopBase parent_obj;
+
+    int64_t poll_cpu_budget;
 };
 typedef struct MainLoop MainLoop;
 
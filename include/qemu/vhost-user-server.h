@@ -23,7 +23,8 @@ typedef struct VuFdWatch {
     VuDev *vu_dev;
     int fd; /*kick fd*/
     void *pvt;
-    vu_watch_cb cb;
+    vu_watch_cb cb; /* NULL once removed, see remove_watch() */
+    AioContext *queue_ctx; /* per-queue context or NULL for VuServer->ctx */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -31,7 +32,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, unless a
+ * virtqueue has been given its own AioContext in @queue_ctx.
  */
 typedef struct {
     QIONetListener *listener;
@@ -40,12 +42,24 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
-    /* Protected by ctx lock */
+    /*
+     * Per-virtqueue AioContexts (max_queues entries, NULL entries use ctx) or
+     * NULL.  Kicks of these virtqueues are handled with the queue's AioContext
+     * lock held, and vhost-user messages are processed with all of them held.
+     */
+    AioContext **queue_ctx;
+    bool queues_locked; /* queue_ctx locks held by vu_client_trip() */
+    bool kicks_stopped; /* no new requests may be started */
+
+    /* Accessed atomically */
     unsigned int refcount;
     bool wait_idle;
+
+    /* Protected by ctx lock */
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
     QIOChannelSocket *sioc; /* The underlying data channel with the client */
+    QemuMutex vu_fd_watches_lock; /* also taken from queue_ctx threads */
     QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
 
     Coroutine *co_trip; /* coroutine for processing VhostUserMsg */
@@ -55,6 +69,7 @@ bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp);
 
@@ -63,6 +78,8 @@ void vhost_user_server_stop(VuServer *server);
 void vhost_user_server_ref(VuServer *server);
 void vhost_user_server_unref(VuServer *server);
 
+AioContext *vhost_user_server_get_queue_ctx(VuServer *server, int idx);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
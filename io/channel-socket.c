@@ -163,15 +163,7 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    qio_channel_socket_enable_zero_copy(ioc);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -723,11 +715,34 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 #endif /* WIN32 */
 
 
+bool qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc)
+{
 #ifdef QEMU_MSG_ZEROCOPY
-static int qio_channel_socket_flush(QIOChannel *ioc,
-                                    Error **errp)
+    int v = 1;
+
+    if (!qio_channel_has_feature(QIO_CHANNEL(ioc),
+                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY) &&
+        setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+        /* Zero copy available on host */
+        qio_channel_set_feature(QIO_CHANNEL(ioc),
+                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    }
+#endif
+    return qio_channel_has_feature(QIO_CHANNEL(ioc),
+                                   QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+}
+
+#ifdef QEMU_MSG_ZEROCOPY
+/*
+ * Read zero copy completions from the error queue until all queued writes
+ * have completed or, if @wait is false, until the error queue is empty.
+ * Returns -1 on error, 0 if any write was sent with zero copy and 1 if all
+ * of them were copied.
+ */
+static int qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc,
+                                             bool wait, Error **errp)
 {
-    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
     struct msghdr msg = {};
     struct sock_extended_err *serr;
     struct cmsghdr *cm;
@@ -750,6 +765,9 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
         if (received < 0) {
             switch (errno) {
             case EAGAIN:
+                if (!wait) {
+                    return ret;
+                }
                 /* Nothing on errqueue, wait until something is available */
                 qio_channel_wait(ioc, G_IO_ERR);
                 continue;
@@ -794,6 +812,25 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
     return ret;
 }
 
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    return qio_channel_socket_reap_zero_copy(QIO_CHANNEL_SOCKET(ioc), true,
+                                             errp);
+}
+
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc, Error **errp)
+{
+    return qio_channel_socket_reap_zero_copy(ioc, false, errp) < 0 ? -1 : 0;
+}
+
+#else /* QEMU_MSG_ZEROCOPY */
+
+int qio_channel_socket_poll_zero_copy(QIOChannelSocket *ioc, Error **errp)
+{
+    return 0;
+}
+
 #endif /* QEMU_MSG_ZEROCOPY */
 
 static int
@@ -167,12 +167,28 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
         return;
     }
 
+    aio_context_set_poll_adaptive(iothread->ctx, iothread->poll_adaptive,
+                                  errp);
+    if (*errp) {
+        return;
+    }
+
     aio_context_set_aio_params(iothread->ctx,
                                iothread->parent_obj.aio_max_batch,
                                errp);
+    if (*errp) {
+        return;
+    }
+
+    aio_context_set_io_uring_params(iothread->ctx, base->io_uring_entries,
+                                    base->io_uring_sqpoll_idle, errp);
+    if (*errp) {
+        return;
+    }
 
     aio_context_set_thread_pool_params(iothread->ctx, base->thread_pool_min,
-                                       base->thread_pool_max, errp);
+                                       base->thread_pool_max,
+                                       base->thread_pool_numa_affine, errp);
 }
 
 
@@ -291,6 +307,24 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static bool iothread_get_poll_adaptive(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return iothread->poll_adaptive;
+}
+
+static void iothread_set_poll_adaptive(Object *obj, bool value, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_adaptive = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_adaptive(iothread->ctx, value, errp);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -310,6 +344,9 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add_bool(klass, "poll-adaptive",
+                                   iothread_get_poll_adaptive,
+                                   iothread_set_poll_adaptive);
 }
 
 static const TypeInfo iothread_info = {
@@ -356,6 +393,13 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
     info->aio_max_batch = iothread->parent_obj.aio_max_batch;
+    info->poll_adaptive = iothread->poll_adaptive;
+    if (iothread->ctx) {
+        info->poll_hits = stat64_get(&iothread->ctx->poll_hits);
+        info->poll_misses = stat64_get(&iothread->ctx->poll_misses);
+        info->poll_time_ns = stat64_get(&iothread->ctx->poll_time_ns);
+        info->poll_throttled = stat64_get(&iothread->ctx->poll_throttled);
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
@@ -227,6 +227,14 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
         monitor_printf(mon, "  aio-max-batch=%" PRId64 "\n",
                        value->aio_max_batch);
+        monitor_printf(mon, "  poll-adaptive=%s\n",
+                       value->poll_adaptive ? "on" : "off");
+        monitor_printf(mon, "  poll-hits=%" PRId64 "\n", value->poll_hits);
+        monitor_printf(mon, "  poll-misses=%" PRId64 "\n", value->poll_misses);
+        monitor_printf(mon, "  poll-time-ns=%" PRId64 "\n",
+                       value->poll_time_ns);
+        monitor_printf(mon, "  poll-throttled=%" PRId64 "\n",
+                       value->poll_throttled);
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -29,6 +29,10 @@
 #include "qemu/units.h"
 #include "qemu/memalign.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/resource.h>
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
 /* Dirty bitmaps use 'NBD_META_ID_DIRTY_BITMAP + i', so keep this id last. */
@@ -42,6 +46,15 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * MSG_ZEROCOPY only pays off for large writes; read buffers sent with it
+ * stay allocated until the kernel reports completion, up to
+ * NBD_ZERO_COPY_MAX_PENDING bytes per client (less if RLIMIT_MEMLOCK is
+ * lower, as the kernel locks the pages while they are in flight).
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (16 * KiB)
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -85,6 +98,22 @@ struct NBDRequestData {
     bool complete;
 };
 
+/* A read buffer that may still be referenced by a zero copy write */
+typedef struct NBDZeroCopyBuffer {
+    uint8_t *data;
+    size_t size;
+    ssize_t seq; /* zero_copy_queued of the socket after the last write */
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
+typedef QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) NBDZeroCopyBufferList;
+
+/* The read buffers of a closed client, kept until their writes complete */
+typedef struct NBDZeroCopyDrain {
+    QIOChannelSocket *sioc;
+    NBDZeroCopyBufferList buffers;
+} NBDZeroCopyDrain;
+
 struct NBDExport {
     BlockExport common;
 
@@ -101,6 +130,8 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -146,6 +177,12 @@ struct NBDClient {
     bool structured_reply;
     NBDExportMetaContexts export_meta;
 
+    /* Send read payloads with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY */
+    bool zero_copy;
+    size_t zero_copy_pending; /* bytes in zero_copy_buffers */
+    size_t zero_copy_max_pending;
+    NBDZeroCopyBufferList zero_copy_buffers;
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -1452,6 +1489,116 @@ static int nbd_receive_request(NBDClient *client, NBDRequest *request,
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Free the buffers in @list whose zero copy writes have completed on @sioc,
+ * or all of them if @all is true.  Returns the number of bytes freed.
+ */
+static size_t nbd_zero_copy_free(QIOChannelSocket *sioc,
+                                 NBDZeroCopyBufferList *list, bool all)
+{
+    NBDZeroCopyBuffer *buf;
+    size_t freed = 0;
+
+    while ((buf = QSIMPLEQ_FIRST(list)) &&
+           (all || buf->seq <= sioc->zero_copy_sent)) {
+        QSIMPLEQ_REMOVE_HEAD(list, next);
+        freed += buf->size;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+    return freed;
+}
+
+/* Free the read buffers whose zero copy writes have completed */
+static void nbd_client_release_zero_copy(NBDClient *client)
+{
+    /* Socket errors are reported by the next read or write */
+    qio_channel_socket_poll_zero_copy(client->sioc, NULL);
+    client->zero_copy_pending -= nbd_zero_copy_free(client->sioc,
+                                                    &client->zero_copy_buffers,
+                                                    false);
+}
+
+static gboolean nbd_zero_copy_drain_ready(QIOChannel *ioc,
+                                          GIOCondition condition,
+                                          gpointer opaque)
+{
+    NBDZeroCopyDrain *drain = opaque;
+    ssize_t sent = drain->sioc->zero_copy_sent;
+    int err;
+    socklen_t len = sizeof(err);
+
+    if (qio_channel_socket_poll_zero_copy(drain->sioc, NULL) == 0) {
+        nbd_zero_copy_free(drain->sioc, &drain->buffers, false);
+        if (QSIMPLEQ_EMPTY(&drain->buffers)) {
+            goto done;
+        }
+        if (drain->sioc->zero_copy_sent == sent) {
+            /* POLLERR comes from a socket error rather than a completion */
+            getsockopt(drain->sioc->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* The error queue is unreadable, no completion will ever come */
+    nbd_zero_copy_free(drain->sioc, &drain->buffers, true);
+done:
+    object_unref(OBJECT(drain->sioc));
+    g_free(drain);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * MSG_ZEROCOPY pins the pages of the read buffers but does not copy them,
+ * so the buffers of a closed client must outlive it until the kernel has
+ * reported completion for every write.  Keep them with a reference to the
+ * socket and free them from its error queue watch.
+ */
+static void nbd_client_drain_zero_copy(NBDClient *client)
+{
+    NBDZeroCopyDrain *drain;
+
+    nbd_client_release_zero_copy(client);
+    if (QSIMPLEQ_EMPTY(&client->zero_copy_buffers)) {
+        return;
+    }
+
+    drain = g_new(NBDZeroCopyDrain, 1);
+    drain->sioc = client->sioc;
+    object_ref(OBJECT(drain->sioc));
+    QSIMPLEQ_INIT(&drain->buffers);
+    QSIMPLEQ_CONCAT(&drain->buffers, &client->zero_copy_buffers);
+    client->zero_copy_pending = 0;
+
+    qio_channel_add_watch(QIO_CHANNEL(drain->sioc), G_IO_ERR,
+                          nbd_zero_copy_drain_ready, drain, NULL);
+}
+
+/*
+ * Keep the read buffer of @req if it may have been passed to a zero copy
+ * write, i.e. if the socket queued any since @seq.
+ */
+static void nbd_request_hold_zero_copy(NBDRequestData *req, size_t size,
+                                       ssize_t seq)
+{
+    NBDClient *client = req->client;
+    NBDZeroCopyBuffer *buf;
+
+    if (req->data && client->sioc->zero_copy_queued != seq) {
+        buf = g_new(NBDZeroCopyBuffer, 1);
+        *buf = (NBDZeroCopyBuffer) {
+            .data = req->data,
+            .size = size,
+            .seq = client->sioc->zero_copy_queued,
+        };
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_buffers, buf, next);
+        client->zero_copy_pending += size;
+        req->data = NULL;
+    }
+
+    nbd_client_release_zero_copy(client);
+}
+
 void nbd_client_get(NBDClient *client)
 {
     client->refcount++;
@@ -1465,6 +1612,7 @@ void nbd_client_put(NBDClient *client)
          */
         assert(client->closing);
 
+        nbd_client_drain_zero_copy(client);
         qio_channel_detach_aio_context(client->ioc);
         object_unref(OBJECT(client->sioc));
         object_unref(OBJECT(client->ioc));
@@ -1771,6 +1919,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1870,8 +2019,66 @@ const BlockExportDriver blk_exp_nbd = {
     .request_shutdown   = nbd_export_request_shutdown,
 };
 
-static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
-                                        unsigned niov, Error **errp)
+static bool nbd_client_can_zero_copy(NBDClient *client, size_t size)
+{
+    return client->zero_copy && size >= NBD_ZERO_COPY_MIN_SIZE &&
+           client->zero_copy_pending + size <= client->zero_copy_max_pending;
+}
+
+/* The locked memory limit is shared by the whole process */
+static size_t nbd_zero_copy_max_pending(void)
+{
+    size_t max = NBD_ZERO_COPY_MAX_PENDING;
+#ifdef CONFIG_LINUX
+    struct rlimit rlim;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 &&
+        rlim.rlim_cur != RLIM_INFINITY) {
+        max = MIN(max, rlim.rlim_cur);
+    }
+#endif
+    return max;
+}
+
+/*
+ * Send @iov with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, falling back to a copy
+ * for whatever the kernel refuses to send that way, typically with ENOBUFS
+ * when the locked memory limit has been reached.  Real socket errors are
+ * reported by the copying write.
+ */
+static int coroutine_fn nbd_co_send_zero_copy(NBDClient *client,
+                                              const struct iovec *iov,
+                                              Error **errp)
+{
+    struct iovec local_iov = *iov;
+    ssize_t len;
+
+    while (local_iov.iov_len) {
+        len = qio_channel_writev_full(client->ioc, &local_iov, 1, NULL, 0,
+                                      QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, NULL);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (len < 0) {
+            trace_nbd_co_send_zero_copy_fallback(local_iov.iov_len);
+            return qio_channel_writev_all(client->ioc, &local_iov, 1, errp);
+        }
+        local_iov.iov_base += len;
+        local_iov.iov_len -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Send a reply.  If @read_payload is true, the last element of @iov is a
+ * read buffer that nbd_request_hold_zero_copy() keeps alive, so it may be
+ * sent without copying.
+ */
+static int coroutine_fn nbd_co_send_iov_full(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             bool read_payload, Error **errp)
 {
     int ret;
 
@@ -1879,7 +2086,18 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
 
-    ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ? -EIO : 0;
+    if (read_payload && nbd_client_can_zero_copy(client,
+                                                 iov[niov - 1].iov_len)) {
+        /* The reply header lives on the stack, copy it */
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = nbd_co_send_zero_copy(client, &iov[niov - 1], errp);
+        }
+        ret = ret < 0 ? -EIO : 0;
+    } else {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp) < 0 ?
+              -EIO : 0;
+    }
 
     client->send_coroutine = NULL;
     qemu_co_mutex_unlock(&client->send_lock);
@@ -1887,6 +2105,12 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov, Error **errp)
+{
+    return nbd_co_send_iov_full(client, iov, niov, false, errp);
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1913,7 +2137,9 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    /* Only NBD_CMD_READ replies carry a payload */
+    return nbd_co_send_iov_full(client, iov, len ? 2 : 1, len != 0,
+                                errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1962,7 +2188,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_full(client, iov, 2, true, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -2679,7 +2905,12 @@ static coroutine_fn void nbd_trip(void *opaque)
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
+        ssize_t zero_copy_seq = client->sioc->zero_copy_queued;
+
         ret = nbd_handle_request(client, &request, req->data, &local_err);
+        if (client->zero_copy && request.type == NBD_CMD_READ) {
+            nbd_request_hold_zero_copy(req, request.len, zero_copy_seq);
+        }
     }
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
@@ -2734,6 +2965,13 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* TLS encrypts into its own buffers, zero copy would not help */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy = qio_channel_socket_enable_zero_copy(client->sioc);
+        client->zero_copy_max_pending = nbd_zero_copy_max_pending();
+    }
+    trace_nbd_co_client_start_zero_copy(client->zero_copy);
+
     nbd_client_receive_next_request(client);
 }
 
@@ -2763,6 +3001,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->ioc = QIO_CHANNEL(sioc);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
+    QSIMPLEQ_INIT(&client->zero_copy_buffers);
 
     co = qemu_coroutine_create(nbd_co_client_start, client);
     qemu_coroutine_enter(co);
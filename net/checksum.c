@@ -18,6 +18,7 @@
 #include "qemu/osdep.h"
 #include "net/checksum.h"
 #include "net/eth.h"
+#include "qemu/host-utils.h"
 
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
@@ -206,3 +207,37 @@ net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
     }
     return res;
 }
+
+/* The 32 bits of @key starting at bit @bit, most significant bit first */
+static uint32_t net_toeplitz_key_window(const uint8_t *key, size_t key_len,
+                                        unsigned int bit)
+{
+    size_t byte = bit / 8;
+    uint64_t window = 0;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        window = (window << 8) | (byte + i < key_len ? key[byte + i] : 0);
+    }
+    return window >> (8 - bit % 8);
+}
+
+void net_toeplitz_table_init(NetToeplitzTable *table,
+                             const uint8_t *key, size_t key_len)
+{
+    unsigned int i, bit, val;
+    uint32_t window[8];
+
+    for (i = 0; i < NET_TOEPLITZ_MAX_INPUT; i++) {
+        /* Key window XORed in for each bit of the byte, MSB first */
+        for (bit = 0; bit < 8; bit++) {
+            window[bit] = net_toeplitz_key_window(key, key_len, i * 8 + bit);
+        }
+
+        table->byte[i][0] = 0;
+        for (val = 1; val < 256; val++) {
+            table->byte[i][val] = table->byte[i][val & (val - 1)] ^
+                                  window[7 - ctz32(val)];
+        }
+    }
+}
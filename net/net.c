@@ -660,6 +660,34 @@ static ssize_t filter_receive(NetClientState *nc,
     return filter_receive_iov(nc, direction, sender, flags, &iov, 1, sent_cb);
 }
 
+static void qemu_receive_batch_begin(NetClientState *nc)
+{
+    if (nc && nc->info->receive_batch_begin) {
+        nc->info->receive_batch_begin(nc);
+    }
+}
+
+static void qemu_receive_batch_end(NetClientState *nc)
+{
+    if (nc && nc->info->receive_batch_end) {
+        nc->info->receive_batch_end(nc);
+    }
+}
+
+/*
+ * Tell the peer of @nc that the packets sent until qemu_send_batch_end()
+ * come in a burst, so that it can e.g. notify the guest only once.
+ */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    qemu_receive_batch_begin(nc->peer);
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    qemu_receive_batch_end(nc->peer);
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
     if (!nc->peer) {
@@ -671,6 +699,8 @@ void qemu_purge_queued_packets(NetClientState *nc)
 
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
 {
+    bool flushed;
+
     nc->receive_disabled = 0;
 
     if (nc->peer && nc->peer->info->type == NET_CLIENT_DRIVER_HUBPORT) {
@@ -678,7 +708,10 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
             qemu_notify_event();
         }
     }
-    if (qemu_net_queue_flush(nc->incoming_queue)) {
+    qemu_receive_batch_begin(nc);
+    flushed = qemu_net_queue_flush(nc->incoming_queue);
+    qemu_receive_batch_end(nc);
+    if (flushed) {
         /* We emptied the queue successfully, signal to the IO thread to repoll
          * the file descriptor (for tap, for example).
          */
@@ -816,7 +849,15 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
         return 0;
     }
 
-    if (nc->info->receive_iov && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) &&
+        nc->info->receive_iov_zerocopy) {
+        bool held = false;
+
+        ret = nc->info->receive_iov_zerocopy(nc, iov, iovcnt, &held);
+        if (held) {
+            sender->zerocopy_sent++;
+        }
+    } else if (nc->info->receive_iov && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
         ret = nc->info->receive_iov(nc, iov, iovcnt);
     } else {
         ret = nc_sendv_compat(nc, iov, iovcnt, flags);
@@ -829,9 +870,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -845,26 +888,86 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
         return size;
     }
 
-    /* Let filters handle the packet first */
+    /*
+     * Let filters handle the packet first.  Filters may keep a packet they
+     * consume, so they always see it as a copied one.
+     */
     ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                             iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
+                             flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                             iov, iovcnt, sent_cb);
     if (ret) {
         return ret;
     }
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async(), but if the peer supports it, it may
+ * transmit straight from @iov after returning.  In that case *@held is set
+ * and the memory referenced by @iov must stay valid until the peer hands
+ * the packet back through the zerocopy_complete() callback of @sender.
+ * Packets are handed back in the order they were sent.
+ */
+ssize_t qemu_sendv_packet_zerocopy(NetClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb, bool *held)
+{
+    uint64_t zerocopy_sent = sender->zerocopy_sent;
+    ssize_t ret;
+
+    assert(sender->info->zerocopy_complete);
+
+    ret = qemu_sendv_packet_async_with_flags(sender,
+                                             QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                             iov, iovcnt, sent_cb);
+    *held = sender->zerocopy_sent != zerocopy_sent;
+    return ret;
+}
+
+/*
+ * Called by the receiver @nc when the oldest @num packets it holds from its
+ * peer are no longer referenced.
+ */
+void qemu_net_zerocopy_complete(NetClientState *nc, unsigned int num)
+{
+    if (num && nc->peer && nc->peer->info->zerocopy_complete) {
+        nc->peer->info->zerocopy_complete(nc->peer, num);
+    }
+}
+
+/*
+ * Called by the sender @nc when it needs back all packets that its peer
+ * holds, e.g. because the device is reset.  They are handed back through
+ * zerocopy_complete() before this returns, as soon as the peer no longer
+ * references them.
+ */
+void qemu_net_zerocopy_flush(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->zerocopy_flush) {
+        nc->peer->info->zerocopy_flush(nc->peer);
+    }
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -1082,6 +1185,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1186,6 +1292,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -104,7 +104,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     }
     packet = g_malloc(sizeof(NetPacket) + size);
     packet->sender = sender;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY;
     packet->size = size;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
@@ -134,7 +134,8 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     packet = g_malloc(sizeof(NetPacket) + max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
+    /* The packet is copied, so the receiver must not hold on to it */
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY;
     packet->size = 0;
 
     for (i = 0; i < iovcnt; i++) {
@@ -35,6 +35,7 @@
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "io/channel.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
@@ -42,6 +43,20 @@
 #include "qapi/qapi-visit-sockets.h"
 #include "qapi/clone-visitor.h"
 
+/*
+ * MSG_ZEROCOPY only pays off for large writes; smaller packets are copied
+ * as usual.  The stream netdev has no vnet header, so the guest cannot
+ * offload segmentation and packets are at most as large as its MTU: only
+ * jumbo frames, commonly 9000 bytes, take the zero copy path.
+ */
+#define NET_STREAM_ZERO_COPY_MIN_SIZE (8 * KiB)
+
+/* A packet that may still be referenced by a zero copy write */
+typedef struct NetStreamZeroCopyPacket {
+    ssize_t seq;    /* zero_copy_queued of the socket after the write */
+    uint32_t len;   /* length header, sent from here with the packet */
+} NetStreamZeroCopyPacket;
+
 typedef struct NetStreamState {
     NetClientState nc;
     QIOChannel *listen_ioc;
@@ -54,12 +69,22 @@ typedef struct NetStreamState {
     uint32_t reconnect;
     guint timer_tag;
     SocketAddress *addr;
+
+    /* Transmit large packets with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY */
+    bool zero_copy;
+    guint ioc_err_tag;            /* watch for zero copy completions */
+    GQueue zero_copy_held;        /* of NetStreamZeroCopyPacket, in order */
+    /* Unsent end of a packet that was partially written with zero copy */
+    uint8_t *zero_copy_tail;
+    size_t zero_copy_tail_len;
+    size_t zero_copy_tail_index;
 } NetStreamState;
 
 static void net_stream_listen(QIONetListener *listener,
                               QIOChannelSocket *cioc,
                               void *opaque);
 static void net_stream_arm_reconnect(NetStreamState *s);
+static bool net_stream_flush_tail(NetStreamState *s);
 
 static gboolean net_stream_writable(QIOChannel *ioc,
                                     GIOCondition condition,
@@ -69,32 +94,249 @@ static gboolean net_stream_writable(QIOChannel *ioc,
 
     s->ioc_write_tag = 0;
 
+    if (!net_stream_flush_tail(s)) {
+        return G_SOURCE_REMOVE;
+    }
+
     qemu_flush_queued_packets(&s->nc);
 
     return G_SOURCE_REMOVE;
 }
 
-static ssize_t net_stream_receive(NetClientState *nc, const uint8_t *buf,
-                                  size_t size)
+static void net_stream_arm_write(NetStreamState *s)
+{
+    if (!s->ioc_write_tag) {
+        s->ioc_write_tag = qio_channel_add_watch(s->ioc, G_IO_OUT,
+                                                 net_stream_writable, s, NULL);
+    }
+}
+
+/* Hand back the held packets whose zero copy writes have completed */
+static void net_stream_zero_copy_release(NetStreamState *s)
+{
+    NetStreamZeroCopyPacket *pkt;
+    unsigned int num = 0;
+
+    while ((pkt = g_queue_peek_head(&s->zero_copy_held)) &&
+           pkt->seq <= QIO_CHANNEL_SOCKET(s->ioc)->zero_copy_sent) {
+        g_free(g_queue_pop_head(&s->zero_copy_held));
+        num++;
+    }
+
+    if (g_queue_is_empty(&s->zero_copy_held) && s->ioc_err_tag) {
+        g_source_remove(s->ioc_err_tag);
+        s->ioc_err_tag = 0;
+    }
+
+    qemu_net_zerocopy_complete(&s->nc, num);
+}
+
+/* Reap the completions that have arrived, and release their packets */
+static void net_stream_zero_copy_poll(NetStreamState *s)
+{
+    /* Socket errors are reported by the next read or write */
+    qio_channel_socket_poll_zero_copy(QIO_CHANNEL_SOCKET(s->ioc), NULL);
+    net_stream_zero_copy_release(s);
+}
+
+/*
+ * Wait until the kernel is done with every zero copy write, then hand back
+ * all held packets.  MSG_ZEROCOPY pins the pages of the guest buffers but
+ * does not snapshot them, so they must not go back to the guest before the
+ * completion arrives, even if the connection is going away.  On a live
+ * connection this waits until the queued data has been acknowledged.
+ */
+static void net_stream_zero_copy_drain(NetStreamState *s)
+{
+    QIOChannelSocket *sioc;
+
+    if (g_queue_is_empty(&s->zero_copy_held)) {
+        return;
+    }
+
+    sioc = QIO_CHANNEL_SOCKET(s->ioc);
+    if (qio_channel_flush(s->ioc, NULL) < 0) {
+        /*
+         * The error queue is unreadable, so no completion will ever come;
+         * there is nothing left to wait for.
+         */
+        sioc->zero_copy_sent = sioc->zero_copy_queued;
+    }
+    net_stream_zero_copy_release(s);
+}
+
+static gboolean net_stream_zero_copy_ready(QIOChannel *ioc,
+                                           GIOCondition condition,
+                                           gpointer data)
+{
+    NetStreamState *s = data;
+    GPollFD pfd = {
+        .fd = QIO_CHANNEL_SOCKET(ioc)->fd,
+    };
+
+    net_stream_zero_copy_poll(s);
+    if (!s->ioc_err_tag) {
+        return G_SOURCE_REMOVE;
+    }
+
+    /*
+     * If POLLERR is still set, it is a socket error rather than a
+     * completion; stop watching and let the read side handle it.
+     */
+    if (g_poll(&pfd, 1, 0) == 1 && (pfd.revents & G_IO_ERR)) {
+        s->ioc_err_tag = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* Hand back the packets held for the peer as soon as they are unused */
+static void net_stream_zerocopy_flush(NetClientState *nc)
 {
     NetStreamState *s = DO_UPCAST(NetStreamState, nc, nc);
+
+    net_stream_zero_copy_drain(s);
+}
+
+static void net_stream_drop_tail(NetStreamState *s)
+{
+    g_free(s->zero_copy_tail);
+    s->zero_copy_tail = NULL;
+    s->zero_copy_tail_len = 0;
+    s->zero_copy_tail_index = 0;
+}
+
+/*
+ * Write the end of a packet that was partially sent with zero copy.
+ * Returns false if some of it is still pending.
+ */
+static bool net_stream_flush_tail(NetStreamState *s)
+{
+    ssize_t ret;
+
+    if (!s->zero_copy_tail) {
+        return true;
+    }
+
+    ret = qio_channel_write(s->ioc,
+                            (char *)s->zero_copy_tail + s->zero_copy_tail_index,
+                            s->zero_copy_tail_len - s->zero_copy_tail_index,
+                            NULL);
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        ret = 0;
+    }
+    if (ret == -1) {
+        /* The connection is broken, the read side will notice */
+        net_stream_drop_tail(s);
+        return true;
+    }
+
+    s->zero_copy_tail_index += ret;
+    if (s->zero_copy_tail_index < s->zero_copy_tail_len) {
+        net_stream_arm_write(s);
+        return false;
+    }
+    net_stream_drop_tail(s);
+    return true;
+}
+
+/* Copy @iov from @offset on and write it after the zero copy writes */
+static void net_stream_save_tail(NetStreamState *s, const struct iovec *iov,
+                                 int iovcnt, size_t offset)
+{
+    s->zero_copy_tail_len = iov_size(iov, iovcnt) - offset;
+    s->zero_copy_tail = g_malloc(s->zero_copy_tail_len);
+    iov_to_buf(iov, iovcnt, offset, s->zero_copy_tail, s->zero_copy_tail_len);
+    net_stream_flush_tail(s);
+}
+
+/*
+ * Send @iov with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY.  Returns the size of the
+ * packet if it was sent, 0 if the socket is full or -1 if it must be sent
+ * with a copy instead.  @held is set if the packet must be kept until the
+ * write completes.
+ *
+ * The length header goes out in the same write as the guest buffer, so it
+ * lives in the held packet until the completion arrives.
+ */
+static ssize_t net_stream_send_zero_copy(NetStreamState *s,
+                                         const struct iovec *iov, int iovcnt,
+                                         size_t size, bool *held)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(s->ioc);
+    NetStreamZeroCopyPacket *pkt = g_new(NetStreamZeroCopyPacket, 1);
+    struct iovec full_iov[iovcnt + 1];
+    ssize_t ret;
+
+    pkt->len = htonl(size);
+    full_iov[0].iov_base = &pkt->len;
+    full_iov[0].iov_len = sizeof(pkt->len);
+    memcpy(&full_iov[1], iov, iovcnt * sizeof(*iov));
+
+    ret = qio_channel_writev_full(s->ioc, full_iov, iovcnt + 1, NULL, 0,
+                                  QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, NULL);
+    if (ret == QIO_CHANNEL_ERR_BLOCK) {
+        g_free(pkt);
+        net_stream_arm_write(s);
+        return 0;
+    }
+    if (ret < 0) {
+        /* e.g. ENOBUFS when the locked memory limit has been reached */
+        g_free(pkt);
+        return -1;
+    }
+
+    pkt->seq = sioc->zero_copy_queued;
+    g_queue_push_tail(&s->zero_copy_held, pkt);
+    *held = true;
+    if (!s->ioc_err_tag) {
+        s->ioc_err_tag = qio_channel_add_watch(s->ioc, G_IO_ERR,
+                                               net_stream_zero_copy_ready,
+                                               s, NULL);
+    }
+
+    if (ret < (ssize_t)(sizeof(pkt->len) + size)) {
+        /* Copy the rest, so that the packet is complete on the wire */
+        net_stream_save_tail(s, full_iov, iovcnt + 1, ret);
+    }
+
+    return size;
+}
+
+static ssize_t net_stream_receive_iov_full(NetClientState *nc,
+                                           const struct iovec *iov,
+                                           int iovcnt, bool *held)
+{
+    NetStreamState *s = DO_UPCAST(NetStreamState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
-    struct iovec local_iov[2];
+    struct iovec full_iov[iovcnt + 1];
+    struct iovec local_iov[iovcnt + 1];
     unsigned int nlocal_iov;
     size_t remaining;
     ssize_t ret;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    nlocal_iov = iov_copy(local_iov, 2, iov, 2, s->send_index, remaining);
+    if (!net_stream_flush_tail(s)) {
+        return 0;
+    }
+
+    if (held && s->zero_copy && s->send_index == 0 &&
+        size >= NET_STREAM_ZERO_COPY_MIN_SIZE &&
+        qio_channel_has_feature(s->ioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        net_stream_zero_copy_poll(s);
+        ret = net_stream_send_zero_copy(s, iov, iovcnt, size, held);
+        if (ret >= 0) {
+            return ret;
+        }
+    }
+
+    full_iov[0].iov_base = &len;
+    full_iov[0].iov_len = sizeof(len);
+    memcpy(&full_iov[1], iov, iovcnt * sizeof(*iov));
+
+    remaining = iov_size(full_iov, iovcnt + 1) - s->send_index;
+    nlocal_iov = iov_copy(local_iov, iovcnt + 1, full_iov, iovcnt + 1,
+                          s->send_index, remaining);
     ret = qio_channel_writev(s->ioc, local_iov, nlocal_iov, NULL);
     if (ret == QIO_CHANNEL_ERR_BLOCK) {
         ret = 0; /* handled further down */
@@ -105,14 +347,37 @@ static ssize_t net_stream_receive(NetClientState *nc, const uint8_t *buf,
     }
     if (ret < (ssize_t)remaining) {
         s->send_index += ret;
-        s->ioc_write_tag = qio_channel_add_watch(s->ioc, G_IO_OUT,
-                                                 net_stream_writable, s, NULL);
+        net_stream_arm_write(s);
         return 0;
     }
     s->send_index = 0;
     return size;
 }
 
+static ssize_t net_stream_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
+{
+    return net_stream_receive_iov_full(nc, iov, iovcnt, NULL);
+}
+
+static ssize_t net_stream_receive_iov_zerocopy(NetClientState *nc,
+                                               const struct iovec *iov,
+                                               int iovcnt, bool *held)
+{
+    return net_stream_receive_iov_full(nc, iov, iovcnt, held);
+}
+
+static ssize_t net_stream_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_stream_receive_iov_full(nc, &iov, 1, NULL);
+}
+
 static gboolean net_stream_send(QIOChannel *ioc,
                                 GIOCondition condition,
                                 gpointer data);
@@ -164,6 +429,8 @@ static gboolean net_stream_send(QIOChannel *ioc,
             g_source_remove(s->ioc_write_tag);
             s->ioc_write_tag = 0;
         }
+        net_stream_zero_copy_drain(s);
+        net_stream_drop_tail(s);
         if (s->listener) {
             qio_net_listener_set_client_func(s->listener, net_stream_listen,
                                              s, NULL);
@@ -213,6 +480,8 @@ static void net_stream_cleanup(NetClientState *nc)
                 s->ioc_write_tag = 0;
             }
         }
+        net_stream_zero_copy_drain(s);
+        net_stream_drop_tail(s);
         object_unref(OBJECT(s->ioc));
         s->ioc = NULL;
     }
@@ -231,6 +500,9 @@ static NetClientInfo net_stream_info = {
     .type = NET_CLIENT_DRIVER_STREAM,
     .size = sizeof(NetStreamState),
     .receive = net_stream_receive,
+    .receive_iov = net_stream_receive_iov,
+    .receive_iov_zerocopy = net_stream_receive_iov_zerocopy,
+    .zerocopy_flush = net_stream_zerocopy_flush,
     .cleanup = net_stream_cleanup,
 };
 
@@ -250,6 +522,10 @@ static void net_stream_listen(QIONetListener *listener,
     qio_channel_set_name(s->ioc, "stream-server");
     s->nc.link_down = false;
 
+    if (s->zero_copy) {
+        qio_channel_socket_enable_zero_copy(cioc);
+    }
+
     s->ioc_read_tag = qio_channel_add_watch(s->ioc, G_IO_IN, net_stream_send,
                                             s, NULL);
 
@@ -301,6 +577,7 @@ static int net_stream_server_init(NetClientState *peer,
                                   const char *model,
                                   const char *name,
                                   SocketAddress *addr,
+                                  bool zero_copy,
                                   Error **errp)
 {
     NetClientState *nc;
@@ -310,6 +587,7 @@ static int net_stream_server_init(NetClientState *peer,
     nc = qemu_new_net_client(&net_stream_info, peer, model, name);
     s = DO_UPCAST(NetStreamState, nc, nc);
 
+    s->zero_copy = zero_copy;
     s->listen_ioc = QIO_CHANNEL(listen_sioc);
     qio_channel_socket_listen_async(listen_sioc, addr, 0,
                                     net_stream_server_listening, s,
@@ -392,6 +670,7 @@ static int net_stream_client_init(NetClientState *peer,
                                   const char *name,
                                   SocketAddress *addr,
                                   uint32_t reconnect,
+                                  bool zero_copy,
                                   Error **errp)
 {
     NetStreamState *s;
@@ -403,6 +682,7 @@ static int net_stream_client_init(NetClientState *peer,
 
     s->ioc = QIO_CHANNEL(sioc);
     s->nc.link_down = true;
+    s->zero_copy = zero_copy;
 
     s->reconnect = reconnect;
     if (reconnect) {
@@ -419,19 +699,23 @@ int net_init_stream(const Netdev *netdev, const char *name,
                     NetClientState *peer, Error **errp)
 {
     const NetdevStreamOptions *sock;
+    bool zero_copy;
 
     assert(netdev->type == NET_CLIENT_DRIVER_STREAM);
     sock = &netdev->u.stream;
 
+    zero_copy = sock->has_zero_copy && sock->zero_copy;
+
     if (!sock->has_server || !sock->server) {
         return net_stream_client_init(peer, "stream", name, sock->addr,
                                       sock->has_reconnect ? sock->reconnect : 0,
-                                      errp);
+                                      zero_copy, errp);
     }
     if (sock->has_reconnect) {
         error_setg(errp, "'reconnect' option is incompatible with "
                          "socket in server mode");
         return -1;
     }
-    return net_stream_server_init(peer, "stream", name, sock->addr, errp);
+    return net_stream_server_init(peer, "stream", name, sock->addr,
+                                  zero_copy, errp);
 }
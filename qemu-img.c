@@ -41,6 +41,7 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/rcu.h"
 #include "qemu/sockets.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
@@ -86,6 +87,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_THREADS = 278,
 };
 
 typedef enum OutputFormat {
@@ -206,6 +208,8 @@ void help(void)
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
+           "  '--threads' specifies how many I/O threads run those coroutines\n"
+           "       (defaults to 1)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
@@ -1659,8 +1663,23 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/*
+ * A thread with its own AioContext that runs some of the convert coroutines
+ * (see --threads).  It reads from its own copies of the source images.  If
+ * the target can be written in parallel, the worker has its own copy of it
+ * too; otherwise its coroutines move to the main AioContext for writing.
+ */
+typedef struct ImgConvertWorker {
+    QemuThread thread;
+    AioContext *ctx;
+    bool stopping;
+    BlockBackend **src;
+    BlockBackend *target; /* NULL if writes go through ImgConvertState */
+} ImgConvertWorker;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1676,6 +1695,7 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool compress_multiple_clusters;
     bool target_is_new;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
@@ -1688,9 +1708,11 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
-    int running_coroutines;
-    Coroutine *co[MAX_COROUTINES];
-    int64_t wait_sector_num[MAX_COROUTINES];
+    int running_coroutines; /* accessed atomically */
+    Coroutine **co;
+    int64_t *wait_sector_num;
+    long num_threads;
+    ImgConvertWorker *workers; /* num_threads elements if num_threads > 1 */
     CoMutex lock;
     int ret;
 } ImgConvertState;
@@ -1707,7 +1729,8 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+static int convert_iteration_sectors(ImgConvertState *s, BlockBackend **src,
+                                     int64_t sector_num)
 {
     int64_t src_cur_offset;
     int ret, n, src_cur;
@@ -1732,7 +1755,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
-        BlockDriverState *src_bs = blk_bs(s->src[src_cur]);
+        BlockDriverState *src_bs = blk_bs(src[src_cur]);
         BlockDriverState *base;
 
         if (s->target_has_backing) {
@@ -1813,8 +1836,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     return n;
 }
 
-static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
-                                        int nb_sectors, uint8_t *buf)
+static int coroutine_fn convert_co_read(ImgConvertState *s, BlockBackend **src,
+                                        int64_t sector_num, int nb_sectors,
+                                        uint8_t *buf)
 {
     uint64_t single_read_until = 0;
     int n, ret;
@@ -1830,7 +1854,7 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
          * nb_sectors that spreads into the next part. So we must be able to
          * read across multiple BDSes for one convert_read() call. */
         convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
-        blk = s->src[src_cur];
+        blk = src[src_cur];
         bs_sectors = s->src_sectors[src_cur];
 
         offset = (sector_num - src_cur_offset) << BDRV_SECTOR_BITS;
@@ -1867,7 +1891,31 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
-static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+/*
+ * Returns the number of sectors at the start of @buf, up to @n, that make a
+ * run of clusters which are either all zero or all non-zero.
+ */
+static int convert_compressed_run(ImgConvertState *s, const uint8_t *buf,
+                                  int n, bool *is_zero)
+{
+    int cluster_sectors = s->cluster_sectors;
+    int len = MIN(n, cluster_sectors);
+    int i;
+
+    *is_zero = buffer_is_zero(buf, len * BDRV_SECTOR_SIZE);
+    for (i = len; i < n; i += len) {
+        len = MIN(n - i, cluster_sectors);
+        if (buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                           len * BDRV_SECTOR_SIZE) != *is_zero) {
+            break;
+        }
+    }
+    return i;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         BlockBackend *target,
+                                         int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
 {
@@ -1876,6 +1924,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     while (nb_sectors > 0) {
         int n = nb_sectors;
         BdrvRequestFlags flags = s->compressed ? BDRV_REQ_WRITE_COMPRESSED : 0;
+        bool zero_clusters = false;
 
         switch (status) {
         case BLK_BACKING_FILE:
@@ -1890,16 +1939,18 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
+            if (s->compressed) {
+                n = convert_compressed_run(s, buf, n, &zero_clusters);
+            }
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                (s->compressed && !zero_clusters))
             {
-                ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
+                ret = blk_co_pwrite(target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
                     return ret;
@@ -1913,7 +1964,7 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                 assert(!s->target_has_backing);
                 break;
             }
-            ret = blk_co_pwrite_zeroes(s->target,
+            ret = blk_co_pwrite_zeroes(target,
                                        sector_num << BDRV_SECTOR_BITS,
                                        n << BDRV_SECTOR_BITS,
                                        BDRV_REQ_MAY_UNMAP);
@@ -1931,7 +1982,10 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
-static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector_num,
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              BlockBackend **src,
+                                              BlockBackend *target,
+                                              int64_t sector_num,
                                               int nb_sectors)
 {
     int n, ret;
@@ -1944,12 +1998,12 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 
         convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
         offset = (sector_num - src_cur_offset) << BDRV_SECTOR_BITS;
-        blk = s->src[src_cur];
+        blk = src[src_cur];
         bs_sectors = s->src_sectors[src_cur];
 
         n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
 
-        ret = blk_co_copy_range(blk, offset, s->target,
+        ret = blk_co_copy_range(blk, offset, target,
                                 sector_num << BDRV_SECTOR_BITS,
                                 n << BDRV_SECTOR_BITS, 0, 0);
         if (ret < 0) {
@@ -1965,6 +2019,10 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
+    ImgConvertWorker *w = NULL;
+    BlockBackend **src = s->src;
+    BlockBackend *target = s->target;
+    bool shared_target = false;
     uint8_t *buf = NULL;
     int ret, i;
     int index = -1;
@@ -1977,7 +2035,16 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
     }
     assert(index >= 0);
 
-    s->running_coroutines++;
+    if (s->workers) {
+        w = &s->workers[index % s->num_threads];
+        src = w->src;
+        if (w->target) {
+            target = w->target;
+        } else {
+            shared_target = true;
+        }
+    }
+
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
 
     while (1) {
@@ -1992,7 +2059,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
             break;
         }
         WITH_GRAPH_RDLOCK_GUARD() {
-            n = convert_iteration_sectors(s, s->sector_num);
+            n = convert_iteration_sectors(s, src, s->sector_num);
         }
         if (n < 0) {
             qemu_co_mutex_unlock(&s->lock);
@@ -2008,18 +2075,18 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         /* increment global sector counter so that other coroutines can
          * already continue reading beyond this request */
         s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
             qemu_progress_print(100.0 * s->allocated_done /
                                         s->allocated_sectors, 0);
         }
+        qemu_co_mutex_unlock(&s->lock);
 
 retry:
         copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
-            ret = convert_co_read(s, sector_num, n, buf);
+            ret = convert_co_read(s, src, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
@@ -2030,6 +2097,11 @@ retry:
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
+        if (shared_target) {
+            /* Write (in order, if needed) from the target's AioContext */
+            aio_co_reschedule_self(qemu_get_aio_context());
+        }
+
         if (s->wr_in_order) {
             /* keep writes in order */
             while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
@@ -2042,14 +2114,14 @@ retry:
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 WITH_GRAPH_RDLOCK_GUARD() {
-                    ret = convert_co_copy_range(s, sector_num, n);
+                    ret = convert_co_copy_range(s, src, target, sector_num, n);
                 }
                 if (ret) {
                     s->copy_range = false;
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                ret = convert_co_write(s, target, sector_num, n, buf, status);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2074,14 +2146,19 @@ retry:
                 }
             }
         }
+
+        if (shared_target) {
+            aio_co_reschedule_self(w->ctx);
+        }
     }
 
     qemu_vfree(buf);
     s->co[index] = NULL;
-    s->running_coroutines--;
-    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
-        /* the convert job finished successfully */
-        s->ret = 0;
+    /* convert_do_copy() may return as soon as this drops to zero */
+    qatomic_dec(&s->running_coroutines);
+    if (w) {
+        /* Wake up convert_do_copy() */
+        qemu_notify_event();
     }
 }
 
@@ -2096,18 +2173,24 @@ static int convert_do_copy(ImgConvertState *s)
         s->has_zero_init = bdrv_has_zero_init(blk_bs(s->target));
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only whole
+     * clusters can be copied, and only one at a time unless the driver
+     * compresses several clusters in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        if (s->compress_multiple_clusters) {
+            s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors,
+                                             s->cluster_sectors);
+        } else {
+            s->buf_sectors = s->cluster_sectors;
+        }
     }
 
     while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
+        n = convert_iteration_sectors(s, s->src, sector_num);
         if (n < 0) {
             return n;
         }
@@ -2123,15 +2206,31 @@ static int convert_do_copy(ImgConvertState *s)
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    s->co = g_new(Coroutine *, s->num_coroutines);
+    s->wait_sector_num = g_new(int64_t, s->num_coroutines);
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
-        qemu_coroutine_enter(s->co[i]);
+    }
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->workers) {
+            aio_co_enter(s->workers[i % s->num_threads].ctx, s->co[i]);
+        } else {
+            qemu_coroutine_enter(s->co[i]);
+        }
     }
 
-    while (s->running_coroutines) {
+    while (qatomic_load_acquire(&s->running_coroutines)) {
         main_loop_wait(false);
     }
+    g_free(s->co);
+    g_free(s->wait_sector_num);
+
+    if (s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
 
     if (s->compressed && !s->ret) {
         /* signal EOF to align */
@@ -2220,6 +2319,135 @@ static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
     blk_set_io_limits(blk, &cfg);
 }
 
+static void *convert_worker_run(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+
+    rcu_register_thread();
+    qemu_set_current_aio_context(w->ctx);
+
+    while (!qatomic_read(&w->stopping)) {
+        aio_poll(w->ctx, true);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void convert_worker_stop_bh(void *opaque)
+{
+    ImgConvertWorker *w = opaque;
+
+    qatomic_set(&w->stopping, true);
+}
+
+static int convert_worker_attach(ImgConvertWorker *w, BlockBackend *blk)
+{
+    AioContext *old_ctx = qemu_get_aio_context();
+    Error *local_err = NULL;
+    int ret;
+
+    aio_context_acquire(old_ctx);
+    ret = blk_set_aio_context(blk, w->ctx, &local_err);
+    aio_context_release(old_ctx);
+    if (ret < 0) {
+        error_report_err(local_err);
+    }
+    return ret;
+}
+
+static void convert_worker_release(ImgConvertWorker *w, BlockBackend *blk)
+{
+    if (blk && blk_get_aio_context(blk) == w->ctx) {
+        aio_context_acquire(w->ctx);
+        blk_set_aio_context(blk, qemu_get_aio_context(), &error_abort);
+        aio_context_release(w->ctx);
+    }
+    blk_unref(blk);
+}
+
+/*
+ * Start s->num_threads workers, each with its own AioContext and its own
+ * BlockBackends for the source images and, if @target_filename is not NULL,
+ * for the raw target image.
+ */
+static int convert_start_workers(ImgConvertState *s, bool image_opts,
+                                 char **filenames, const char *fmt,
+                                 int src_flags, bool src_writethrough,
+                                 bool force_share, const char *target_filename,
+                                 int flags, bool writethrough)
+{
+    Error *local_err = NULL;
+    int i, j;
+
+    s->workers = g_new0(ImgConvertWorker, s->num_threads);
+
+    for (i = 0; i < s->num_threads; i++) {
+        ImgConvertWorker *w = &s->workers[i];
+
+        w->ctx = aio_context_new(&local_err);
+        if (!w->ctx) {
+            error_report_err(local_err);
+            return -1;
+        }
+        qemu_thread_create(&w->thread, "convert-worker", convert_worker_run,
+                           w, QEMU_THREAD_JOINABLE);
+
+        w->src = g_new0(BlockBackend *, s->src_num);
+        for (j = 0; j < s->src_num; j++) {
+            w->src[j] = img_open(image_opts, filenames[j], fmt, src_flags,
+                                 src_writethrough, s->quiet, force_share);
+            if (!w->src[j] || convert_worker_attach(w, w->src[j]) < 0) {
+                return -1;
+            }
+        }
+
+        if (target_filename) {
+            /* The image is already locked through s->target */
+            QDict *opts = qdict_new();
+
+            qdict_put_str(opts, "file.locking", "off");
+            w->target = img_open_file(target_filename, opts, "raw", flags,
+                                      writethrough, s->quiet, false);
+            if (!w->target || convert_worker_attach(w, w->target) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void convert_stop_workers(ImgConvertState *s)
+{
+    int i, j;
+
+    if (!s->workers) {
+        return;
+    }
+
+    for (i = 0; i < s->num_threads; i++) {
+        ImgConvertWorker *w = &s->workers[i];
+
+        if (!w->ctx) {
+            break;
+        }
+
+        for (j = 0; w->src && j < s->src_num; j++) {
+            convert_worker_release(w, w->src[j]);
+        }
+        g_free(w->src);
+        convert_worker_release(w, w->target);
+
+        aio_bh_schedule_oneshot(w->ctx, convert_worker_stop_bh, w);
+        qemu_thread_join(&w->thread);
+        aio_context_unref(w->ctx);
+    }
+
+    g_free(s->workers);
+    s->workers = NULL;
+}
+
 static int img_convert(int argc, char **argv)
 {
     int c, bs_i, flags, src_flags = BDRV_O_NO_SHARE;
@@ -2251,6 +2479,7 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .num_threads        = 1,
     };
 
     for(;;) {
@@ -2264,6 +2493,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"threads", required_argument, 0, OPTION_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2398,6 +2628,15 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.num_threads) ||
+                s.num_threads < 1 || s.num_threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2410,6 +2649,11 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.num_threads > 1 && (sn_opts || snapshot_name)) {
+        error_report("Cannot use --threads with -l");
+        goto fail_getopt;
+    }
+
     if (s.compressed && s.copy_range) {
         error_report("Cannot enable copy offloading when -c is used");
         goto fail_getopt;
@@ -2763,6 +3007,7 @@ static int img_convert(int argc, char **argv)
         }
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
+        s.compress_multiple_clusters = bdi.can_compress_multiple_clusters;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
@@ -2770,6 +3015,37 @@ static int img_convert(int argc, char **argv)
         set_rate_limit(s.target, rate_limit);
     }
 
+    if (s.num_threads > 1) {
+        BdrvChild *file = out_bs->file;
+        /*
+         * A raw image on a local file or block device can be written by all
+         * threads at once.  Other targets are written from the main thread,
+         * so that formats with metadata keep allocating in order.
+         */
+        bool parallel_target =
+            !tgt_image_opts && !s.compressed && !s.target_has_backing &&
+            !rate_limit && !strcmp(out_bs->drv->format_name, "raw") && file &&
+            (!strcmp(file->bs->drv->format_name, "file") ||
+             !strcmp(file->bs->drv->format_name, "host_device"));
+
+        if (parallel_target) {
+            /* Writes through different BlockBackends cannot be ordered */
+            s.wr_in_order = false;
+        } else {
+            /* Source and target are in different AioContexts */
+            s.copy_range = false;
+        }
+
+        s.num_coroutines *= s.num_threads;
+        ret = convert_start_workers(&s, image_opts, argv + optind, fmt,
+                                    src_flags, src_writethrough, force_share,
+                                    parallel_target ? out_filename : NULL,
+                                    flags, writethrough);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     ret = convert_do_copy(&s);
 
     /* Now copy the bitmaps */
@@ -2785,6 +3061,7 @@ out:
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
+    convert_stop_workers(&s);
     blk_unref(s.target);
     if (s.src) {
         for (bs_i = 0; bs_i < s.src_num; bs_i++) {
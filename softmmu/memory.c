@@ -1413,6 +1413,76 @@ bool memory_region_access_valid(MemoryRegion *mr,
     return true;
 }
 
+/*
+ * Whether an access of @size bytes would be split by
+ * access_with_adjusted_size() but can be handed over to the bulk callback
+ * in one go instead.
+ */
+static bool memory_region_widen_access(MemoryRegion *mr, unsigned size,
+                                       bool is_write)
+{
+    unsigned access_size_max = mr->ops->impl.max_access_size;
+
+    if (!access_size_max) {
+        access_size_max = 4;
+    }
+    return size > access_size_max && memory_region_has_bulk_ops(mr, is_write);
+}
+
+bool memory_region_can_dispatch_bulk(MemoryRegion *mr, hwaddr addr,
+                                     hwaddr len, bool is_write,
+                                     MemTxAttrs attrs)
+{
+    unsigned size = mr->ops->valid.max_access_size;
+
+    if (!memory_region_has_bulk_ops(mr, is_write)) {
+        return false;
+    }
+
+    /* As in memory_access_size(), 1-4 byte accesses unless specified */
+    if (!size) {
+        size = 4;
+    }
+    if (!len || ((addr | len) & (size - 1))) {
+        return false;
+    }
+    return memory_region_access_valid(mr, addr, size, is_write, attrs);
+}
+
+MemTxResult memory_region_dispatch_read_bulk(MemoryRegion *mr,
+                                             hwaddr addr,
+                                             void *buf,
+                                             hwaddr len,
+                                             MemTxAttrs attrs)
+{
+    if (mr->alias) {
+        return memory_region_dispatch_read_bulk(mr->alias,
+                                                mr->alias_offset + addr,
+                                                buf, len, attrs);
+    }
+
+    trace_memory_region_ops_read_bulk(get_cpu_index(), mr, addr, len,
+                                      memory_region_name(mr));
+    return mr->ops->read_bulk(mr->opaque, addr, buf, len, attrs);
+}
+
+MemTxResult memory_region_dispatch_write_bulk(MemoryRegion *mr,
+                                              hwaddr addr,
+                                              const void *buf,
+                                              hwaddr len,
+                                              MemTxAttrs attrs)
+{
+    if (mr->alias) {
+        return memory_region_dispatch_write_bulk(mr->alias,
+                                                 mr->alias_offset + addr,
+                                                 buf, len, attrs);
+    }
+
+    trace_memory_region_ops_write_bulk(get_cpu_index(), mr, addr, len,
+                                       memory_region_name(mr));
+    return mr->ops->write_bulk(mr->opaque, addr, buf, len, attrs);
+}
+
 static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
                                                 hwaddr addr,
                                                 uint64_t *pval,
@@ -1421,6 +1491,19 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
 {
     *pval = 0;
 
+    if (memory_region_widen_access(mr, size, false)) {
+        uint8_t buf[8];
+        MemTxResult r;
+
+        r = memory_region_dispatch_read_bulk(mr, addr, buf, size, attrs);
+        if (memory_region_big_endian(mr)) {
+            *pval = ldn_be_p(buf, size);
+        } else {
+            *pval = ldn_le_p(buf, size);
+        }
+        return r;
+    }
+
     if (mr->ops->read) {
         return access_with_adjusted_size(addr, pval, size,
                                          mr->ops->impl.min_access_size,
@@ -1511,6 +1594,17 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
+    if (memory_region_widen_access(mr, size, true)) {
+        uint8_t buf[8];
+
+        if (memory_region_big_endian(mr)) {
+            stn_be_p(buf, size, data);
+        } else {
+            stn_le_p(buf, size, data);
+        }
+        return memory_region_dispatch_write_bulk(mr, addr, buf, size, attrs);
+    }
+
     if (mr->ops->write) {
         return access_with_adjusted_size(addr, &data, size,
                                          mr->ops->impl.min_access_size,
@@ -2634,12 +2634,18 @@ static MemTxResult flatview_write_continue(FlatView *fv, hwaddr addr,
             /* Keep going. */
         } else if (!memory_access_is_direct(mr, true)) {
             release_lock |= prepare_mmio_access(mr);
-            l = memory_access_size(mr, l, addr1);
-            /* XXX: could force current_cpu to NULL to avoid
-               potential bugs */
-            val = ldn_he_p(buf, l);
-            result |= memory_region_dispatch_write(mr, addr1, val,
-                                                   size_memop(l), attrs);
+            if (memory_region_can_dispatch_bulk(mr, addr1, l, true, attrs)) {
+                /* The whole span within @mr goes out in one call */
+                result |= memory_region_dispatch_write_bulk(mr, addr1, buf, l,
+                                                            attrs);
+            } else {
+                l = memory_access_size(mr, l, addr1);
+                /* XXX: could force current_cpu to NULL to avoid
+                   potential bugs */
+                val = ldn_he_p(buf, l);
+                result |= memory_region_dispatch_write(mr, addr1, val,
+                                                       size_memop(l), attrs);
+            }
         } else {
             /* RAM case */
             ram_ptr = qemu_ram_ptr_length(mr->ram_block, addr1, &l, false);
@@ -2704,10 +2710,16 @@ MemTxResult flatview_read_continue(FlatView *fv, hwaddr addr,
         } else if (!memory_access_is_direct(mr, false)) {
             /* I/O case */
             release_lock |= prepare_mmio_access(mr);
-            l = memory_access_size(mr, l, addr1);
-            result |= memory_region_dispatch_read(mr, addr1, &val,
-                                                  size_memop(l), attrs);
-            stn_he_p(buf, l, val);
+            if (memory_region_can_dispatch_bulk(mr, addr1, l, false, attrs)) {
+                /* The whole span within @mr comes in one call */
+                result |= memory_region_dispatch_read_bulk(mr, addr1, buf, l,
+                                                           attrs);
+            } else {
+                l = memory_access_size(mr, l, addr1);
+                result |= memory_region_dispatch_read(mr, addr1, &val,
+                                                      size_memop(l), attrs);
+                stn_he_p(buf, l, val);
+            }
         } else {
             /* RAM case */
             ram_ptr = qemu_ram_ptr_length(mr->ram_block, addr1, &l, false);
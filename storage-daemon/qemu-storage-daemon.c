@@ -100,7 +100,7 @@ static void help(void)
 "                         once startup is complete\n"
 "\n"
 "  --export [type=]nbd,id=<id>,node-name=<node-name>[,name=<export-name>]\n"
-"           [,writable=on|off][,bitmap=<name>]\n"
+"           [,writable=on|off][,bitmap=<name>][,zero-copy=on|off]\n"
 "                         export the specified block node over NBD\n"
 "                         (requires --nbd-server)\n"
 "\n"
@@ -114,11 +114,13 @@ static void help(void)
 "  --export [type=]vhost-user-blk,id=<id>,node-name=<node-name>,\n"
 "           addr.type=unix,addr.path=<socket-path>[,writable=on|off]\n"
 "           [,logical-block-size=<block-size>][,num-queues=<num-queues>]\n"
+"           [,queue-iothreads.<n>=<iothread-id>]\n"
 "                         export the specified block node as a\n"
 "                         vhost-user-blk device over UNIX domain socket\n"
 "  --export [type=]vhost-user-blk,id=<id>,node-name=<node-name>,\n"
 "           addr.type=fd,addr.str=<fd>[,writable=on|off]\n"
 "           [,logical-block-size=<block-size>][,num-queues=<num-queues>]\n"
+"           [,queue-iothreads.<n>=<iothread-id>]\n"
 "                         export the specified block node as a\n"
 "                         vhost-user-blk device over file descriptor\n"
 "\n"
@@ -197,6 +197,8 @@ extern bool have_movbe;
 #define TCG_TARGET_HAS_v64              have_avx1
 #define TCG_TARGET_HAS_v128             have_avx1
 #define TCG_TARGET_HAS_v256             have_avx2
+/* All element sizes at 512 bits need AVX512BW, and VPMOVM2[DQ] AVX512DQ.  */
+#define TCG_TARGET_HAS_v512             (have_avx512bw && have_avx512dq)
 
 #define TCG_TARGET_HAS_andc_vec         1
 #define TCG_TARGET_HAS_orc_vec          have_avx512vl
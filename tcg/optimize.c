@@ -25,6 +25,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/int128.h"
+#include "exec/exec-all.h"
 #include "tcg/tcg-op.h"
 #include "tcg-internal.h"
 
@@ -44,13 +45,33 @@ typedef struct TempOptInfo {
     uint64_t val;
     uint64_t z_mask;  /* mask bit is 0 if and only if value bit is 0 */
     uint64_t s_mask;  /* a left-aligned mask of clrsb(value) bits. */
+    uint32_t version; /* incremented each time the temp is written */
 } TempOptInfo;
 
+/*
+ * A guest memory value known from a previous qemu_ld or qemu_st in the
+ * same basic block.  The entry is only valid while neither ADDR nor VAL
+ * has been written since, as recorded by their versions.
+ */
+typedef struct MemOptInfo {
+    TCGTemp *addr;
+    TCGTemp *val;
+    uint32_t addr_version;
+    uint32_t val_version;
+    TCGOpcode opc;    /* the qemu_ld opcode that would produce VAL */
+    MemOpIdx oi;
+} MemOptInfo;
+
+#define MEM_OPT_ENTRIES 8
+
 typedef struct OptContext {
     TCGContext *tcg;
     TCGOp *prev_mb;
     TCGTempSet temps_used;
 
+    MemOptInfo mem[MEM_OPT_ENTRIES];
+    int nb_mem;
+
     /* In flight values from optimization. */
     uint64_t a_mask;  /* mask bit is 0 iff value identical to first input */
     uint64_t z_mask;  /* mask bit is 0 iff value bit is 0 */
@@ -136,6 +157,7 @@ static void reset_ts(TCGTemp *ts)
     ti->is_const = false;
     ti->z_mask = -1;
     ti->s_mask = 0;
+    ti->version++;
 }
 
 static void reset_temp(TCGArg arg)
@@ -162,6 +184,7 @@ static void init_ts_info(OptContext *ctx, TCGTemp *ts)
 
     ti->next_copy = ts;
     ti->prev_copy = ts;
+    ti->version = 0;
     if (ts->kind == TEMP_CONST) {
         ti->is_const = true;
         ti->val = ts->val;
@@ -253,6 +276,7 @@ static bool tcg_opt_gen_mov(OptContext *ctx, TCGOp *op, TCGArg dst, TCGArg src)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         /* TCGOP_VECL and TCGOP_VECE remain unchanged.  */
         new_op = INDEX_op_mov_vec;
         break;
@@ -696,6 +720,7 @@ static void finish_folding(OptContext *ctx, TCGOp *op)
     if (def->flags & TCG_OPF_BB_END) {
         memset(&ctx->temps_used, 0, sizeof(ctx->temps_used));
         ctx->prev_mb = NULL;
+        ctx->nb_mem = 0;
         return;
     }
 
@@ -814,6 +839,7 @@ static bool fold_to_not(OptContext *ctx, TCGOp *op, int idx)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         not_op = INDEX_op_not_vec;
         have_not = TCG_TARGET_HAS_not_vec;
         break;
@@ -1227,6 +1253,11 @@ static bool fold_call(OptContext *ctx, TCGOp *op)
 
     /* Stop optimizing MB across calls. */
     ctx->prev_mb = NULL;
+
+    /* Any helper that is not pure may modify guest memory. */
+    if (!(flags & TCG_CALL_NO_SIDE_EFFECTS)) {
+        ctx->nb_mem = 0;
+    }
     return true;
 }
 
@@ -1476,6 +1507,9 @@ static bool fold_extu(OptContext *ctx, TCGOp *op)
 
 static bool fold_mb(OptContext *ctx, TCGOp *op)
 {
+    /* Do not forward guest memory values across a barrier.  */
+    ctx->nb_mem = 0;
+
     /* Eliminate duplicate and redundant fence instructions.  */
     if (ctx->prev_mb) {
         /*
@@ -1706,12 +1740,106 @@ static bool fold_orc(OptContext *ctx, TCGOp *op)
     return false;
 }
 
+/*
+ * Forwarding of guest memory values, from a qemu_ld or qemu_st to a later
+ * qemu_ld of the same address temp with the same MemOpIdx, so that the
+ * repeated load and its TLB lookup can be replaced by a move.
+ *
+ * This is only done for user-only emulation.  In system mode any guest
+ * access may turn out to be MMIO, with side effects on every access, and
+ * this cannot be known at translation time.
+ *
+ * A store invalidates everything but itself, as different virtual
+ * addresses may alias the same memory.  So do barriers, helpers with side
+ * effects and the end of a basic block.  When other vCPUs run in parallel,
+ * only the immediately preceding guest memory access is forwarded, so that
+ * no other access is reordered with respect to the load.
+ */
+static bool mem_opt_enabled(OptContext *ctx)
+{
+#ifdef CONFIG_USER_ONLY
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void mem_opt_record(OptContext *ctx, TCGOpcode opc, MemOpIdx oi,
+                           TCGTemp *addr, uint32_t addr_version, TCGTemp *val)
+{
+    MemOptInfo *m;
+
+    if (ctx->tcg->gen_tb->cflags & CF_PARALLEL) {
+        ctx->nb_mem = 0;
+    }
+    if (ctx->nb_mem == MEM_OPT_ENTRIES) {
+        /* Drop the oldest entry. */
+        memmove(&ctx->mem[0], &ctx->mem[1],
+                sizeof(MemOptInfo) * (MEM_OPT_ENTRIES - 1));
+        ctx->nb_mem--;
+    }
+
+    m = &ctx->mem[ctx->nb_mem++];
+    m->addr = addr;
+    m->val = val;
+    m->addr_version = addr_version;
+    m->val_version = ts_info(val)->version;
+    m->opc = opc;
+    m->oi = oi;
+}
+
+static TCGTemp *mem_opt_lookup(OptContext *ctx, TCGOpcode opc, MemOpIdx oi,
+                               TCGTemp *addr)
+{
+    for (int i = ctx->nb_mem - 1; i >= 0; i--) {
+        MemOptInfo *m = &ctx->mem[i];
+
+        if (m->opc == opc && m->oi == oi
+            && ts_info(m->addr)->version == m->addr_version
+            && ts_info(m->val)->version == m->val_version
+            && ts_are_copies(m->addr, addr)) {
+            return m->val;
+        }
+    }
+    return NULL;
+}
+
+/* Sign extension does not matter for a load of the full data width. */
+static MemOpIdx mem_opt_oi(TCGOpcode ld_opc, MemOpIdx oi)
+{
+    MemOp mop = get_memop(oi);
+    MemOp full = ld_opc == INDEX_op_qemu_ld_i32 ? MO_32 : MO_64;
+
+    if ((mop & MO_SIZE) == full) {
+        mop &= ~MO_SIGN;
+    }
+    return make_memop_idx(mop, get_mmuidx(oi));
+}
+
 static bool fold_qemu_ld(OptContext *ctx, TCGOp *op)
 {
     const TCGOpDef *def = &tcg_op_defs[op->opc];
     MemOpIdx oi = op->args[def->nb_oargs + def->nb_iargs];
     MemOp mop = get_memop(oi);
     int width = 8 * memop_size(mop);
+    /* Only loads with a single data and address temp are tracked. */
+    bool track = (mem_opt_enabled(ctx)
+                  && def->nb_oargs == 1 && def->nb_iargs == 1);
+    TCGTemp *addr = arg_temp(op->args[def->nb_oargs]);
+    uint32_t addr_version = ts_info(addr)->version;
+
+    /* Opcodes that touch guest memory stop the mb optimization.  */
+    ctx->prev_mb = NULL;
+
+    if (track) {
+        TCGTemp *val = mem_opt_lookup(ctx, op->opc,
+                                      mem_opt_oi(op->opc, oi), addr);
+        if (val) {
+            return tcg_opt_gen_mov(ctx, op, op->args[0], temp_arg(val));
+        }
+    } else {
+        ctx->nb_mem = 0;
+    }
 
     if (width < 64) {
         ctx->s_mask = MAKE_64BIT_MASK(width, 64 - width);
@@ -1720,16 +1848,55 @@ static bool fold_qemu_ld(OptContext *ctx, TCGOp *op)
             ctx->s_mask <<= 1;
         }
     }
+    finish_folding(ctx, op);
 
-    /* Opcodes that touch guest memory stop the mb optimization.  */
-    ctx->prev_mb = NULL;
-    return false;
+    /*
+     * Record the output only now that it has been written.  If it
+     * overwrote the address, ADDR_VERSION is stale and so is the entry.
+     */
+    if (track) {
+        mem_opt_record(ctx, op->opc, mem_opt_oi(op->opc, oi),
+                       addr, addr_version, arg_temp(op->args[0]));
+    }
+    return true;
 }
 
 static bool fold_qemu_st(OptContext *ctx, TCGOp *op)
 {
+    const TCGOpDef *def = &tcg_op_defs[op->opc];
+    MemOpIdx oi = op->args[def->nb_oargs + def->nb_iargs];
+    MemOp mop = get_memop(oi);
+    TCGOpcode ld_opc;
+
     /* Opcodes that touch guest memory stop the mb optimization.  */
     ctx->prev_mb = NULL;
+
+    ctx->nb_mem = 0;
+    if (!mem_opt_enabled(ctx) || def->nb_iargs != 2) {
+        return false;
+    }
+
+    /* Only a store of the full width of the data temp is forwarded. */
+    switch (op->opc) {
+    case INDEX_op_qemu_st_i32:
+        ld_opc = INDEX_op_qemu_ld_i32;
+        if ((mop & MO_SIZE) != MO_32) {
+            return false;
+        }
+        break;
+    case INDEX_op_qemu_st_i64:
+        ld_opc = INDEX_op_qemu_ld_i64;
+        if ((mop & MO_SIZE) != MO_64) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    mem_opt_record(ctx, ld_opc, mem_opt_oi(ld_opc, oi),
+                   arg_temp(op->args[1]), arg_info(op->args[1])->version,
+                   arg_temp(op->args[0]));
     return false;
 }
 
@@ -1937,6 +2104,7 @@ static bool fold_sub_to_neg(OptContext *ctx, TCGOp *op)
     case TCG_TYPE_V64:
     case TCG_TYPE_V128:
     case TCG_TYPE_V256:
+    case TCG_TYPE_V512:
         neg_op = INDEX_op_neg_vec;
         have_neg = (TCG_TARGET_HAS_neg_vec &&
                     tcg_can_emit_vec_op(neg_op, ctx->type, TCGOP_VECE(op)) > 0);
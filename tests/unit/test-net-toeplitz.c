@@ -0,0 +1,81 @@
+/*
+ * Toeplitz hash unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+/* Length of the RSS hash key of virtio-net and most NICs */
+#define TEST_KEY_LEN 40
+
+static uint32_t toeplitz_add_hash(uint8_t *key, uint8_t *input, size_t len)
+{
+    net_toeplitz_key key_data;
+    uint32_t hash = 0;
+
+    net_toeplitz_key_init(&key_data, key);
+    net_toeplitz_add(&hash, input, len, &key_data);
+    return hash;
+}
+
+/* Verification suite of the Microsoft RSS specification, IPv4 with TCP */
+static void test_toeplitz_rss_vector(void)
+{
+    static uint8_t key[TEST_KEY_LEN] = {
+        0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+        0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+        0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+        0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+        0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+    };
+    static uint8_t input[] = {
+        66, 9, 149, 187,            /* source address */
+        161, 142, 100, 80,          /* destination address */
+        0x0a, 0xea,                 /* source port 2794 */
+        0x06, 0xe6,                 /* destination port 1766 */
+    };
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+
+    net_toeplitz_table_init(table, key, sizeof(key));
+    g_assert_cmphex(net_toeplitz_table_hash(table, input, sizeof(input)), ==,
+                    0x51ccc178);
+    g_assert_cmphex(toeplitz_add_hash(key, input, sizeof(input)), ==,
+                    0x51ccc178);
+}
+
+/* The table lookup must agree with the bitwise hash for any key and input */
+static void test_toeplitz_table_random(void)
+{
+    g_autofree NetToeplitzTable *table = g_new(NetToeplitzTable, 1);
+    uint8_t key[TEST_KEY_LEN];
+    uint8_t input[NET_TOEPLITZ_MAX_INPUT];
+    size_t len, k;
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < TEST_KEY_LEN; j++) {
+            key[j] = g_test_rand_int_range(0, 256);
+        }
+        net_toeplitz_table_init(table, key, sizeof(key));
+
+        for (j = 0; j < 64; j++) {
+            len = g_test_rand_int_range(0, NET_TOEPLITZ_MAX_INPUT + 1);
+            for (k = 0; k < len; k++) {
+                input[k] = g_test_rand_int_range(0, 256);
+            }
+            g_assert_cmphex(net_toeplitz_table_hash(table, input, len), ==,
+                            toeplitz_add_hash(key, input, len));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/toeplitz/rss-vector", test_toeplitz_rss_vector);
+    g_test_add_func("/net/toeplitz/table-random", test_toeplitz_table_random);
+    return g_test_run();
+}
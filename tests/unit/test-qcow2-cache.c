@@ -0,0 +1,322 @@
+/*
+ * qcow2 metadata cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+
+#define IMG_SIZE (64 * MiB)
+#define CACHE_TABLES 4
+
+static char *img_path;
+
+typedef struct TestCache {
+    BlockBackend *blk;
+    BlockDriverState *bs;
+    Qcow2Cache *c;
+    int table_size;
+} TestCache;
+
+static void test_cache_init(TestCache *tc, int num_tables)
+{
+    QDict *options = qdict_new();
+    BDRVQcow2State *s;
+
+    qdict_put_str(options, "driver", "qcow2");
+    tc->blk = blk_new_open(img_path, NULL, options, BDRV_O_RDWR,
+                           &error_abort);
+    tc->bs = blk_bs(tc->blk);
+    s = tc->bs->opaque;
+
+    tc->table_size = s->cluster_size;
+    tc->c = qcow2_cache_create(tc->bs, num_tables, tc->table_size);
+    g_assert_nonnull(tc->c);
+}
+
+static void test_cache_cleanup(TestCache *tc)
+{
+    g_assert_cmpint(qcow2_cache_flush(tc->bs, tc->c), ==, 0);
+    qcow2_cache_destroy(tc->c);
+    blk_unref(tc->blk);
+}
+
+/* Offset of table @n, past the metadata of the image */
+static uint64_t table_offset(TestCache *tc, int n)
+{
+    return (uint64_t)(n + 256) * tc->table_size;
+}
+
+static bool is_cached(TestCache *tc, int n)
+{
+    return qcow2_cache_is_table_offset(tc->c, table_offset(tc, n)) != NULL;
+}
+
+/* Get table @n without reading it, and drop the reference again */
+static void *touch(TestCache *tc, int n)
+{
+    void *table, *ret;
+
+    g_assert_cmpint(qcow2_cache_get_empty(tc->bs, tc->c, table_offset(tc, n),
+                                          &table), ==, 0);
+    ret = table;
+    qcow2_cache_put(tc->c, &table);
+    g_assert_null(table);
+    return ret;
+}
+
+static void test_lookup(void)
+{
+    TestCache tc;
+    void *t0, *t1;
+    int i;
+
+    test_cache_init(&tc, CACHE_TABLES);
+
+    g_assert_false(is_cached(&tc, 0));
+    t0 = touch(&tc, 0);
+    t1 = touch(&tc, 1);
+    g_assert(t0 != t1);
+
+    g_assert(qcow2_cache_is_table_offset(tc.c, table_offset(&tc, 0)) == t0);
+    g_assert(qcow2_cache_is_table_offset(tc.c, table_offset(&tc, 1)) == t1);
+    g_assert_false(is_cached(&tc, 2));
+
+    /* A hit returns the same table */
+    for (i = 0; i < 8; i++) {
+        g_assert(touch(&tc, i % 2) == (i % 2 ? t1 : t0));
+    }
+
+    test_cache_cleanup(&tc);
+}
+
+static void test_eviction_order(void)
+{
+    TestCache tc;
+    int i;
+
+    test_cache_init(&tc, CACHE_TABLES);
+
+    for (i = 0; i < CACHE_TABLES; i++) {
+        touch(&tc, i);
+    }
+
+    /* Make table 0 the most recently used one */
+    touch(&tc, 0);
+
+    /* Tables are evicted least recently used first */
+    touch(&tc, 10);
+    g_assert_false(is_cached(&tc, 1));
+    g_assert_true(is_cached(&tc, 0));
+    g_assert_true(is_cached(&tc, 2));
+    g_assert_true(is_cached(&tc, 3));
+
+    touch(&tc, 11);
+    g_assert_false(is_cached(&tc, 2));
+    g_assert_true(is_cached(&tc, 0));
+    g_assert_true(is_cached(&tc, 3));
+    g_assert_true(is_cached(&tc, 10));
+
+    /* Discarded tables are reused before any table is evicted */
+    qcow2_cache_discard(tc.c,
+                        qcow2_cache_is_table_offset(tc.c,
+                                                    table_offset(&tc, 10)));
+    g_assert_false(is_cached(&tc, 10));
+    touch(&tc, 12);
+    g_assert_true(is_cached(&tc, 0));
+    g_assert_true(is_cached(&tc, 3));
+    g_assert_true(is_cached(&tc, 11));
+    g_assert_true(is_cached(&tc, 12));
+
+    test_cache_cleanup(&tc);
+}
+
+static void test_referenced(void)
+{
+    TestCache tc;
+    void *held, *table;
+    int i;
+
+    test_cache_init(&tc, CACHE_TABLES);
+
+    g_assert_cmpint(qcow2_cache_get_empty(tc.bs, tc.c, table_offset(&tc, 0),
+                                          &held), ==, 0);
+
+    /* Tables that are in use are never evicted */
+    for (i = 1; i < 4 * CACHE_TABLES; i++) {
+        touch(&tc, i);
+        g_assert_true(is_cached(&tc, 0));
+    }
+
+    /* A second reference to a table in use */
+    g_assert_cmpint(qcow2_cache_get(tc.bs, tc.c, table_offset(&tc, 0),
+                                    &table), ==, 0);
+    g_assert(table == held);
+    qcow2_cache_put(tc.c, &table);
+    qcow2_cache_put(tc.c, &held);
+
+    /* Once released, it is the most recently used table */
+    for (i = 100; i < 100 + CACHE_TABLES - 1; i++) {
+        touch(&tc, i);
+    }
+    g_assert_true(is_cached(&tc, 0));
+    touch(&tc, 200);
+    g_assert_false(is_cached(&tc, 0));
+
+    test_cache_cleanup(&tc);
+}
+
+/* Many tables through a small cache, checked against a simple LRU model */
+static void test_lru_model(void)
+{
+    TestCache tc;
+    int model[CACHE_TABLES];
+    int i, j, n, pos;
+
+    test_cache_init(&tc, CACHE_TABLES);
+    for (i = 0; i < CACHE_TABLES; i++) {
+        model[i] = -1;
+    }
+
+    for (i = 0; i < 1000; i++) {
+        n = g_test_rand_int_range(0, 3 * CACHE_TABLES);
+        touch(&tc, n);
+
+        /* model[] lists the cached tables, most recently used last */
+        for (pos = 0; pos < CACHE_TABLES; pos++) {
+            if (model[pos] == n) {
+                break;
+            }
+        }
+        if (pos == CACHE_TABLES) {
+            /* A miss evicts the least recently used table */
+            pos = 0;
+        }
+        memmove(&model[pos], &model[pos + 1],
+                (CACHE_TABLES - 1 - pos) * sizeof(model[0]));
+        model[CACHE_TABLES - 1] = n;
+
+        for (j = 0; j < 3 * CACHE_TABLES; j++) {
+            bool expected = false;
+
+            for (pos = 0; pos < CACHE_TABLES; pos++) {
+                expected |= model[pos] == j;
+            }
+            g_assert_cmpint(is_cached(&tc, j), ==, expected);
+        }
+    }
+
+    test_cache_cleanup(&tc);
+}
+
+static void test_dirty(void)
+{
+    TestCache tc;
+    void *table;
+    int i;
+
+    test_cache_init(&tc, CACHE_TABLES);
+
+    g_assert_cmpint(qcow2_cache_get_empty(tc.bs, tc.c, table_offset(&tc, 0),
+                                          &table), ==, 0);
+    memset(table, 0xa5, tc.table_size);
+    qcow2_cache_entry_mark_dirty(tc.c, table);
+    qcow2_cache_put(tc.c, &table);
+
+    /* Evicting a dirty table writes it back */
+    for (i = 1; i <= CACHE_TABLES; i++) {
+        touch(&tc, i);
+    }
+    g_assert_false(is_cached(&tc, 0));
+
+    g_assert_cmpint(qcow2_cache_get(tc.bs, tc.c, table_offset(&tc, 0),
+                                    &table), ==, 0);
+    g_assert_cmphex(((uint8_t *)table)[0], ==, 0xa5);
+    g_assert_cmphex(((uint8_t *)table)[tc.table_size - 1], ==, 0xa5);
+    qcow2_cache_put(tc.c, &table);
+
+    /* A discarded dirty table is dropped without being written back */
+    g_assert_cmpint(qcow2_cache_get_empty(tc.bs, tc.c, table_offset(&tc, 50),
+                                          &table), ==, 0);
+    memset(table, 0x5a, tc.table_size);
+    qcow2_cache_entry_mark_dirty(tc.c, table);
+    qcow2_cache_put(tc.c, &table);
+    qcow2_cache_discard(tc.c,
+                        qcow2_cache_is_table_offset(tc.c,
+                                                    table_offset(&tc, 50)));
+    g_assert_cmpint(qcow2_cache_get(tc.bs, tc.c, table_offset(&tc, 50),
+                                    &table), ==, 0);
+    g_assert_cmphex(((uint8_t *)table)[0], ==, 0);
+    qcow2_cache_put(tc.c, &table);
+
+    test_cache_cleanup(&tc);
+}
+
+static void test_clean_unused(void)
+{
+    TestCache tc;
+    void *table;
+
+    test_cache_init(&tc, CACHE_TABLES);
+
+    touch(&tc, 0);
+    g_assert_cmpint(qcow2_cache_get_empty(tc.bs, tc.c, table_offset(&tc, 1),
+                                          &table), ==, 0);
+    qcow2_cache_entry_mark_dirty(tc.c, table);
+    qcow2_cache_put(tc.c, &table);
+
+    /* Tables used since the previous call are kept */
+    qcow2_cache_clean_unused(tc.c);
+    g_assert_true(is_cached(&tc, 0));
+    g_assert_true(is_cached(&tc, 1));
+
+    /* Clean unused tables are dropped, dirty ones are kept */
+    qcow2_cache_clean_unused(tc.c);
+    g_assert_false(is_cached(&tc, 0));
+    g_assert_true(is_cached(&tc, 1));
+
+    /* Emptying the cache writes back and drops everything */
+    touch(&tc, 2);
+    g_assert_cmpint(qcow2_cache_empty(tc.bs, tc.c), ==, 0);
+    g_assert_false(is_cached(&tc, 1));
+    g_assert_false(is_cached(&tc, 2));
+
+    test_cache_cleanup(&tc);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+
+    img_path = g_strdup_printf("%s/qcow2-cache.XXXXXX", g_get_tmp_dir());
+    fd = mkstemp(img_path);
+    g_assert(fd >= 0);
+    close(fd);
+    bdrv_img_create(img_path, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    g_test_add_func("/qcow2-cache/lookup", test_lookup);
+    g_test_add_func("/qcow2-cache/eviction-order", test_eviction_order);
+    g_test_add_func("/qcow2-cache/referenced", test_referenced);
+    g_test_add_func("/qcow2-cache/lru-model", test_lru_model);
+    g_test_add_func("/qcow2-cache/dirty", test_dirty);
+    g_test_add_func("/qcow2-cache/clean-unused", test_clean_unused);
+
+    ret = g_test_run();
+
+    unlink(img_path);
+    g_free(img_path);
+    return ret;
+}
@@ -21,12 +21,28 @@
 #include "qemu/rcu_queue.h"
 #include "qemu/sockets.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "trace.h"
 #include "aio-posix.h"
 
 /* Stop userspace polling on a handler if it isn't active for some time */
 #define POLL_IDLE_INTERVAL_NS (7 * NANOSECONDS_PER_SECOND)
 
+/* How often adaptive polling checks whether the thread is being preempted */
+#define POLL_CONTENTION_INTERVAL_NS (10 * SCALE_MS)
+
+/* Accounting period of the global polling CPU budget */
+#define POLL_BUDGET_PERIOD_NS (100 * SCALE_MS)
+
+/*
+ * Global polling CPU budget, shared by all AioContexts.  The time spent
+ * polling in the current period is counted in microseconds so that 32-bit
+ * atomics are enough.
+ */
+static unsigned int poll_cpu_budget;     /* in percent of one CPU */
+static unsigned int poll_budget_period;  /* index of the current period */
+static unsigned int poll_budget_used_us; /* time used in the current period */
+
 bool aio_poll_disabled(AioContext *ctx)
 {
     return qatomic_read(&ctx->poll_disable_cnt);
@@ -426,6 +442,118 @@ void aio_dispatch(AioContext *ctx)
     timerlistgroup_run_timers(&ctx->tlg);
 }
 
+/* Returns how long we may still poll in this budget period */
+static int64_t poll_budget_remaining(void)
+{
+    unsigned int budget = qatomic_read(&poll_cpu_budget);
+    unsigned int period, old_period;
+    int64_t limit_us;
+
+    if (!budget) {
+        return INT64_MAX;
+    }
+
+    period = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) / POLL_BUDGET_PERIOD_NS;
+
+    /* No thread synchronization beyond this, a slight overshoot is fine */
+    old_period = qatomic_read(&poll_budget_period);
+    if (old_period != period &&
+        qatomic_cmpxchg(&poll_budget_period, old_period, period) ==
+            old_period) {
+        qatomic_set(&poll_budget_used_us, 0);
+    }
+
+    limit_us = (int64_t)budget * POLL_BUDGET_PERIOD_NS / SCALE_US / 100;
+    return MAX(limit_us - qatomic_read(&poll_budget_used_us), 0) * SCALE_US;
+}
+
+static void poll_budget_charge(int64_t ns)
+{
+    if (qatomic_read(&poll_cpu_budget)) {
+        qatomic_add(&poll_budget_used_us, ns / SCALE_US);
+    }
+}
+
+/* Update the average time between two events of @node */
+static void poll_record_event(AioHandler *node, int64_t now)
+{
+    if (node->poll_last_event) {
+        int64_t sample = now - node->poll_last_event;
+
+        if (node->poll_event_interval) {
+            node->poll_event_interval =
+                (node->poll_event_interval * 3 + sample) / 4;
+        } else {
+            node->poll_event_interval = sample;
+        }
+    }
+    node->poll_last_event = now;
+}
+
+/*
+ * Busy polling only pays off if we have the CPU to ourselves.  Being
+ * preempted while polling means that other tasks on the host want to run.
+ */
+static bool poll_contended(AioContext *ctx, int64_t now)
+{
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+
+    if (now < ctx->poll_contention_check) {
+        return ctx->poll_contended;
+    }
+    ctx->poll_contention_check = now + POLL_CONTENTION_INTERVAL_NS;
+
+    if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+        ctx->poll_contended = ru.ru_nivcsw != ctx->poll_nivcsw;
+        ctx->poll_nivcsw = ru.ru_nivcsw;
+    }
+#endif
+    return ctx->poll_contended;
+}
+
+/*
+ * Poll for as long as the busiest handler is expected to need until its next
+ * event, with some slack for jitter.  If events are too far apart for that
+ * to fit in poll_max_ns, blocking is cheaper and we don't poll at all.
+ */
+static void adjust_polling_adaptive(AioContext *ctx, int64_t now)
+{
+    AioHandler *node;
+    int64_t interval = 0;
+    int64_t old = ctx->poll_ns;
+    bool contended;
+
+    QLIST_FOREACH(node, &ctx->poll_aio_handlers, node_poll) {
+        int64_t expected;
+
+        if (!node->poll_event_interval) {
+            continue;
+        }
+
+        /* A handler that has been quiet for a while is not that busy */
+        expected = MAX(node->poll_event_interval, now - node->poll_last_event);
+        if (!interval || expected < interval) {
+            interval = expected;
+        }
+    }
+
+    if (!interval || interval > ctx->poll_max_ns) {
+        ctx->poll_ns = 0;
+    } else {
+        ctx->poll_ns = MIN(interval + interval / 2, ctx->poll_max_ns);
+    }
+
+    contended = poll_contended(ctx, now);
+    if (contended) {
+        ctx->poll_ns /= 2;
+    }
+
+    if (ctx->poll_ns != old) {
+        trace_poll_adaptive(ctx, old, ctx->poll_ns, interval, contended);
+    }
+}
+
 static bool run_poll_handlers_once(AioContext *ctx,
                                    AioHandlerList *ready_list,
                                    int64_t now,
@@ -560,6 +688,9 @@ static bool run_poll_handlers(AioContext *ctx, AioHandlerList *ready_list,
         *timeout -= MIN(*timeout, elapsed_time);
     }
 
+    stat64_add(&ctx->poll_time_ns, elapsed_time);
+    poll_budget_charge(elapsed_time);
+
     trace_run_poll_handlers_end(ctx, progress, *timeout);
     return progress;
 }
@@ -585,6 +716,14 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
 
     max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
     if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
+        int64_t budget_ns = poll_budget_remaining();
+
+        if (!budget_ns) {
+            stat64_add(&ctx->poll_throttled, 1);
+            return false;
+        }
+        max_ns = MIN(max_ns, budget_ns);
+
         /*
          * Enable poll mode. It pairs with the poll_set_started() in
          * aio_poll() which disables poll mode.
@@ -592,8 +731,10 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
         poll_set_started(ctx, ready_list, true);
 
         if (run_poll_handlers(ctx, ready_list, max_ns, timeout)) {
+            stat64_add(&ctx->poll_hits, 1);
             return true;
         }
+        stat64_add(&ctx->poll_misses, 1);
     }
     return false;
 }
@@ -678,7 +819,18 @@ bool aio_poll(AioContext *ctx, bool blocking)
     aio_notify_accept(ctx);
 
     /* Adjust polling time */
-    if (ctx->poll_max_ns) {
+    if (ctx->poll_max_ns && ctx->poll_adaptive) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        AioHandler *node;
+
+        QLIST_FOREACH(node, &ready_list, node_ready) {
+            if (node->io_poll && node->opaque != &ctx->notifier) {
+                poll_record_event(node, now);
+            }
+        }
+
+        adjust_polling_adaptive(ctx, now);
+    } else if (ctx->poll_max_ns) {
         int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
 
         if (block_ns <= ctx->poll_ns) {
@@ -776,6 +928,27 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     aio_notify(ctx);
 }
 
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   Error **errp)
+{
+    /* No thread synchronization here, see aio_context_set_poll_params() */
+    ctx->poll_adaptive = adaptive;
+    ctx->poll_ns = 0;
+
+    aio_notify(ctx);
+}
+
+void aio_set_poll_cpu_budget(int64_t percent, Error **errp)
+{
+    if (percent < 0 || percent > UINT_MAX / 100) {
+        error_setg(errp, "poll-cpu-budget must be in range [0, %u]",
+                   UINT_MAX / 100);
+        return;
+    }
+
+    qatomic_set(&poll_cpu_budget, percent);
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp)
 {
@@ -37,6 +37,8 @@ struct AioHandler {
     unsigned flags; /* see fdmon-io_uring.c */
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_last_event; /* when the handler last became ready */
+    int64_t poll_event_interval; /* average time between events */
     bool poll_ready; /* has polling detected an event? */
     bool is_external;
 };
@@ -444,6 +444,21 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     }
 }
 
+void aio_context_set_poll_adaptive(AioContext *ctx, bool adaptive,
+                                   Error **errp)
+{
+    if (adaptive) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
+void aio_set_poll_cpu_budget(int64_t percent, Error **errp)
+{
+    if (percent) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch,
                                 Error **errp)
 {
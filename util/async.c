@@ -434,7 +434,8 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->io_uring_entries,
+                                      ctx->io_uring_sqpoll_idle, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -581,11 +582,16 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_max_ns = 0;
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
+    ctx->poll_adaptive = false;
 
     ctx->aio_max_batch = 0;
 
+    ctx->io_uring_entries = 0;
+    ctx->io_uring_sqpoll_idle = 0;
+
     ctx->thread_pool_min = 0;
     ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    ctx->thread_pool_numa_affine = false;
 
     register_aiocontext(ctx);
 
@@ -723,8 +729,31 @@ void qemu_set_current_aio_context(AioContext *ctx)
     set_my_aiocontext(ctx);
 }
 
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t entries,
+                                     int64_t sqpoll_idle, Error **errp)
+{
+    if (entries > 32768 || sqpoll_idle > UINT32_MAX) {
+        error_setg(errp, "bad io-uring-entries/io-uring-sqpoll-idle values");
+        return;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring &&
+        (entries != ctx->io_uring_entries ||
+         sqpoll_idle != ctx->io_uring_sqpoll_idle)) {
+        error_setg(errp, "io_uring parameters cannot be changed while the "
+                   "ring is in use");
+        return;
+    }
+#endif
+
+    ctx->io_uring_entries = entries;
+    ctx->io_uring_sqpoll_idle = sqpoll_idle;
+}
+
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
-                                        int64_t max, Error **errp)
+                                        int64_t max, bool numa_affine,
+                                        Error **errp)
 {
 
     if (min > max || !max || min > INT_MAX || max > INT_MAX) {
@@ -734,6 +763,7 @@ void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
 
     ctx->thread_pool_min = min;
     ctx->thread_pool_max = max;
+    ctx->thread_pool_numa_affine = numa_affine;
 
     if (ctx->thread_pool) {
         thread_pool_update_params(ctx->thread_pool, ctx);
@@ -34,6 +34,7 @@
 #include "qemu/error-report.h"
 #include "qemu/queue.h"
 #include "qom/object.h"
+#include "qapi/visitor.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
@@ -197,8 +198,15 @@ static void main_loop_update_params(EventLoopBase *base, Error **errp)
         return;
     }
 
+    aio_context_set_io_uring_params(qemu_aio_context, base->io_uring_entries,
+                                    base->io_uring_sqpoll_idle, errp);
+    if (*errp) {
+        return;
+    }
+
     aio_context_set_thread_pool_params(qemu_aio_context, base->thread_pool_min,
-                                       base->thread_pool_max, errp);
+                                       base->thread_pool_max,
+                                       base->thread_pool_numa_affine, errp);
 }
 
 MainLoop *mloop;
@@ -223,6 +231,34 @@ static bool main_loop_can_be_deleted(EventLoopBase *base)
     return false;
 }
 
+static void main_loop_get_poll_cpu_budget(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    MainLoop *m = MAIN_LOOP(obj);
+
+    visit_type_int64(v, name, &m->poll_cpu_budget, errp);
+}
+
+static void main_loop_set_poll_cpu_budget(Object *obj, Visitor *v,
+                                          const char *name, void *opaque,
+                                          Error **errp)
+{
+    ERRP_GUARD();
+    MainLoop *m = MAIN_LOOP(obj);
+    int64_t value;
+
+    if (!visit_type_int64(v, name, &value, errp)) {
+        return;
+    }
+
+    aio_set_poll_cpu_budget(value, errp);
+    if (*errp) {
+        return;
+    }
+    m->poll_cpu_budget = value;
+}
+
 static void main_loop_class_init(ObjectClass *oc, void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(oc);
@@ -230,6 +266,11 @@ static void main_loop_class_init(ObjectClass *oc, void *class_data)
     bc->init = main_loop_init;
     bc->update_params = main_loop_update_params;
     bc->can_be_deleted = main_loop_can_be_deleted;
+
+    object_class_property_add(oc, "poll-cpu-budget", "int",
+                              main_loop_get_poll_cpu_budget,
+                              main_loop_set_poll_cpu_budget,
+                              NULL, NULL);
 }
 
 static const TypeInfo main_loop_info = {
@@ -18,10 +18,22 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 
+/* Maximum number of requests a worker takes from the queue at once */
+#define THREAD_POOL_MAX_BATCH 8
+
+/*
+ * If requests wait longer than this for a worker on average, the pool grows
+ * even if some workers are idle, and keeps its workers around.
+ */
+#define THREAD_POOL_LATENCY_TARGET_NS (50 * SCALE_US)
+
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
@@ -45,6 +57,9 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* When the request was queued, for the queueing delay estimate */
+    int64_t submit_time;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -65,35 +80,188 @@ struct ThreadPool {
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int queued;          /* length of request_list */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     int min_threads;
     int max_threads;
+    int warm_threads;    /* workers kept alive because of queueing delays */
+    int64_t queue_wait_ns; /* average time requests wait for a worker */
+
+    /*
+     * CPUs of the host NUMA node that the AioContext's thread runs on, or NULL
+     * if workers are not bound.  Workers apply it when affinity_gen changes.
+     */
+    bool numa_affine;
+    int numa_node;
+    unsigned long *affinity;
+    unsigned long affinity_nbits;
+    unsigned affinity_gen;
 };
 
+#ifdef CONFIG_LINUX
+/* Host NUMA topology, read from sysfs on first use */
+static struct {
+    long nr_cpus;
+    int *cpu_node;              /* NUMA node of each CPU, or -1 */
+} host_numa;
+
+static gpointer host_numa_init(gpointer opaque)
+{
+    g_autofree char *possible = NULL;
+    const char *p;
+
+    host_numa.nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (host_numa.nr_cpus <= 0) {
+        host_numa.nr_cpus = 0;
+        return NULL;
+    }
+    host_numa.cpu_node = g_new(int, host_numa.nr_cpus);
+    memset(host_numa.cpu_node, -1, host_numa.nr_cpus * sizeof(int));
+
+    if (!g_file_get_contents("/sys/devices/system/node/possible",
+                             &possible, NULL, NULL)) {
+        return NULL;
+    }
+
+    /* Both files use the "0-3,8,10-11" list format */
+    for (p = possible; *p && *p != '\n'; ) {
+        unsigned long first, last, node;
+
+        if (qemu_strtoul(p, &p, 10, &first) < 0) {
+            break;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            break;
+        }
+
+        for (node = first; node <= last; node++) {
+            g_autofree char *path = NULL;
+            g_autofree char *cpulist = NULL;
+            const char *q;
+
+            path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist",
+                                   node);
+            if (!g_file_get_contents(path, &cpulist, NULL, NULL)) {
+                continue;
+            }
+
+            for (q = cpulist; *q && *q != '\n'; ) {
+                unsigned long cpu_first, cpu_last, cpu;
+
+                if (qemu_strtoul(q, &q, 10, &cpu_first) < 0) {
+                    break;
+                }
+                cpu_last = cpu_first;
+                if (*q == '-' && qemu_strtoul(q + 1, &q, 10, &cpu_last) < 0) {
+                    break;
+                }
+                for (cpu = cpu_first;
+                     cpu <= cpu_last && cpu < host_numa.nr_cpus; cpu++) {
+                    host_numa.cpu_node[cpu] = node;
+                }
+                if (*q == ',') {
+                    q++;
+                }
+            }
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Follow the AioContext's thread to its current NUMA node.  Called with the
+ * pool lock held from the AioContext's thread.
+ */
+static void thread_pool_update_affinity(ThreadPool *pool)
+{
+    static GOnce once = G_ONCE_INIT;
+    int cpu, node;
+    long i;
+
+    g_once(&once, host_numa_init, NULL);
+
+    cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= host_numa.nr_cpus) {
+        return;
+    }
+    node = host_numa.cpu_node[cpu];
+    if (node < 0 || node == pool->numa_node) {
+        return;
+    }
+
+    g_free(pool->affinity);
+    pool->affinity_nbits = host_numa.nr_cpus;
+    pool->affinity = bitmap_new(pool->affinity_nbits);
+    for (i = 0; i < host_numa.nr_cpus; i++) {
+        if (host_numa.cpu_node[i] == node) {
+            set_bit(i, pool->affinity);
+        }
+    }
+
+    pool->numa_node = node;
+    pool->affinity_gen++;
+    trace_thread_pool_numa_node(pool, node);
+}
+#else
+static void thread_pool_update_affinity(ThreadPool *pool)
+{
+}
+#endif
+
+/*
+ * Called with the pool lock held when a worker picks up a request that waited
+ * @wait_ns in the queue.
+ */
+static void thread_pool_account_wait(ThreadPool *pool, int64_t wait_ns)
+{
+    pool->queue_wait_ns = (pool->queue_wait_ns * 7 + wait_ns) / 8;
+    if (pool->queue_wait_ns > THREAD_POOL_LATENCY_TARGET_NS) {
+        /* Workers are scarce, don't let idle ones time out for now */
+        pool->warm_threads = pool->cur_threads;
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    QemuThread self;
+    unsigned long *orig_affinity = NULL;
+    unsigned long orig_nbits = 0;
+    unsigned affinity_gen = 0;
+
+    qemu_thread_get_self(&self);
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
 
     while (pool->cur_threads <= pool->max_threads) {
+        QTAILQ_HEAD(, ThreadPoolElement) batch =
+            QTAILQ_HEAD_INITIALIZER(batch);
         ThreadPoolElement *req;
-        int ret;
+        int64_t now;
+        int ret, n;
 
         if (QTAILQ_EMPTY(&pool->request_list)) {
             pool->idle_threads++;
             ret = qemu_cond_timedwait(&pool->request_cond, &pool->lock, 10000);
             pool->idle_threads--;
-            if (ret == 0 &&
-                QTAILQ_EMPTY(&pool->request_list) &&
-                pool->cur_threads > pool->min_threads) {
-                /* Timed out + no work to do + no need for warm threads = exit.  */
-                break;
+            if (ret == 0 && QTAILQ_EMPTY(&pool->request_list)) {
+                if (pool->cur_threads >
+                    MAX(pool->min_threads, pool->warm_threads)) {
+                    /* Timed out + no work to do + no need for warm threads */
+                    break;
+                }
+                /* Let the next idle worker time out */
+                pool->warm_threads = MAX(pool->warm_threads - 1, 0);
             }
             /*
              * Even if there was some work to do, check if there aren't
@@ -102,19 +270,57 @@ static void *worker_thread(void *opaque)
             continue;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
+        if (affinity_gen != pool->affinity_gen) {
+            affinity_gen = pool->affinity_gen;
+            if (pool->affinity) {
+                if (!orig_affinity) {
+                    qemu_thread_get_affinity(&self, &orig_affinity,
+                                             &orig_nbits);
+                }
+                qemu_thread_set_affinity(&self, pool->affinity,
+                                         pool->affinity_nbits);
+            } else if (orig_affinity) {
+                qemu_thread_set_affinity(&self, orig_affinity, orig_nbits);
+            }
+        }
+
+        /*
+         * Take several requests at once when there are more of them than
+         * idle workers to pick them up, so that a busy pool goes through
+         * fewer wakeups and lock round trips.  Only do so once the pool
+         * cannot grow anymore: otherwise a blocking request would hold up
+         * the rest of the batch while new workers could run it.
+         */
+        n = 1;
+        if (pool->cur_threads >= pool->max_threads &&
+            pool->queued > pool->idle_threads) {
+            n = MIN(pool->queued - pool->idle_threads, THREAD_POOL_MAX_BATCH);
+        }
+
+        now = get_clock();
+        while (n-- && !QTAILQ_EMPTY(&pool->request_list)) {
+            req = QTAILQ_FIRST(&pool->request_list);
+            QTAILQ_REMOVE(&pool->request_list, req, reqs);
+            pool->queued--;
+            req->state = THREAD_ACTIVE;
+            thread_pool_account_wait(pool, now - req->submit_time);
+            QTAILQ_INSERT_TAIL(&batch, req, reqs);
+        }
         qemu_mutex_unlock(&pool->lock);
 
-        ret = req->func(req->arg);
+        while ((req = QTAILQ_FIRST(&batch))) {
+            QTAILQ_REMOVE(&batch, req, reqs);
 
-        req->ret = ret;
-        /* Write ret before state.  */
-        smp_wmb();
-        req->state = THREAD_DONE;
+            ret = req->func(req->arg);
+
+            req->ret = ret;
+            /* Write ret before state.  */
+            smp_wmb();
+            req->state = THREAD_DONE;
+
+            qemu_bh_schedule(pool->completion_bh);
+        }
 
-        qemu_bh_schedule(pool->completion_bh);
         qemu_mutex_lock(&pool->lock);
     }
 
@@ -127,6 +333,7 @@ static void *worker_thread(void *opaque)
      * to exit due to pool->cur_threads > pool->max_threads.
      */
     qemu_cond_signal(&pool->request_cond);
+    g_free(orig_affinity);
     return NULL;
 }
 
@@ -224,6 +431,7 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     QEMU_LOCK_GUARD(&pool->lock);
     if (elem->state == THREAD_QUEUED) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        pool->queued--;
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -262,10 +470,23 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
+    if (pool->numa_affine) {
+        thread_pool_update_affinity(pool);
+    }
+
+    /*
+     * Grow the pool if no worker is idle, or if requests have been waiting
+     * too long lately and the idle workers are already spoken for.
+     */
+    if (pool->cur_threads < pool->max_threads &&
+        (pool->idle_threads == 0 ||
+         (pool->queued >= pool->idle_threads &&
+          pool->queue_wait_ns > THREAD_POOL_LATENCY_TARGET_NS))) {
         spawn_thread(pool);
     }
+    req->submit_time = get_clock();
     QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queued++;
     qemu_mutex_unlock(&pool->lock);
     qemu_cond_signal(&pool->request_cond);
     return &req->common;
@@ -306,6 +527,14 @@ void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
     pool->min_threads = ctx->thread_pool_min;
     pool->max_threads = ctx->thread_pool_max;
 
+    if (pool->numa_affine != ctx->thread_pool_numa_affine) {
+        pool->numa_affine = ctx->thread_pool_numa_affine;
+        pool->numa_node = -1;
+        g_free(pool->affinity);
+        pool->affinity = NULL;
+        pool->affinity_gen++;
+    }
+
     /*
      * We either have to:
      *  - Increase the number available of threads until over the min_threads
@@ -342,6 +571,7 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
+    pool->numa_node = -1;
 
     thread_pool_update_params(pool, ctx);
 }
@@ -378,6 +608,7 @@ void thread_pool_free(ThreadPool *pool)
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
+    g_free(pool->affinity);
     qemu_cond_destroy(&pool->request_cond);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
@@ -9,6 +9,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/vhost-user-server.h"
 #include "block/aio-wait.h"
@@ -27,7 +28,17 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless the
+ * virtqueue has its own AioContext in VuServer->queue_ctx[].
+ *
+ * Per-queue AioContexts let several IOThreads process virtqueues in parallel.
+ * libvhost-user state is shared between the virtqueues and the vhost-user
+ * protocol messages, so kick_handler() runs with the queue's AioContext lock
+ * held and vu_client_trip() holds the locks of all per-queue AioContexts
+ * while a message is being processed. The locks are released while
+ * vu_message_read() waits for the next message. Device backends complete
+ * requests of such virtqueues from the queue's AioContext too, so that
+ * libvhost-user's virtqueue state is only touched by one thread at a time.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -75,20 +86,71 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
     error_report("vu_panic: %s", buf);
 }
 
+/* Called from the server's or a virtqueue's AioContext */
 void vhost_user_server_ref(VuServer *server)
 {
-    assert(!server->wait_idle);
-    server->refcount++;
+    assert(!qatomic_read(&server->wait_idle));
+    qatomic_inc(&server->refcount);
 }
 
+/* Called from the server's or a virtqueue's AioContext */
 void vhost_user_server_unref(VuServer *server)
 {
-    server->refcount--;
-    if (server->wait_idle && !server->refcount) {
+    /* Pairs with the barrier in vu_client_trip() */
+    if (qatomic_fetch_dec(&server->refcount) == 1 &&
+        qatomic_xchg(&server->wait_idle, false)) {
         aio_co_wake(server->co_trip);
     }
 }
 
+/* Returns the AioContext in which virtqueue @idx is processed */
+AioContext *vhost_user_server_get_queue_ctx(VuServer *server, int idx)
+{
+    if (server->queue_ctx && server->queue_ctx[idx]) {
+        return server->queue_ctx[idx];
+    }
+    return server->ctx;
+}
+
+static void vu_acquire_queue_ctxs(VuServer *server)
+{
+    int i;
+
+    for (i = 0; server->queue_ctx && i < server->max_queues; i++) {
+        if (server->queue_ctx[i]) {
+            aio_context_acquire(server->queue_ctx[i]);
+        }
+    }
+}
+
+static void vu_release_queue_ctxs(VuServer *server)
+{
+    int i;
+
+    for (i = 0; server->queue_ctx && i < server->max_queues; i++) {
+        if (server->queue_ctx[i]) {
+            aio_context_release(server->queue_ctx[i]);
+        }
+    }
+}
+
+/* Keep the virtqueues out while vu_client_trip() touches libvhost-user state */
+static void vu_lock_queues(VuServer *server)
+{
+    if (!server->queues_locked) {
+        vu_acquire_queue_ctxs(server);
+        server->queues_locked = true;
+    }
+}
+
+static void vu_unlock_queues(VuServer *server)
+{
+    if (server->queues_locked) {
+        server->queues_locked = false;
+        vu_release_queue_ctxs(server);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -102,6 +164,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
     QIOChannel *ioc = server->ioc;
 
+    /* Let the virtqueues run while waiting for the next message */
+    vu_unlock_queues(server);
+
     vmsg->fd_num = 0;
     if (!ioc) {
         error_report_err(local_err);
@@ -175,6 +240,7 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    vu_lock_queues(server);
     return true;
 
 fail:
@@ -192,15 +258,25 @@ static coroutine_fn void vu_client_trip(void *opaque)
         /* Keep running */
     }
 
-    if (server->refcount) {
-        /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
+    /* Kicks that are still pending must not start new requests */
+    vu_lock_queues(server);
+    server->kicks_stopped = true;
+    vu_unlock_queues(server);
+
+    /* Wait for requests to complete before we can unmap the memory */
+    qatomic_set(&server->wait_idle, true);
+    smp_mb(); /* pairs with the atomic decrement in vhost_user_server_unref() */
+    if (qatomic_read(&server->refcount) == 0 &&
+        qatomic_xchg(&server->wait_idle, false)) {
+        /* Idle already and nobody is going to wake us up */
+    } else {
         qemu_coroutine_yield();
-        server->wait_idle = false;
     }
-    assert(server->refcount == 0);
+    assert(qatomic_read(&server->refcount) == 0);
 
+    vu_lock_queues(server);
     vu_deinit(vu_dev);
+    vu_unlock_queues(server);
 
     /* vu_deinit() should have called remove_watch() */
     assert(QTAILQ_EMPTY(&server->vu_fd_watches));
@@ -229,17 +305,41 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    AioContext *queue_ctx = vu_fd_watch->queue_ctx;
+
+    if (queue_ctx) {
+        aio_context_acquire(queue_ctx);
+    }
+
+    /*
+     * The watch may have been removed or the server detached from its
+     * AioContext by another thread after this handler was dispatched. A
+     * pending kick is picked up again once the fd handler is reinstalled.
+     */
+    if (!vu_fd_watch->cb || !server->ctx || server->kicks_stopped) {
+        goto out;
+    }
 
     vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
 
     /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
     if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
-
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+out:
+    if (queue_ctx) {
+        aio_context_release(queue_ctx);
+    }
 }
 
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    return vu_fd_watch->queue_ctx ?: server->ctx;
+}
+
+/* Called with vu_fd_watches_lock held */
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -262,6 +362,7 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     g_assert(fd >= 0);
     g_assert(cb);
 
+    QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
@@ -271,14 +372,25 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+
+        /* libvhost-user only watches kick fds, pvt is the virtqueue index */
+        if (server->queue_ctx) {
+            vu_fd_watch->queue_ctx = server->queue_ctx[(intptr_t)pvt];
+        }
+
+        qemu_socket_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd, true,
+                           kick_handler, NULL, NULL, NULL, vu_fd_watch);
     }
 }
 
+static void vu_fd_watch_free_bh(void *opaque)
+{
+    g_free(opaque);
+}
+
 
 static void remove_watch(VuDev *vu_dev, int fd)
 {
@@ -288,16 +400,29 @@ static void remove_watch(VuDev *vu_dev, int fd)
 
     server = container_of(vu_dev, VuServer, vu_dev);
 
+    QEMU_LOCK_GUARD(&server->vu_fd_watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true,
+    aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd, true,
                        NULL, NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+
+    if (vu_fd_watch->queue_ctx) {
+        /*
+         * kick_handler() may already have been dispatched in the queue's
+         * thread and be waiting for the AioContext lock. Free the watch from
+         * that thread once the handler has returned.
+         */
+        vu_fd_watch->cb = NULL;
+        aio_bh_schedule_oneshot(vu_fd_watch->queue_ctx, vu_fd_watch_free_bh,
+                                vu_fd_watch);
+    } else {
+        g_free(vu_fd_watch);
+    }
 }
 
 
@@ -327,6 +452,7 @@ static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
                                      NULL,
                                      NULL);
     server->sioc = sioc;
+    server->kicks_stopped = false;
     /*
      * Increase the object reference, so sioc will not freed by
      * qio_net_listener_channel_func which will call object_unref(OBJECT(sioc))
@@ -355,10 +481,16 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        vu_acquire_queue_ctxs(server);
+        qemu_mutex_lock(&server->vu_fd_watches_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, true,
                                NULL, NULL, NULL, NULL, vu_fd_watch);
         }
+        qemu_mutex_unlock(&server->vu_fd_watches_lock);
+        server->kicks_stopped = true;
+        vu_release_queue_ctxs(server);
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
@@ -369,6 +501,10 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    qemu_mutex_destroy(&server->vu_fd_watches_lock);
+    g_free(server->queue_ctx);
+    server->queue_ctx = NULL;
 }
 
 /*
@@ -388,7 +524,9 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 {
     VuFdWatch *vu_fd_watch;
 
+    vu_acquire_queue_ctxs(server);
     server->ctx = ctx;
+    vu_release_queue_ctxs(server);
 
     if (!server->sioc) {
         return;
@@ -396,10 +534,13 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 
     qio_channel_attach_aio_context(server->ioc, ctx);
 
+    qemu_mutex_lock(&server->vu_fd_watches_lock);
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                           vu_fd_watch->fd, true, kick_handler, NULL,
                            NULL, NULL, vu_fd_watch);
     }
+    qemu_mutex_unlock(&server->vu_fd_watches_lock);
 
     aio_co_schedule(ctx, server->co_trip);
 }
@@ -407,24 +548,35 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 /* Called with server->ctx acquired */
 void vhost_user_server_detach_aio_context(VuServer *server)
 {
+    vu_acquire_queue_ctxs(server);
+
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        /*
+         * Kicks of virtqueues with their own AioContext are paused too, so
+         * that no new requests are submitted while the server is detached.
+         */
+        qemu_mutex_lock(&server->vu_fd_watches_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, true,
                                NULL, NULL, NULL, NULL, vu_fd_watch);
         }
+        qemu_mutex_unlock(&server->vu_fd_watches_lock);
 
         qio_channel_detach_aio_context(server->ioc);
     }
 
     server->ctx = NULL;
+    vu_release_queue_ctxs(server);
 }
 
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
@@ -455,6 +607,11 @@ bool vhost_user_server_start(VuServer *server,
         .ctx                   = ctx,
     };
 
+    if (queue_ctx) {
+        server->queue_ctx = g_memdup2(queue_ctx,
+                                      max_queues * sizeof(queue_ctx[0]));
+    }
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,
@@ -462,6 +619,7 @@ bool vhost_user_server_start(VuServer *server,
                                      server,
                                      NULL);
 
+    qemu_mutex_init(&server->vu_fd_watches_lock);
     QTAILQ_INIT(&server->vu_fd_watches);
     return true;
 }